@@ -13,9 +13,17 @@
 ** along with this program. If not, see <http://www.gnu.org/licenses/>.
 **********************************************************************/
 
-#include <QSignalSpy>
+#include <QMetaMethod>
+#include <QPointer>
+#include <chrono>
+#include <cstring>
 
 #include "modbus.h"
+#include "modbuscore.h"
+#include "modbusframing.h"
+#ifdef Q_OS_LINUX
+#include "modbustermiosport.h"
+#endif
 
 ModBus::ModBus(QObject *parent, QString interface, bool debug) : QObject(parent)
 {
@@ -26,16 +34,52 @@ ModBus::ModBus(QObject *parent, QString interface, bool debug) : QObject(parent)
     }
     m_interface = interface;
     m_debug = debug;
+    qRegisterMetaType<ModBusRegisterView>("ModBusRegisterView");
+    qRegisterMetaType<ModBusTimestamps>("ModBusTimestamps");
+    qRegisterMetaType<QMap<quint8, QByteArray> >("QMap<quint8,QByteArray>");
     m_port = new QSerialPort(interface, this);
+    m_termiosPort = NULL;
     m_transactionPending = false;
     m_currentTelegram = NULL;
+    ModBusCoreMaster::Io io = { this, &ModBus::coreWrite, &ModBus::coreRead, &ModBus::coreNowUs, &ModBus::coreResponseLength, &ModBus::coreFrameReceived };
+    m_master = new ModBusCoreMaster(io);
+    m_batchQueue = NULL;
+    m_collectingBatch = NULL;
+    for (int i = 0; i < 256; i++)
+        m_readWriteFusion[i] = false;
     m_telegramRepeatCount = 2;
     m_rx_telegrams = 0;
     m_crc_errors = 0;
-
-    // This timer notifies about a telegram timeout if a unit does not answer
+    m_dropped_bytes = 0;
+    m_resynchronizing = false;
+    m_capture = NULL;
+    m_captureChannel = 0;
+    m_replayMode = false;
+    m_snifferMode = false;
+    m_sniffedRequest = NULL;
+    m_serverMode = false;
+    for (int i = 0; i < 256; i++)
+        m_serverBanks[i] = NULL;
+    m_serverForeignAddress = 0;
+    m_serverForeignFunctionCode = 0;
+    m_futuresEnabled = false;
+    m_reconnect = true;
+    m_portDown = false;
+    m_failurePolicy = FAILURE_KEEP_QUEUE;
+    m_echoMode = ECHO_OFF;
+    m_echoDecided = false;
+    m_echoPresent = false;
+    m_baudrate = QSerialPort::Baud9600;
+    m_dataBits = QSerialPort::Data8;
+    m_parity = QSerialPort::NoParity;
+    m_stopBits = QSerialPort::TwoStop;
+    registerBuiltinFunctionCodeHandlers();
+
+    // This timer polls the master at its next timeout if no bytes arrive before
+    m_requestTimeout = 5000;    // was 200
+    m_broadcastTurnaroundDelay = 100;
     m_requestTimer.setSingleShot(true);
-    m_requestTimer.setInterval(5000);  // was 200
+    m_requestTimer.setTimerType(Qt::PreciseTimer);
     connect(&m_requestTimer, SIGNAL(timeout()), this, SLOT(slot_requestTimer_fired()));
 
     // This timer delays tx after rx to wait for line clearance
@@ -48,13 +92,27 @@ ModBus::ModBus(QObject *parent, QString interface, bool debug) : QObject(parent)
     m_rxIdleTimer.setSingleShot(true);
     m_rxIdleTimer.setInterval(100); // was 100
     connect(&m_rxIdleTimer, SIGNAL(timeout()), this, SLOT(slot_rxIdleTimer_fired()));
+
+    // This timer reopens a failed port
+    m_reconnectDelayMinimum = 50;
+    m_reconnectDelayMaximum = 1000;
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, SIGNAL(timeout()), this, SLOT(slot_reconnectTimer_fired()));
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 8, 0)
+    connect(m_port, SIGNAL(errorOccurred(QSerialPort::SerialPortError)), this, SLOT(slot_portError(QSerialPort::SerialPortError)));
+#else
+    connect(m_port, SIGNAL(error(QSerialPort::SerialPortError)), this, SLOT(slot_portError(QSerialPort::SerialPortError)));
+#endif
 }
 
 ModBus::~ModBus()
 {
-    if (m_port->isOpen())
+    if (portIsOpen())
         this->close();
     delete m_port;
+    delete m_sniffedRequest;
+    delete m_master;
 
     if (m_debug)
     {
@@ -71,19 +129,61 @@ bool ModBus::open(qint32 baudrate, QSerialPort::DataBits dataBits, QSerialPort::
         fflush(stdout);
     }
 
-    m_port->setBaudRate(baudrate);
+    m_baudrate = baudrate;
+    m_dataBits = dataBits;
+    m_parity = parity;
+    m_stopBits = stopBits;
+    m_reconnectTimer.stop();
+
+    bool openOK = openPort();
+    if (openOK && m_portDown)
+    {
+        m_portDown = false;
+        slot_tryToSendNextTelegram();   // Telegrams kept while the port was down
+    }
+    return openOK;
+}
+
+bool ModBus::openPort()
+{
+    // The adapter may have been exchanged
+    m_echoDecided = false;
+    m_expectedEcho.clear();
+
+#ifdef Q_OS_LINUX
+    if (m_termiosPort != NULL)
+    {
+        bool openOK = m_termiosPort->open(m_baudrate, m_dataBits, m_parity, m_stopBits);
+        if (!openOK && m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBus::open: %s.\n", m_termiosPort->errorString().toLocal8Bit().constData());
+            fflush(stdout);
+        }
+        if (openOK && (m_echoMode == ECHO_AUTO))
+            queueEchoProbe();
+        return openOK;
+    }
+#endif
+
+    if (m_port->isOpen())
+        m_port->close();
+    m_port->clearError();
+
+    m_port->setBaudRate(m_baudrate);
 
-    m_port->setDataBits(dataBits);
-    m_port->setParity(parity);
-    m_port->setStopBits(stopBits);
+    m_port->setDataBits(m_dataBits);
+    m_port->setParity(m_parity);
+    m_port->setStopBits(m_stopBits);
     m_port->setFlowControl(QSerialPort::NoFlowControl);
-    connect(m_port, SIGNAL(readyRead()), this, SLOT(slot_readyRead()));
+    connect(m_port, SIGNAL(readyRead()), this, SLOT(slot_readyRead()), Qt::UniqueConnection);
     bool openOK = m_port->open(QIODevice::ReadWrite);
     m_port->setBreakEnabled(false);
     m_port->setTextModeEnabled(false);
 
 //    QThread::msleep(10000);
 
+    if (openOK && (m_echoMode == ECHO_AUTO))
+        queueEchoProbe();
     return openOK;
 }
 
@@ -94,8 +194,289 @@ void ModBus::close()
         fprintf(stdout, "DEBUG ModBus::close().\n");
         fflush(stdout);
     }
+    m_reconnectTimer.stop();
+#ifdef Q_OS_LINUX
+    if (m_termiosPort != NULL)
+        m_termiosPort->close();
+#endif
+    if (m_port->isOpen())
+        m_port->close();
+}
+
+bool ModBus::setTermiosBackend(bool on, int realtimePriority, int interFrameGapMicroseconds)
+{
+#ifdef Q_OS_LINUX
+    if (portIsOpen())
+        return false;
+
+    delete m_termiosPort;
+    m_termiosPort = NULL;
+    if (on)
+    {
+        m_termiosPort = new ModBusTermiosPort(this, m_interface, m_debug);
+        m_termiosPort->setRealtimePriority(realtimePriority);
+        m_termiosPort->setInterFrameGap(interFrameGapMicroseconds);
+        // Emitted on the I/O thread, so these are queued connections
+        connect(m_termiosPort, SIGNAL(signal_frameReceived(QByteArray,qint64)), this, SLOT(slot_frameReceived(QByteArray,qint64)));
+        connect(m_termiosPort, SIGNAL(signal_deviceLost(QString)), this, SLOT(slot_termiosDeviceLost(QString)));
+    }
+    return true;
+#else
+    Q_UNUSED(realtimePriority);
+    Q_UNUSED(interFrameGapMicroseconds);
+    return !on;
+#endif
+}
+
+bool ModBus::portIsOpen() const
+{
+#ifdef Q_OS_LINUX
+    if (m_termiosPort != NULL)
+        return m_termiosPort->isOpen();
+#endif
+    return m_port->isOpen();
+}
+
+void ModBus::portWrite(const char *data, int length)
+{
+#ifdef Q_OS_LINUX
+    if (m_termiosPort != NULL)
+    {
+        m_termiosPort->write(QByteArray(data, length));
+        return;
+    }
+#endif
+    // QSerialPort writes the buffer out from the event loop; flush() would block it until the bytes are gone
+    m_port->write(data, length);
+}
+
+void ModBus::setEchoMode(EchoMode mode)
+{
+    m_echoMode = mode;
+    m_echoDecided = false;
+    m_echoPresent = (mode == ECHO_ON);
+    m_expectedEcho.clear();
+    if ((mode == ECHO_AUTO) && portIsOpen())
+        queueEchoProbe();
+}
+
+void ModBus::queueEchoProbe()
+{
+    // Server, sniffer and replay never drive the bus themselves
+    if (m_serverMode || m_snifferMode || m_replayMode)
+        return;
+
+    // Diagnostics to the reserved address 248; no slave answers, so whatever comes back is the echo of the adapter
+    ModBusTelegram* probe = new ModBusTelegram(248, 0x08, QByteArray(4, 0), 1);
+    probe->echoProbe = true;
+    probe->requestTimeout = rxIdleTimeout();
+    encodeTelegram(probe);
+
+    // First in line; the port is quiet right after opening
+    m_telegramQueueMutex.lock();
+    m_telegramQueue_highPriority.prepend(probe);
+    bool start = !m_transactionPending && !m_portDown;
+    m_telegramQueueMutex.unlock();
+    if (start)
+        slot_tryToSendNextTelegram();
+}
+
+void ModBus::finishEchoProbe()
+{
+    // Nothing at all came back, so the adapter does not echo. Anything else leaves the decision to the first transaction.
+    if (!m_echoDecided && (m_currentTelegram->responseTimeNs < 0) && m_readBuffer.isEmpty())
+    {
+        m_echoDecided = true;
+        m_echoPresent = false;
+    }
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::finishEchoProbe: Local echo on %s %s.\n", m_interface.toLocal8Bit().constData(),
+                m_echoDecided ? (m_echoPresent ? "detected" : "not present") : "undecided");
+        fflush(stdout);
+    }
+
+    m_rxIdleTimer.stop();
+    m_expectedEcho.clear();
+    m_readBuffer.clear();
+    m_currentTelegram->repeatCount = 0;
+    emit signal_transactionFinished();
+}
+
+bool ModBus::echoDetected() const
+{
+    return m_echoPresent;
+}
+
+void ModBus::setReconnect(bool on, int minimumDelayMilliseconds, int maximumDelayMilliseconds)
+{
+    m_reconnect = on;
+    m_reconnectDelayMinimum = qMax(1, minimumDelayMilliseconds);
+    m_reconnectDelayMaximum = qMax(m_reconnectDelayMinimum, maximumDelayMilliseconds);
+    if (!on)
+        m_reconnectTimer.stop();
+}
+
+void ModBus::setFailurePolicy(FailurePolicy policy)
+{
+    m_failurePolicy = policy;
+}
+
+bool ModBus::isPortDown() const
+{
+    return m_portDown;
+}
+
+void ModBus::slot_portError(QSerialPort::SerialPortError error)
+{
+    // Errors of a port that is already down come from reopening it and are handled by the reconnect timer
+    if (m_portDown)
+        return;
+
+    switch (error)
+    {
+    case QSerialPort::DeviceNotFoundError:
+    case QSerialPort::PermissionError:
+    case QSerialPort::ReadError:
+    case QSerialPort::WriteError:
+    case QSerialPort::ResourceError:    // Adapter unplugged or reset
+        // Reported synchronously from write() or later from the event loop; the telegram being written must stay valid until they return
+        if (m_portFailure.isEmpty())
+        {
+            m_portFailure = m_port->errorString();
+            if (m_portFailure.isEmpty())
+                m_portFailure = QString("Serial port error %1").arg((int)error);
+            QMetaObject::invokeMethod(this, "slot_portFailure", Qt::QueuedConnection);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void ModBus::slot_portFailure()
+{
+    QString errorString = m_portFailure;
+    m_portFailure.clear();
+
+    // The port may have been closed meanwhile
+    if (!m_portDown && m_port->isOpen())
+        portFailed(errorString);
+}
+
+void ModBus::slot_termiosDeviceLost(QString errorString)
+{
+    if (!m_portDown)
+        portFailed(errorString);
+}
+
+void ModBus::portFailed(QString errorString)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::portFailed: %s: %s\n", m_interface.toLocal8Bit().constData(), errorString.toLocal8Bit().constData());
+        fflush(stdout);
+    }
+
+    m_portDown = true;
+    m_master->abort();
+    m_requestTimer.stop();
+    m_delayTxTimer.stop();
+    m_rxIdleTimer.stop();
+#ifdef Q_OS_LINUX
+    if (m_termiosPort != NULL)
+        m_termiosPort->close();
+#endif
     if (m_port->isOpen())
         m_port->close();
+    m_readBuffer.clear();
+    m_expectedEcho.clear();
+
+    QList<ModBusTelegram*> failed;
+
+    m_telegramQueueMutex.lock();
+    ModBusTelegram* interrupted = m_currentTelegram;
+    m_currentTelegram = NULL;
+    m_transactionPending = false;
+
+    // A telegram that has completed only waited for the line clearance time
+    if ((interrupted != NULL) && (interrupted->timestamps.completed != 0))
+    {
+        delete interrupted;
+        interrupted = NULL;
+    }
+
+    if (m_failurePolicy == FAILURE_KEEP_QUEUE)
+    {
+        // The interrupted transmission does not count as an attempt
+        if (interrupted != NULL)
+        {
+            interrupted->repeatCount++;
+            if (m_batchQueue != NULL)
+                m_batchQueue->prepend(interrupted);
+            else
+                m_telegramQueue_highPriority.prepend(interrupted);
+        }
+    }
+    else
+    {
+        if (interrupted != NULL)
+            failed.append(interrupted);
+        failed.append(m_telegramQueue_highPriority);
+        failed.append(m_telegramQueue_standardPriority);
+        m_telegramQueue_highPriority.clear();
+        m_telegramQueue_standardPriority.clear();
+        m_batchQueue = NULL;
+    }
+    m_telegramQueueMutex.unlock();
+
+    emit signal_portError(errorString);
+    failTelegrams(failed);
+
+    if (m_reconnect)
+        m_reconnectTimer.start(m_reconnectDelayMinimum);
+}
+
+void ModBus::failTelegrams(QList<ModBusTelegram *> telegrams)
+{
+    // Called without the lock; continuations may enqueue new telegrams
+    foreach (ModBusTelegram* telegram, telegrams)
+    {
+        if (telegram->echoProbe)
+        {
+            delete telegram;
+            continue;
+        }
+        resolveFuture(telegram, ModBusFuture::STATE_LOST);
+        emit signal_transactionLost(telegram->getID());
+        if (!telegram->fusedRead.isNull())
+        {
+            resolveFuture(telegram->fusedRead.data(), ModBusFuture::STATE_LOST);
+            emit signal_transactionLost(telegram->fusedRead->getID());
+        }
+        delete telegram;
+    }
+}
+
+void ModBus::slot_reconnectTimer_fired()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::slot_reconnectTimer_fired() after %i ms.\n", m_reconnectTimer.interval());
+        fflush(stdout);
+    }
+
+    if (!openPort())
+    {
+        m_reconnectTimer.start(qMin(m_reconnectTimer.interval() * 2, m_reconnectDelayMaximum));
+        return;
+    }
+
+    m_portDown = false;
+    emit signal_portReopened();
+
+    // Sent right away; the line has been quiet while the port was down
+    slot_tryToSendNextTelegram();
 }
 
 void ModBus::setDelayTxTimer(quint32 milliseconds)
@@ -103,6 +484,21 @@ void ModBus::setDelayTxTimer(quint32 milliseconds)
     m_delayTxTimer.setInterval(milliseconds);
 }
 
+void ModBus::setRequestTimeout(quint32 milliseconds)
+{
+    m_requestTimeout = milliseconds;
+}
+
+int ModBus::rxIdleTimeout() const
+{
+    return m_rxIdleTimer.interval();
+}
+
+void ModBus::setBroadcastTurnaroundDelay(quint32 milliseconds)
+{
+    m_broadcastTurnaroundDelay = milliseconds;
+}
+
 quint64 ModBus::sendRawRequest(quint8 slaveAddress, quint8 functionCode, QByteArray payload)
 {
     if (m_debug)
@@ -120,17 +516,49 @@ QByteArray ModBus::sendRawRequestBlocking(quint8 slaveAddress, quint8 functionCo
         fprintf(stdout, "DEBUG ModBus::sendRawRequestBlocking(). +++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
         fflush(stdout);
     }
-    QSignalSpy spy(this, SIGNAL(signal_responseRawComplete(quint64, QByteArray)));
 
-    writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount));
+    // Wait for the response of exactly this telegram, not for whatever response comes next
+    ModBusFuture future = sendRawRequestAsync(slaveAddress, functionCode, payload);
     QByteArray response;
-    if (spy.wait(10000))
+    if (future.waitForFinished(10000))
+        response = future.response();
+
+    return response;
+}
+
+ModBusFuture ModBus::sendRawRequestAsync(quint8 slaveAddress, quint8 functionCode, QByteArray payload)
+{
+    if (m_debug)
     {
-        QList<QVariant> arguments = spy.takeFirst();
-        response = arguments.at(1).toByteArray();
+        fprintf(stdout, "DEBUG ModBus::sendRawRequestAsync().\n");
+        fflush(stdout);
     }
+    ModBusTelegram* telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    QSharedPointer<ModBusFutureState> state(new ModBusFutureState(telegram->getID(), slaveAddress, functionCode, this->thread()));
+    telegram->futureState = state;
+    writeTelegramToQueue(telegram);
+    return ModBusFuture(state);
+}
 
-    return response;
+void ModBus::setFuturesEnabled(bool on)
+{
+    m_telegramQueueMutex.lock();
+    m_futuresEnabled = on;
+    if (!on)
+    {
+        m_futures.clear();
+        m_finishedFutureIDs.clear();
+    }
+    m_telegramQueueMutex.unlock();
+}
+
+ModBusFuture ModBus::future(quint64 telegramID)
+{
+    // Fetching hands the future over to the caller, the bus does not keep it anymore
+    m_telegramQueueMutex.lock();
+    QSharedPointer<ModBusFutureState> state = m_futures.take(telegramID);
+    m_telegramQueueMutex.unlock();
+    return ModBusFuture(state);
 }
 
 quint64 ModBus::readCoils(quint8 slaveAddress, quint16 dataStartAddress, quint16 count, quint8 functionCode)
@@ -141,14 +569,12 @@ quint64 ModBus::readCoils(quint8 slaveAddress, quint16 dataStartAddress, quint16
         fflush(stdout);
     }
 
-    QByteArray payload;
-
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadRequest(adu, sizeof(adu), slaveAddress, functionCode, dataStartAddress, count);
+    if (size == 0)
+        return 0;   // Nothing to read or more than fit into one response
 
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram);
@@ -162,14 +588,12 @@ quint64 ModBus::readDiscreteInputs(quint8 slaveAddress, quint16 dataStartAddress
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadRequest(adu, sizeof(adu), slaveAddress, functionCode, dataStartAddress, count);
+    if (size == 0)
+        return 0;   // Nothing to read or more than fit into one response
 
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
-
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram);
@@ -183,14 +607,12 @@ quint64 ModBus::readHoldingRegisters(quint8 slaveAddress, quint16 dataStartAddre
         fflush(stdout);
     }
 
-    QByteArray payload;
-
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadRequest(adu, sizeof(adu), slaveAddress, functionCode, dataStartAddress, count);
+    if (size == 0)
+        return 0;   // Nothing to read or more than fit into one response
 
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram);
@@ -204,14 +626,12 @@ quint64 ModBus::readInputRegisters(quint8 slaveAddress, quint16 dataStartAddress
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadRequest(adu, sizeof(adu), slaveAddress, functionCode, dataStartAddress, count);
+    if (size == 0)
+        return 0;   // Nothing to read or more than fit into one response
 
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
-
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram);
@@ -225,14 +645,10 @@ quint64 ModBus::writeSingleCoil(quint8 slaveAddress, quint16 dataAddress, bool o
         fflush(stdout);
     }
 
-    QByteArray payload;
-
-    payload += (unsigned char)(dataAddress >> 8);
-    payload += (unsigned char)(dataAddress & 0xff);
-    payload += (unsigned char)(on ? 0xff : 0x00);
-    payload += (unsigned char)0x00;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteSingle(adu, sizeof(adu), slaveAddress, functionCode, dataAddress, on ? 0xff00 : 0x0000);
 
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = 1;
     telegram->requestedDataStartAddress = dataAddress;
     return writeTelegramToQueue(telegram, true);
@@ -246,14 +662,10 @@ quint64 ModBus::writeSingleRegister(quint8 slaveAddress, quint16 dataAddress, qu
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteSingle(adu, sizeof(adu), slaveAddress, functionCode, dataAddress, data);
 
-    payload += (unsigned char)(dataAddress >> 8);
-    payload += (unsigned char)(dataAddress & 0xff);
-    payload += (unsigned char)(data >> 8);
-    payload += (unsigned char)(data & 0xff);
-
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = 1;
     telegram->requestedDataStartAddress = dataAddress;
     return writeTelegramToQueue(telegram, true);
@@ -267,9 +679,10 @@ quint64 ModBus::readExceptionStatus(quint8 slaveAddress, quint8 functionCode)
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeRequest(adu, sizeof(adu), slaveAddress, functionCode, NULL, 0);
 
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount));
+    return writeTelegramToQueue(telegramFromAdu(adu, size));
 }
 
 quint64 ModBus::readDiagnosticCounter(quint8 slaveAddress, quint8 subFunctionCode, QByteArray data, quint8 functionCode)
@@ -280,13 +693,12 @@ quint64 ModBus::readDiagnosticCounter(quint8 slaveAddress, quint8 subFunctionCod
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeDiagnostics(adu, sizeof(adu), slaveAddress, subFunctionCode, (const uint8_t*)data.constData(), data.size(), functionCode);
+    if (size == 0)
+        return 0;   // More data than fit into one request
 
-    payload += (unsigned char)(subFunctionCode >> 8);
-    payload += (unsigned char)(subFunctionCode & 0xff);
-    payload += data;
-
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount), true);
+    return writeTelegramToQueue(telegramFromAdu(adu, size), true);
 }
 
 quint64 ModBus::getCommEventCounter(quint8 slaveAddress, quint8 functionCode)
@@ -297,9 +709,10 @@ quint64 ModBus::getCommEventCounter(quint8 slaveAddress, quint8 functionCode)
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeRequest(adu, sizeof(adu), slaveAddress, functionCode, NULL, 0);
 
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount), true);
+    return writeTelegramToQueue(telegramFromAdu(adu, size), true);
 }
 
 quint64 ModBus::getCommEventLog(quint8 slaveAddress, quint8 functionCode)
@@ -310,9 +723,10 @@ quint64 ModBus::getCommEventLog(quint8 slaveAddress, quint8 functionCode)
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeRequest(adu, sizeof(adu), slaveAddress, functionCode, NULL, 0);
 
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount), true);
+    return writeTelegramToQueue(telegramFromAdu(adu, size), true);
 }
 
 quint64 ModBus::writeMultipleCoils(quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on, quint8 functionCode)
@@ -323,46 +737,92 @@ quint64 ModBus::writeMultipleCoils(quint8 slaveAddress, quint16 dataStartAddress
         fflush(stdout);
     }
 
-    QByteArray payload;
-
+    if ((on.count() == 0) || (on.count() > 1968))
+        return 0;   // No coils or more than fit into one request
     quint16 count = on.count();
 
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
-    unsigned char bytes = count / 8;
-    if ((count % 8) != 0) bytes += 1;
-    payload += bytes;
+    uint8_t packed[MODBUSCORE_MAX_ADU_SIZE];
+    memset(packed, 0, (count + 7) / 8);
+    for (int i = 0; i < count; i++)
+    {
+        if (on.at(i))
+            packed[i >> 3] |= 1 << (i & 7);
+    }
 
-    quint8 bit = 0;
-    quint8 byte = 0;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteMultipleCoils(adu, sizeof(adu), slaveAddress, dataStartAddress, packed, count, functionCode);
 
-    while (!on.isEmpty())
-    {
-        if (on.at(0))
-            byte += 1 << bit;
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
+    telegram->requestedCount = count;
+    telegram->requestedDataStartAddress = dataStartAddress;
+    return writeTelegramToQueue(telegram, true);
+}
 
-        on.removeFirst();
+quint64 ModBus::writeMultipleCoils(quint8 slaveAddress, quint16 dataStartAddress, const QBitArray &on, quint8 functionCode)
+{
+    return writeMultipleCoilsPacked(slaveAddress, dataStartAddress, on.size(), packBits(on), functionCode);
+}
 
-        bit++;
-        if (bit == 8)
-        {
-            bit = 0;
-            payload += byte;
-            byte = 0;
-        }
+quint64 ModBus::writeMultipleCoilsPacked(quint8 slaveAddress, quint16 dataStartAddress, quint16 count, QByteArray packed, quint8 functionCode)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::writeMultipleCoilsPacked().\n");
+        fflush(stdout);
     }
 
-    if (bit != 0)
-        payload += byte;
+    if ((count == 0) || (count > 1968))
+        return 0;   // No coils or more than fit into one request
+
+    // Missing bytes of a short packed array are sent as zero
+    uint8_t bits[MODBUSCORE_MAX_ADU_SIZE];
+    int bytes = (count + 7) / 8;
+    int available = qMin(bytes, packed.size());
+    memcpy(bits, packed.constData(), available);
+    memset(bits + available, 0, bytes - available);
 
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteMultipleCoils(adu, sizeof(adu), slaveAddress, dataStartAddress, bits, count, functionCode);
+
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram, true);
 }
 
+QByteArray ModBus::packBits(const QBitArray &bits)
+{
+    // QBitArray stores its bits in the same order as the wire, bit 0 first in the lowest bit
+#if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
+    return QByteArray(bits.bits(), (bits.size() + 7) / 8);
+#else
+    QByteArray packed((bits.size() + 7) / 8, 0);
+    for (int i = 0; i < bits.size(); i++)
+    {
+        if (bits.testBit(i))
+            packed[i >> 3] = packed.at(i >> 3) | (1 << (i & 7));
+    }
+    return packed;
+#endif
+}
+
+QBitArray ModBus::unpackBits(const QByteArray &packed, int count)
+{
+    if (count > packed.size() * 8)
+        count = packed.size() * 8;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
+    return QBitArray::fromBits(packed.constData(), count);
+#else
+    QBitArray bits(count);
+    for (int i = 0; i < count; i++)
+    {
+        if ((packed.at(i >> 3) >> (i & 7)) & 1)
+            bits.setBit(i);
+    }
+    return bits;
+#endif
+}
+
 quint64 ModBus::writeMultipleRegisters(quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data, quint8 functionCode)
 {
     if (m_debug)
@@ -371,25 +831,18 @@ quint64 ModBus::writeMultipleRegisters(quint8 slaveAddress, quint16 dataStartAdd
         fflush(stdout);
     }
 
-    QByteArray payload;
-
+    if ((data.count() == 0) || (data.count() > 123))
+        return 0;   // No registers or more than fit into one request
     quint16 count = data.count();
 
-    payload += (unsigned char)(dataStartAddress >> 8);
-    payload += (unsigned char)(dataStartAddress & 0xff);
-    payload += (unsigned char)(count >> 8);
-    payload += (unsigned char)(count & 0xff);
-    unsigned char bytes = count * 2;
-    payload += bytes;
+    uint16_t words[123];
+    for (int i = 0; i < count; i++)
+        words[i] = data.at(i);
 
-    while (!data.isEmpty())
-    {
-        quint16 word = data.takeFirst();
-        payload += (unsigned char)(word >> 8);
-        payload += (unsigned char)(word & 0xff);
-    }
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteMultipleRegisters(adu, sizeof(adu), slaveAddress, dataStartAddress, words, count, functionCode);
 
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = count;
     telegram->requestedDataStartAddress = dataStartAddress;
     return writeTelegramToQueue(telegram, true);
@@ -403,9 +856,54 @@ quint64 ModBus::reportSlaveID(quint8 slaveAddress, quint8 functionCode)
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeRequest(adu, sizeof(adu), slaveAddress, functionCode, NULL, 0);
+
+    return writeTelegramToQueue(telegramFromAdu(adu, size), true);
+}
+
+quint64 ModBus::readFileRecord(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, quint8 recordLength, quint8 functionCode)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::readFileRecord().\n");
+        fflush(stdout);
+    }
+
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadFileRecord(adu, sizeof(adu), slaveAddress, fileNumber, recordNumber, recordLength, functionCode);
+    if (size == 0)
+        return 0;   // No register or more than fit into one response
+
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
+    telegram->requestedCount = recordLength;
+    telegram->requestedDataStartAddress = recordNumber;
+    return writeTelegramToQueue(telegram);
+}
+
+quint64 ModBus::writeFileRecord(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, QList<quint16> data, quint8 functionCode)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::writeFileRecord().\n");
+        fflush(stdout);
+    }
+
+    if ((data.count() == 0) || (data.count() > 122))
+        return 0;   // No register or more than fit into one request
+    quint16 recordLength = data.count();
+
+    uint16_t words[122];
+    for (int i = 0; i < recordLength; i++)
+        words[i] = data.at(i);
 
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount), true);
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeWriteFileRecord(adu, sizeof(adu), slaveAddress, fileNumber, recordNumber, words, recordLength, functionCode);
+
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
+    telegram->requestedCount = recordLength;
+    telegram->requestedDataStartAddress = recordNumber;
+    return writeTelegramToQueue(telegram);
 }
 
 quint64 ModBus::maskWriteRegister(quint8 slaveAddress, quint16 dataAddress, quint16 andMask, quint16 orMask, quint8 functionCode)
@@ -416,69 +914,231 @@ quint64 ModBus::maskWriteRegister(quint8 slaveAddress, quint16 dataAddress, quin
         fflush(stdout);
     }
 
-    QByteArray payload;
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeMaskWriteRegister(adu, sizeof(adu), slaveAddress, dataAddress, andMask, orMask, functionCode);
 
-    payload += (unsigned char)(dataAddress >> 8);
-    payload += (unsigned char)(dataAddress & 0xff);
-    payload += (unsigned char)(andMask >> 8);
-    payload += (unsigned char)(andMask & 0xff);
-    payload += (unsigned char)(orMask >> 8);
-    payload += (unsigned char)(orMask & 0xff);
-
-    ModBusTelegram *telegram = new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount);
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
     telegram->requestedCount = 1;
     telegram->requestedDataStartAddress = dataAddress;
     return writeTelegramToQueue(telegram, true);
 }
 
-quint64 ModBus::readFIFOqueue(quint8 slaveAddress, quint16 fifoPointerAddress, quint8 functionCode)
+quint64 ModBus::readWriteMultipleRegisters(quint8 slaveAddress, quint16 readStartAddress, quint8 readCount, quint16 writeStartAddress, QList<quint16> writeData, quint8 functionCode)
 {
     if (m_debug)
     {
-        fprintf(stdout, "DEBUG ModBus::readFIFOqueue().\n");
+        fprintf(stdout, "DEBUG ModBus::readWriteMultipleRegisters().\n");
         fflush(stdout);
     }
 
-    QByteArray payload;
+    if ((readCount == 0) || (readCount > 125) || (writeData.count() == 0) || (writeData.count() > 121))
+        return 0;   // Nothing to read or write, or more than fit into one request
+    quint16 writeCount = writeData.count();
+
+    uint16_t words[121];
+    for (int i = 0; i < writeCount; i++)
+        words[i] = writeData.at(i);
 
-    payload += (unsigned char)(fifoPointerAddress >> 8);
-    payload += (unsigned char)(fifoPointerAddress & 0xff);
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), slaveAddress, readStartAddress, readCount, writeStartAddress, words, writeCount, functionCode);
 
-    return writeTelegramToQueue(new ModBusTelegram(slaveAddress, functionCode, payload, m_telegramRepeatCount), true);
+    // Requested address and count describe the read part, which is what the response carries
+    ModBusTelegram *telegram = telegramFromAdu(adu, size);
+    telegram->requestedCount = readCount;
+    telegram->requestedDataStartAddress = readStartAddress;
+    return writeTelegramToQueue(telegram, true);
 }
 
-int ModBus::getSizeOfTelegramQueue(bool highPriorityQueue)
+quint64 ModBus::encapsulatedInterfaceTransport(quint8 slaveAddress, quint8 meiType, QByteArray data, quint8 functionCode)
 {
-    m_telegramQueueMutex.lock();
-    int size;
-    if (highPriorityQueue)
-        size = m_telegramQueue_highPriority.length();
-    else
-        size = m_telegramQueue_standardPriority.length();
-    m_telegramQueueMutex.unlock();
-    return size;
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::encapsulatedInterfaceTransport().\n");
+        fflush(stdout);
+    }
+
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeEncapsulatedInterfaceTransport(adu, sizeof(adu), slaveAddress, meiType, (const uint8_t*)data.constData(), data.size(), functionCode);
+    if (size == 0)
+        return 0;   // More data than fit into one request
+
+    return writeTelegramToQueue(telegramFromAdu(adu, size));
 }
 
-void ModBus::clearTelegramQueue(bool highPriorityQueue)
+quint64 ModBus::readDeviceIdentification(quint8 slaveAddress, quint8 readDeviceIdCode, quint8 objectId, quint8 functionCode)
 {
-    m_telegramQueueMutex.lock();
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::readDeviceIdentification().\n");
+        fflush(stdout);
+    }
+
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadDeviceIdentification(adu, sizeof(adu), slaveAddress, readDeviceIdCode, objectId, functionCode);
+    if (size == 0)
+        return 0;   // Unknown read device id code
+
+    return writeTelegramToQueue(telegramFromAdu(adu, size));
+}
+
+bool ModBus::parseDeviceIdentification(const QByteArray &payload, quint8 *conformityLevel, bool *moreFollows, quint8 *nextObjectId, QMap<quint8, QByteArray> *objects)
+{
+    // The core decodes whole ADUs; it does not look at address and CRC
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE] = { 0x00, 0x2b };
+    if ((payload.length() < 6) || (payload.length() + 4 > (int)sizeof(adu)))
+        return false;
+    memcpy(adu + 2, payload.constData(), payload.length());
+
+    ModBusCore::DeviceIdentification identification;
+    ModBusCore::DeviceIdentificationObject decoded[MODBUSCORE_MAX_ADU_SIZE / 2];
+    int count = ModBusCore::decodeDeviceIdentification(adu, payload.length() + 4, &identification, decoded, sizeof(decoded) / sizeof(decoded[0]));
+    if (count < 0)
+        return false;
+
+    *conformityLevel = identification.conformityLevel;
+    *moreFollows = identification.moreFollows;
+    *nextObjectId = identification.nextObjectId;
+    for (int i = 0; i < count; i++)
+        objects->insert(decoded[i].id, QByteArray((const char*)decoded[i].value, decoded[i].length));
+    return true;
+}
+
+quint64 ModBus::readFIFOqueue(quint8 slaveAddress, quint16 fifoPointerAddress, quint8 functionCode)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::readFIFOqueue().\n");
+        fflush(stdout);
+    }
+
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadFIFOQueue(adu, sizeof(adu), slaveAddress, fifoPointerAddress, functionCode);
+
+    return writeTelegramToQueue(telegramFromAdu(adu, size), true);
+}
+
+void ModBus::setReadWriteFusion(quint8 slaveAddress, bool supported)
+{
+    m_readWriteFusion[slaveAddress] = supported;
+}
+
+void ModBus::beginBatch(ModBusBatch *batch)
+{
+    m_collectingBatch = batch;
+}
+
+void ModBus::endBatch()
+{
+    m_collectingBatch = NULL;
+}
+
+bool ModBus::submitBatch(ModBusBatch *batch, ModBusBatch::Order order, bool highPriority)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::submitBatch() with %i telegrams.\n", batch->m_entries.count());
+        fflush(stdout);
+    }
+
+    if (batch->m_submitted)
+        return false;
+
+    if (m_collectingBatch == batch)
+        m_collectingBatch = NULL;
+
+    QList<ModBusBatch::Entry> entries = batch->m_entries;
+    batch->m_entries.clear();
+    batch->m_submitted = true;
+    batch->m_pending = entries.count();
+
+    if (entries.isEmpty())
+    {
+        emit batch->signal_finished(true, QList<quint64>());
+        return true;
+    }
+
+    // Every telegram reports to the batch through its future; set up before anything can be sent
+    QPointer<ModBusBatch> batchPointer(batch);
+    for (int i = 0; i < entries.count(); i++)
+    {
+        ModBusTelegram* telegram = entries.at(i).telegram;
+        if (telegram->adu.isEmpty())
+            encodeTelegram(telegram);
+        telegram->timestamps.enqueued = monotonicNs();
+        if (telegram->futureState.isNull())
+            telegram->futureState = QSharedPointer<ModBusFutureState>(new ModBusFutureState(telegram->getID(), telegram->slaveAddress, telegram->functionCode, this->thread()));
+        if (order == ModBusBatch::ORDER_CONTIGUOUS)
+            telegram->batchContinues = (i < entries.count() - 1);
+
+        ModBusFuture future(telegram->futureState);
+        batch->m_futures.append(future);
+        future.then([batchPointer](const ModBusFuture &future) {
+            if (!batchPointer.isNull())
+                batchPointer->telegramFinished(future);
+        });
+    }
+
+    m_telegramQueueMutex.lock();
+    foreach (const ModBusBatch::Entry &entry, entries)
+    {
+        if (m_futuresEnabled)
+            m_futures.insert(entry.telegram->getID(), entry.telegram->futureState);
+
+        bool toHighPriorityQueue = (order == ModBusBatch::ORDER_ANY) ? entry.highPriority : highPriority;
+        if (toHighPriorityQueue)
+            m_telegramQueue_highPriority.append(entry.telegram);
+        else
+            m_telegramQueue_standardPriority.append(entry.telegram);
+    }
+
+    if (!m_transactionPending) // If we inserted the first packets, we have to start the sending process
+    {
+        m_telegramQueueMutex.unlock();
+        slot_tryToSendNextTelegram();
+    }
+    else
+    {
+        m_telegramQueueMutex.unlock();
+    }
+
+    return true;
+}
+
+int ModBus::getSizeOfTelegramQueue(bool highPriorityQueue)
+{
+    m_telegramQueueMutex.lock();
+    int size;
+    if (highPriorityQueue)
+        size = m_telegramQueue_highPriority.length();
+    else
+        size = m_telegramQueue_standardPriority.length();
+    m_telegramQueueMutex.unlock();
+    return size;
+}
+
+void ModBus::clearTelegramQueue(bool highPriorityQueue)
+{
+    QList<ModBusTelegram*> telegrams;
+
+    m_telegramQueueMutex.lock();
     if (highPriorityQueue)
     {
-        foreach (ModBusTelegram* telegram, m_telegramQueue_highPriority)
-        {
-            delete telegram;
-        }
+        telegrams = m_telegramQueue_highPriority;
         m_telegramQueue_highPriority.clear();
     }
     else
     {
-        foreach (ModBusTelegram* telegram, m_telegramQueue_standardPriority)
-        {
-            delete telegram;
-        }
+        telegrams = m_telegramQueue_standardPriority;
         m_telegramQueue_standardPriority.clear();
     }
     m_telegramQueueMutex.unlock();
+
+    // Futures are resolved outside the lock, their continuations may enqueue new telegrams
+    foreach (ModBusTelegram* telegram, telegrams)
+    {
+        resolveFuture(telegram, ModBusFuture::STATE_CANCELED);
+        delete telegram;
+    }
 }
 
 
@@ -490,8 +1150,30 @@ void ModBus::slot_tryToSendNextTelegram()
         fflush(stdout);
     }
     m_telegramQueueMutex.lock();
-    // Delete last telegram if it exists
-    // If repeat counter is not zero, then repeat current telegram, otherwise take new
+    if (m_replayMode)   // Replay drives the current telegram itself
+    {
+        m_telegramQueueMutex.unlock();
+        return;
+    }
+
+    if (m_portDown)
+    {
+        // Kept telegrams wait for the reopened port, the others are lost right away
+        QList<ModBusTelegram*> failed;
+        if (m_failurePolicy == FAILURE_FAIL_QUEUE)
+        {
+            failed = m_telegramQueue_highPriority + m_telegramQueue_standardPriority;
+            m_telegramQueue_highPriority.clear();
+            m_telegramQueue_standardPriority.clear();
+        }
+        m_transactionPending = false;
+        m_telegramQueueMutex.unlock();
+        failTelegrams(failed);
+        return;
+    }
+
+    // Delete last telegram if it exists; the master has made all its attempts.
+    // Only a telegram interrupted before it finished is sent again, otherwise take new
     // telegram from the queue
     if ((m_currentTelegram != NULL) && (m_currentTelegram->repeatCount == 0))
     {
@@ -522,19 +1204,99 @@ void ModBus::slot_tryToSendNextTelegram()
             fprintf(stdout, "DEBUG ModBus::slot_tryToSendNextTelegram: Fetching new telegram from queue.\n");
             fflush(stdout);
         }
-        if (m_telegramQueue_highPriority.isEmpty())
-            m_currentTelegram = m_telegramQueue_standardPriority.takeFirst();
+        // A contiguous batch keeps the bus until its last telegram has been sent
+        QList<ModBusTelegram*>* queue;
+        if ((m_batchQueue != NULL) && !m_batchQueue->isEmpty())
+            queue = m_batchQueue;
+        else if (m_telegramQueue_highPriority.isEmpty())
+            queue = &m_telegramQueue_standardPriority;
         else
-            m_currentTelegram = m_telegramQueue_highPriority.takeFirst();
+            queue = &m_telegramQueue_highPriority;
+        m_currentTelegram = queue->takeFirst();
+        m_batchQueue = m_currentTelegram->batchContinues ? queue : NULL;
+        if (m_readWriteFusion[m_currentTelegram->slaveAddress] && (m_batchQueue == NULL))
+            tryToFuseReadWrite(queue);
     }
 
     m_transactionPending = true;
-    m_requestTimer.start();
     m_telegramQueueMutex.unlock();
 
     writeTelegramNow(m_currentTelegram);
 }
 
+void ModBus::tryToFuseReadWrite(QList<ModBusTelegram *> *queue)
+{
+    // Must be called with m_telegramQueueMutex locked, right after m_currentTelegram has been taken from queue.
+    // Only a read that is the very next telegram for the same slave may be fused, otherwise the order
+    // of operations on that slave would change. fc 0x17 executes the write before the read.
+    ModBusTelegram* write = m_currentTelegram;
+    quint16 writeStartAddress;
+    QByteArray writeValues;
+
+    if ((write->functionCode == 0x06) && (write->data.size() == 4))
+    {
+        writeStartAddress = write->requestedDataStartAddress;
+        writeValues = write->data.mid(2, 2);
+    }
+    else if ((write->functionCode == 0x10) && (write->requestedCount <= 121) && (write->data.size() == 5 + write->requestedCount * 2))
+    {
+        writeStartAddress = write->requestedDataStartAddress;
+        writeValues = write->data.mid(5);
+    }
+    else
+        return;
+
+    QList<QList<ModBusTelegram*>*> queues;
+    queues.append(queue);
+    if (queue == &m_telegramQueue_highPriority)
+        queues.append(&m_telegramQueue_standardPriority);
+
+    ModBusTelegram* read = NULL;
+    bool nextTelegramOfSlaveFound = false;
+    foreach (QList<ModBusTelegram*>* candidates, queues)
+    {
+        for (int i = 0; i < candidates->count(); i++)
+        {
+            ModBusTelegram* candidate = candidates->at(i);
+            if (candidate->slaveAddress != write->slaveAddress)
+                continue;
+            if ((candidate->functionCode == 0x03) && !candidate->batchContinues && (candidate->requestedCount >= 1) && (candidate->requestedCount <= 125))
+                read = candidates->takeAt(i);
+            nextTelegramOfSlaveFound = true;
+            break;
+        }
+        if (nextTelegramOfSlaveFound)
+            break;
+    }
+
+    if (read == NULL)
+        return;
+
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::tryToFuseReadWrite: Fusing telegrams %llu and %llu.\n", (unsigned long long)write->getID(), (unsigned long long)read->getID());
+        fflush(stdout);
+    }
+
+    quint16 writeCount = writeValues.size() / 2;
+    uint16_t words[121];
+    for (int i = 0; i < writeCount; i++)
+        words[i] = ((quint8)writeValues.at(i * 2) << 8) | (quint8)writeValues.at(i * 2 + 1);
+
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), write->slaveAddress, read->requestedDataStartAddress, read->requestedCount, writeStartAddress, words, writeCount);
+
+    // The write telegram keeps its id and becomes the combined transaction
+    write->functionCode = 0x17;
+    write->data = QByteArray((const char*)adu + 2, (int)size - 4);
+    write->adu = QByteArray((const char*)adu, (int)size);
+    write->requestedDataStartAddress = read->requestedDataStartAddress;
+    write->requestedCount = read->requestedCount;
+    write->fusedRead = QSharedPointer<ModBusTelegram>(read);
+    if (m_functionCodeHandlers[0x17].encoderInstalled)
+        encodeTelegram(write);
+}
+
 quint64 ModBus::writeTelegramToQueue(ModBusTelegram *telegram, bool highPriority)
 {
     if (m_debug)
@@ -542,8 +1304,27 @@ quint64 ModBus::writeTelegramToQueue(ModBusTelegram *telegram, bool highPriority
         fprintf(stdout, "DEBUG ModBus::writeTelegramToQueue().\n");
         fflush(stdout);
     }
+    // Encoded here, so the scheduler only has to write the frame when the line is free.
+    // The high level calls hand over frames built by the core, unless an installed encoder may change them.
+    if (telegram->adu.isEmpty() || m_functionCodeHandlers[telegram->functionCode & 0x7f].encoderInstalled)
+        encodeTelegram(telegram);
+    if (telegram->adu.isEmpty())
+    {
+        delete telegram;
+        return 0;   // Does not fit into one ADU
+    }
+    telegram->timestamps.enqueued = monotonicNs();
+
+    if (m_collectingBatch != NULL)
+        return m_collectingBatch->append(telegram, highPriority);
+
     quint64 telegramID = telegram->getID();
     m_telegramQueueMutex.lock();
+    if (m_futuresEnabled && telegram->futureState.isNull())
+    {
+        telegram->futureState = QSharedPointer<ModBusFutureState>(new ModBusFutureState(telegramID, telegram->slaveAddress, telegram->functionCode, this->thread()));
+        m_futures.insert(telegramID, telegram->futureState);
+    }
     if (highPriority)
         m_telegramQueue_highPriority.append(telegram);
     else
@@ -573,6 +1354,21 @@ quint64 ModBus::writeTelegramToQueue(ModBusTelegram *telegram, bool highPriority
     return telegramID;
 }
 
+QString ModBus::interfaceName() const
+{
+    return m_interface;
+}
+
+qint64 ModBus::monotonicNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ModBusTimestamps ModBus::currentTimestamps() const
+{
+    return m_currentTimestamps;
+}
+
 int ModBus::getTelegramRepeatCount() const
 {
     return m_telegramRepeatCount;
@@ -590,7 +1386,13 @@ quint64 ModBus::rx_telegrams() const
 
 quint64 ModBus::crc_errors() const
 {
-    return m_crc_errors;
+    // Client transactions are counted by the master
+    return m_crc_errors + m_master->crcErrors();
+}
+
+quint64 ModBus::dropped_bytes() const
+{
+    return m_dropped_bytes;
 }
 
 QString ModBus::exceptionToText(quint8 exceptionCode)
@@ -619,6 +1421,136 @@ QString ModBus::exceptionToText(quint8 exceptionCode)
     }
 }
 
+void ModBus::setCapture(ModBusCapture *capture, quint8 channel)
+{
+    m_capture = capture;
+    m_captureChannel = channel;
+}
+
+void ModBus::setReplayMode(bool on)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::setReplayMode(%i).\n", on);
+        fflush(stdout);
+    }
+    m_telegramQueueMutex.lock();
+    m_replayMode = on;
+    m_master->abort();
+    m_requestTimer.stop();
+    m_delayTxTimer.stop();
+    m_rxIdleTimer.stop();
+    m_readBuffer.clear();
+    ModBusTelegram* telegram = m_currentTelegram;
+    m_currentTelegram = NULL;
+    m_transactionPending = false;
+    m_telegramQueueMutex.unlock();
+
+    if (telegram != NULL)
+    {
+        resolveFuture(telegram, ModBusFuture::STATE_CANCELED);
+        delete telegram;
+    }
+}
+
+void ModBus::replayTransmittedFrame(const QByteArray &adu)
+{
+    if (!m_replayMode || (adu.size() < 4))
+        return;
+
+    // A new request while the last one is still open means the original transaction got no answer
+    if (m_currentTelegram != NULL)
+    {
+        if (m_currentTelegram->needsAnswer())
+            emit signal_transactionLost(m_currentTelegram->getID());
+        delete m_currentTelegram;
+        m_currentTelegram = NULL;
+    }
+
+    ModBusTelegram* telegram = new ModBusTelegram(adu.at(0), adu.at(1), adu.mid(2, adu.size() - 4), 0);
+    telegram->adu = adu;
+    telegram->adu.detach();     // adu may point into a mapped capture file
+    if ((telegram->functionCode >= 0x01) && (telegram->functionCode <= 0x04) && (telegram->data.size() >= 4))
+    {
+        telegram->requestedDataStartAddress = ((quint8)telegram->data.at(0) << 8) | (quint8)telegram->data.at(1);
+        telegram->requestedCount = ((quint8)telegram->data.at(2) << 8) | (quint8)telegram->data.at(3);
+    }
+
+    m_currentTelegram = telegram;
+    m_transactionPending = true;
+}
+
+void ModBus::replayReceivedFrame(const QByteArray &adu)
+{
+    if (!m_replayMode || (m_currentTelegram == NULL) || (adu.size() < 4))
+        return;
+
+    if (!checksumOK(adu))
+    {
+        m_crc_errors++;
+        return;
+    }
+
+    // A frame of another slave or for another function leaves the request open
+    if (((quint8)adu.at(0) != m_currentTelegram->slaveAddress) || (((quint8)adu.at(1) & 0x7f) != (m_currentTelegram->functionCode & 0x7f)))
+        return;
+
+    QByteArray frame = adu;
+    frame.detach();     // adu may point into a mapped capture file
+    responseReceived(frame);
+
+    delete m_currentTelegram;
+    m_currentTelegram = NULL;
+    m_transactionPending = false;
+}
+
+void ModBus::setSnifferMode(bool on)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::setSnifferMode(%i).\n", on);
+        fflush(stdout);
+    }
+    m_snifferMode = on;
+    m_readBuffer.clear();
+    if (m_sniffedRequest != NULL)
+    {
+        delete m_sniffedRequest;
+        m_sniffedRequest = NULL;
+    }
+}
+
+bool ModBus::snifferMode() const
+{
+    return m_snifferMode;
+}
+
+void ModBus::setServerAddress(quint8 slaveAddress, ModBusRegisterBank *bank)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::setServerAddress(%i).\n", slaveAddress);
+        fflush(stdout);
+    }
+
+    if (slaveAddress == 0)  // Broadcast address can not be served
+        return;
+
+    m_serverBanks[slaveAddress] = bank;
+    m_serverMode = false;
+    for (int i = 1; i < 256; i++)
+    {
+        if (m_serverBanks[i] != NULL)
+            m_serverMode = true;
+    }
+    m_readBuffer.clear();
+}
+
+bool ModBus::serverMode() const
+{
+    return m_serverMode;
+}
+
 quint64 ModBus::writeTelegramNow(ModBusTelegram *telegram)
 {
     if (m_debug)
@@ -626,12 +1558,21 @@ quint64 ModBus::writeTelegramNow(ModBusTelegram *telegram)
         fprintf(stdout, "DEBUG ModBus::writeTelegramNow().\n");
         fflush(stdout);
     }
-    quint8 slaveAddress = telegram->slaveAddress;
-    quint8 functionCode = telegram->functionCode;
-    QByteArray data = telegram->data;
-    telegram->repeatCount--;
 
-    writeTelegramRawNow(slaveAddress, functionCode, data);
+    // Normally encoded when queued; telegrams handed over otherwise are encoded now
+    if (telegram->adu.isEmpty())
+        encodeTelegram(telegram);
+
+    // The master repeats the request on its own; every attempt goes through coreWrite()
+    int timeout = (telegram->requestTimeout > 0) ? telegram->requestTimeout : m_requestTimeout;
+    m_master->abort();
+    m_master->setBroadcastTurnaroundDelay(m_broadcastTurnaroundDelay * 1000);
+    // The termios backend delivers whole frames after the gap; QSerialPort delivers bytes as they come
+    m_master->setInterFrameTimeout((m_termiosPort != NULL) ? 0 : rxIdleTimeout() * 1000);
+    if (!m_master->start((const uint8_t*)telegram->adu.constData(), telegram->adu.size(), timeout * 1000, telegram->repeatCount))
+        finishTransaction(ModBusCoreMaster::STATE_LOST);
+    else
+        pollMaster();
     return telegram->getID();
 }
 
@@ -652,325 +1593,1198 @@ void ModBus::writeTelegramRawNow(quint8 slaveAddress, quint8 functionCode, QByte
     out.append(cs & 0xFF);
     out.append(cs >> 8);
 
-    if (m_port->isOpen())
-    {
-        if (m_debug)
-        {
-            fprintf(stdout, "ModBus::writeTelegramRawNow: Writing: %s\n", out.toHex().data());
-            fflush(stdout);
-        }
-        m_port->write(out);
-        m_port->flush();
-    }
+    writeAduNow(out);
 }
 
-void ModBus::tryToParseResponseRaw(QByteArray *buffer)
+void ModBus::writeAduNow(const QByteArray &adu)
 {
-    if (buffer->size() < 4)
-        return;
-
-    if (m_debug)
-    {
-        fprintf(stdout, "ModBus::tryToParseResponseRaw: Reading: %s\n", buffer->toHex().data());
-        fflush(stdout);
-    }
-
-    if (m_currentTelegram == nullptr)
+    if (portIsOpen() && !m_snifferMode)    // A sniffer must never drive the bus
     {
         if (m_debug)
         {
-            fprintf(stdout, "ModBus::tryToParseResponseRaw: Response does not belong to a request. Parse abort.\n");
+            fprintf(stdout, "ModBus::writeAduNow: Writing: %s\n", adu.toHex().data());
             fflush(stdout);
         }
-        buffer->clear();
-        return;
-    }
+        portWrite(adu.constData(), adu.size());
 
-    quint8 address = buffer->at(0);
-    quint8 functionCode = buffer->at(1) & 0x7F;
-    bool exception = buffer->at(1) & 0x80;
+        if ((m_echoMode == ECHO_ON) || ((m_echoMode == ECHO_AUTO) && (!m_echoDecided || m_echoPresent)))
+            m_expectedEcho = adu;
+        if (m_capture != NULL)
+            m_capture->record(ModBusCapture::DIRECTION_TX, m_captureChannel, adu);
+    }
+}
 
-    // Check address match here in case we are Modbus server
-    // if(server)
-    // {...}
+bool ModBus::stripEcho(bool frameComplete)
+{
+    // Returns false while it is not yet known whether the received bytes are echo or response
+    if (m_expectedEcho.isEmpty() || m_readBuffer.isEmpty())
+        return true;
 
-    if (exception)
+    if ((m_echoMode == ECHO_AUTO) && !m_echoDecided)
     {
-        if (buffer->size() < 5)
+        int size = qMin(m_readBuffer.size(), m_expectedEcho.size());
+        if (m_readBuffer.left(size) != m_expectedEcho.left(size))
         {
-            if (m_debug)
-            {
-                fprintf(stdout, "ModBus::tryToParseResponseRaw: Buffer size below 5 byte: %s\n", buffer->toHex().data());
-                fflush(stdout);
-            }
-            return;
+            // Nobody answers the probe, so a difference is noise or another transmitter and proves nothing
+            if ((m_currentTelegram == NULL) || !m_currentTelegram->echoProbe)
+                m_echoDecided = true;
+            m_echoPresent = false;
+            m_expectedEcho.clear();
+            return true;
         }
-
-        quint8 exceptionCode = buffer->at(2);
-        if (!checksumOK(*buffer))
+        if (m_readBuffer.size() < m_expectedEcho.size())
         {
-            buffer->clear();
-            m_crc_errors++;
-            if (m_debug)
-            {
-                fprintf(stdout, "ModBus::tryToParseResponseRaw: Received exception and have CRC error.\n");
-                fflush(stdout);
-            }
-            return;
+            if (frameComplete)
+                m_expectedEcho.clear();
+            return frameComplete;
         }
 
-        m_requestTimer.stop();
-        m_rx_telegrams++;
+        // The response of these codes equals the request; only a longer reception proves an echo.
+        // A single copy is kept until the next frame arrives or the request times out.
+        if (echoUndecided())
+            return false;
 
+        m_echoDecided = true;
+        m_echoPresent = true;
         if (m_debug)
         {
-            fprintf(stdout, "ModBus::tryToParseResponseRaw: Got exception, sending it upstream.\n");
+            fprintf(stdout, "DEBUG ModBus::stripEcho: Local echo detected on %s.\n", m_interface.toLocal8Bit().constData());
             fflush(stdout);
         }
-
-        // Parse exception here and send signal!
-        emit signal_exception(m_currentTelegram->getID(), exceptionCode);
-        emit signal_responseRawComplete(m_currentTelegram->getID(), *buffer);
-        emit signal_transactionFinished();
-        buffer->clear();
-        return;
     }
 
-    // Try to check length here (todo!)
-    if (buffer->length() > 255)
+    int size = qMin(m_readBuffer.size(), m_expectedEcho.size());
+    if (m_readBuffer.left(size) != m_expectedEcho.left(size))
     {
-        buffer->clear();
+        // Another transmitter was active at the same time; the slave did not get our request intact
+        quint64 telegramID = (m_currentTelegram != NULL) ? m_currentTelegram->getID() : 0;
         if (m_debug)
         {
-            fprintf(stdout, "ModBus::tryToParseResponseRaw: Buffer overflow error.\n");
+            fprintf(stdout, "DEBUG ModBus::stripEcho: Collision, sent %s, received %s.\n", m_expectedEcho.toHex().constData(), m_readBuffer.left(size).toHex().constData());
             fflush(stdout);
         }
-        return;
+        emit signal_collision(telegramID, m_expectedEcho, m_readBuffer.left(size));
+        m_expectedEcho.clear();
+        m_readBuffer.clear();
+        return false;
     }
 
-    if (!checksumOK(*buffer))
+    m_readBuffer.remove(0, size);
+    m_expectedEcho.remove(0, size);
+
+    // The response time is measured from the first byte after the echo
+    if ((m_currentTelegram != NULL) && m_expectedEcho.isEmpty())
     {
-        buffer->clear();
-        m_crc_errors++;
-        if (m_debug)
+        if (m_readBuffer.isEmpty())
         {
-            fprintf(stdout, "ModBus::tryToParseResponseRaw: CRC error.\n");
-            fflush(stdout);
+            m_currentTelegram->responseTimeNs = -1;
+            m_currentTelegram->timestamps.firstByteReceived = 0;
         }
+        else
+            stampFirstByteReceived(monotonicNs());
+    }
+    return true;
+}
+
+bool ModBus::echoUndecided() const
+{
+    // Received exactly the request of a function whose response equals the request, while echo presence is unknown
+    if ((m_echoMode != ECHO_AUTO) || m_echoDecided || (m_expectedEcho.size() < 2) || (m_readBuffer != m_expectedEcho))
+        return false;
+    if ((m_currentTelegram != NULL) && m_currentTelegram->echoProbe)
+        return false;   // Nobody answers the probe, a copy of it is the echo
+    quint8 functionCode = m_expectedEcho.at(1);
+    return (functionCode == 0x05) || (functionCode == 0x06) || (functionCode == 0x08) || (functionCode == 0x15);
+}
+
+ModBusTelegram *ModBus::telegramFromAdu(const uint8_t *adu, size_t size)
+{
+    ModBusTelegram* telegram = new ModBusTelegram(adu[0], adu[1], QByteArray((const char*)adu + 2, (int)size - 4), m_telegramRepeatCount);
+    telegram->adu = QByteArray((const char*)adu, (int)size);
+    return telegram;
+}
+
+void ModBus::encodeTelegram(ModBusTelegram *telegram)
+{
+    const FunctionCodeHandler &handler = m_functionCodeHandlers[telegram->functionCode & 0x7f];
+    if (handler.encoder)
+        handler.encoder(telegram);
+
+    // Requests beyond the Modbus ADU limit are left empty and refused
+    uint8_t buffer[MODBUSCORE_MAX_ADU_SIZE];
+    size_t size = ModBusCore::encodeRequest(buffer, sizeof(buffer), telegram->slaveAddress, telegram->functionCode, (const uint8_t*)telegram->data.constData(), telegram->data.size());
+    telegram->adu = QByteArray((const char*)buffer, (int)size);
+}
+
+void ModBus::pollMaster()
+{
+    // Bytes after the end of a transaction do not belong to any request
+    if ((m_currentTelegram == NULL) || (m_master->state() != ModBusCoreMaster::STATE_WAITING))
+    {
+        m_readBuffer.clear();
+        return;
+    }
+
+    ModBusCoreMaster::State state = m_master->poll();
+    if (state != ModBusCoreMaster::STATE_WAITING)
+    {
+        finishTransaction(state);
         return;
     }
 
-    // If we reach this code, checksum is ok
+    // Woken up at the next timeout of the master, unless bytes arrive before
+    qint64 remaining = (qint64)m_master->nextPollUs() - (qint64)coreNowUs(this);
+    m_requestTimer.start(qMax<qint64>(0, (remaining + 999) / 1000));
+}
 
+void ModBus::finishTransaction(ModBusCoreMaster::State state)
+{
     m_requestTimer.stop();
+    m_currentTelegram->repeatCount = 0; // Finished, lost or failed; the master has made all attempts
+
+    if (m_currentTelegram->echoProbe)
+    {
+        finishEchoProbe();
+        return;
+    }
+
+    if ((state == ModBusCoreMaster::STATE_FINISHED) || (state == ModBusCoreMaster::STATE_EXCEPTION))
+    {
+        if (m_currentTelegram->needsAnswer())
+        {
+            responseReceived(QByteArray((const char*)m_master->response(), (int)m_master->responseSize()));
+            return;
+        }
+
+        stampCompleted(m_currentTelegram);
+        resolveFuture(m_currentTelegram, ModBusFuture::STATE_FINISHED);   // Broadcast timeslot is over
+    }
+    else
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBus::finishTransaction: Telegram %llu %s.\n", (unsigned long long)m_currentTelegram->getID(), (state == ModBusCoreMaster::STATE_IO_ERROR) ? "not sent" : "lost");
+            fflush(stdout);
+        }
+        stampCompleted(m_currentTelegram);
+        resolveFuture(m_currentTelegram, ModBusFuture::STATE_LOST);
+        emit signal_transactionLost(m_currentTelegram->getID());
+        if (!m_currentTelegram->fusedRead.isNull())
+        {
+            resolveFuture(m_currentTelegram->fusedRead.data(), ModBusFuture::STATE_LOST);
+            emit signal_transactionLost(m_currentTelegram->fusedRead->getID());
+        }
+    }
+    emit signal_transactionFinished();
+}
+
+void ModBus::responseReceived(const QByteArray &frame)
+{
+    // The frame has a valid CRC and answers the current telegram
     m_rx_telegrams++;
-    QByteArray data = buffer->mid(2, buffer->length() - 4); // Fill data with PDU
+    stampCompleted(m_currentTelegram);
+    m_currentTelegram->repeatCount = 0; // Do not send it again, as we have an answer now
+
+    quint8 address = frame.at(0);
+    quint8 functionCode = frame.at(1) & 0x7F;
+
+    if (frame.at(1) & 0x80)
+    {
+        quint8 exceptionCode = frame.at(2);
+        if (m_debug)
+        {
+            fprintf(stdout, "ModBus::responseReceived: Got exception, sending it upstream.\n");
+            fflush(stdout);
+        }
+
+        resolveFuture(m_currentTelegram, ModBusFuture::STATE_EXCEPTION, frame, exceptionCode);
+        emit signal_exception(m_currentTelegram->getID(), exceptionCode);
+        if (!m_currentTelegram->fusedRead.isNull())
+        {
+            resolveFuture(m_currentTelegram->fusedRead.data(), ModBusFuture::STATE_EXCEPTION, frame, exceptionCode);
+            emit signal_exception(m_currentTelegram->fusedRead->getID(), exceptionCode);
+        }
+        emit signal_responseRawComplete(m_currentTelegram->getID(), frame);
+        emit signal_transactionFinished();
+        return;
+    }
+
+    QByteArray data = frame.mid(2, frame.length() - 4); // Fill data with PDU
 
     if (m_debug)
     {
-        fprintf(stdout, "ModBus::tryToParseResponseRaw: Ok, sending data upstream.\n");
+        fprintf(stdout, "ModBus::responseReceived: Ok, sending data upstream.\n");
         fflush(stdout);
     }
 
-    m_currentTelegram->repeatCount = 0; // Do not send it again, as we have an answer now
-
-    emit signal_responseRawComplete(m_currentTelegram->getID(), *buffer);
+    resolveFuture(m_currentTelegram, ModBusFuture::STATE_FINISHED, frame);
+    if (!m_currentTelegram->fusedRead.isNull())  // Response data of fc 0x17 has the same layout as of fc 0x03
+        resolveFuture(m_currentTelegram->fusedRead.data(), ModBusFuture::STATE_FINISHED, frame);
+    emit signal_responseRawComplete(m_currentTelegram->getID(), frame);
     emit signal_responseRaw(m_currentTelegram->getID(), address, functionCode, data);
-    parseResponse(m_currentTelegram->getID(), address, functionCode, data);
+    parseResponse(m_currentTelegram, address, functionCode, data, frame);
     emit signal_transactionFinished();
+}
+
+int ModBus::coreWrite(void *context, const uint8_t *data, size_t length)
+{
+    ModBus* bus = static_cast<ModBus*>(context);
+    ModBusTelegram* telegram = bus->m_currentTelegram;
+    if ((telegram == NULL) || !bus->portIsOpen() || bus->m_snifferMode)    // A sniffer must never drive the bus
+        return -1;
+    Q_UNUSED(data);
 
-    buffer->clear();
+    // One attempt; the master sends a copy of the telegram's ADU, whose shared buffer is written so that echo check and capture need no copy
+    telegram->repeatCount--;
+    telegram->responseTimeNs = -1;
+    telegram->timestamps.firstByteReceived = 0;
+    telegram->timestamps.completed = 0;
+    telegram->timestamps.transmitted = monotonicNs();
+    bus->m_rxIdleTimer.stop();
+    bus->m_readBuffer.clear();
+    bus->writeAduNow(telegram->adu);
+    return length;
 }
 
-void ModBus::parseResponse(quint64 telegramID, quint8 slaveAddress, quint8 functionCode, QByteArray payload)
+int ModBus::coreRead(void *context, uint8_t *data, size_t capacity)
 {
-    if (m_debug)
+    // Bytes that may still be the local echo are held back until stripEcho() has decided about them
+    ModBus* bus = static_cast<ModBus*>(context);
+    if (!bus->m_expectedEcho.isEmpty())
+        return 0;
+
+    int size = qMin((int)capacity, bus->m_readBuffer.size());
+    memcpy(data, bus->m_readBuffer.constData(), size);
+    bus->m_readBuffer.remove(0, size);
+    return size;
+}
+
+uint64_t ModBus::coreNowUs(void *context)
+{
+    Q_UNUSED(context);
+    return monotonicNs() / 1000;
+}
+
+int ModBus::coreResponseLength(void *context, const uint8_t *adu, size_t size)
+{
+    // Installed length calculators take part in framing
+    return static_cast<ModBus*>(context)->responseLength((const char*)adu, size);
+}
+
+void ModBus::coreFrameReceived(void *context, const uint8_t *adu, size_t size)
+{
+    ModBus* bus = static_cast<ModBus*>(context);
+    if (bus->m_debug)
     {
-        fprintf(stdout, "DEBUG ModBus::parseResponse() fc%i.\n", functionCode);
+        fprintf(stdout, "ModBus::coreFrameReceived: Reading: %s\n", QByteArray((const char*)adu, (int)size).toHex().data());
         fflush(stdout);
     }
+    if ((bus->m_capture != NULL) && (size >= 4))
+        bus->m_capture->record(ModBusCapture::DIRECTION_RX, bus->m_captureChannel, QByteArray((const char*)adu, (int)size));
+}
 
-    switch (functionCode)
-    {
-    case 1:
-    case 2:
+void ModBus::tryToParseSniffedFrames(QByteArray *buffer)
+{
+    // In sniffer mode requests and responses follow each other closely, so frames are cut
+    // out of the buffer as soon as they are complete instead of waiting for the bus to go idle.
+    while (buffer->size() >= 4)
     {
-        quint8 bytes;
-        quint16 dataStartAddress = m_currentTelegram->requestedDataStartAddress;
-        QList<bool> on;
+        quint8 address = buffer->at(0);
+        quint8 functionCode = buffer->at(1) & 0x7F;
+        bool needMoreBytes = false;
+
+        // A frame from the addressed slave with the same function code is the response, if it arrives in time
+        if ((m_sniffedRequest != NULL) &&
+                (m_sniffedRequest->slaveAddress == address) &&
+                (m_sniffedRequest->functionCode == functionCode) &&
+                (m_sniffedRequestTime.elapsed() <= m_requestTimeout))
+        {
+            int length = responseLength(buffer->constData(), buffer->size());
+            if (length == 0 || (length > buffer->size()))
+                needMoreBytes = true;
+            else if ((length > 0) && checksumOK(buffer->constData(), length))
+            {
+                m_resynchronizing = false;
+                sniffedResponse(buffer->left(length));
+                buffer->remove(0, length);
+                continue;
+            }
+        }
 
-        if (payload.length() < 1)
+        int length = ModBusFraming::requestLength(*buffer);
+        if (length == 0 || (length > buffer->size()))
+            needMoreBytes = true;
+        else if ((length > 0) && checksumOK(buffer->constData(), length))
         {
-            fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length < 1.\n", functionCode);
-            fflush(stdout);
-            break;
+            m_resynchronizing = false;
+            sniffedRequest(buffer->left(length));
+            buffer->remove(0, length);
+            continue;
         }
 
-        bytes = payload.at(0);
+        if (needMoreBytes && (buffer->size() < 256))
+            return;
 
-        if (payload.length() != (bytes + 1))
+        // Neither a valid request nor a valid response starts here; resynchronize byte by byte
+        if (m_debug)
         {
-            fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
+            fprintf(stdout, "ModBus::tryToParseSniffedFrames: Dropping byte %02x.\n", (quint8)buffer->at(0));
             fflush(stdout);
-            break;
         }
+        dropByteForResync(buffer);
+    }
+}
 
-        quint16 bit = 0;
-        quint8 byte = 0;
+void ModBus::sniffedRequest(const QByteArray &adu)
+{
+    if (m_capture != NULL)
+        m_capture->record(ModBusCapture::DIRECTION_TX, m_captureChannel, adu);
+
+    // The previous request did not get an answer in time
+    if (m_sniffedRequest != NULL)
+    {
+        if (m_sniffedRequest->needsAnswer())
+            emit signal_transactionLost(m_sniffedRequest->getID());
+        delete m_sniffedRequest;
+        m_sniffedRequest = NULL;
+    }
 
-        while (payload.length() > (byte + 1))
+    ModBusTelegram* telegram = new ModBusTelegram(adu.at(0), adu.at(1), adu.mid(2, adu.size() - 4), 0);
+    telegram->adu = adu;
+    const QByteArray &data = telegram->data;
+    switch (telegram->functionCode)
+    {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x0f:
+    case 0x10:
+        telegram->requestedDataStartAddress = ((quint8)data.at(0) << 8) | (quint8)data.at(1);
+        telegram->requestedCount = ((quint8)data.at(2) << 8) | (quint8)data.at(3);
+        break;
+    case 0x05:
+    case 0x06:
+    case 0x16:
+        telegram->requestedDataStartAddress = ((quint8)data.at(0) << 8) | (quint8)data.at(1);
+        telegram->requestedCount = 1;
+        break;
+    case 0x14:
+    case 0x15:
+        if (data.size() >= 8)   // First sub request only
         {
-            if (payload.at(byte + 1) & (1 << bit))
-                on.append(true);
-            else
-                on.append(false);
+            telegram->requestedDataStartAddress = ((quint8)data.at(4) << 8) | (quint8)data.at(5);
+            telegram->requestedCount = ((quint8)data.at(6) << 8) | (quint8)data.at(7);
+        }
+        break;
+    default:
+        break;
+    }
 
-            if (on.length() == m_currentTelegram->requestedCount)
-                break;
+    m_sniffedRequest = telegram;
+    m_sniffedRequestAdu = adu;
+    m_sniffedRequestTime.start();
 
-            bit++;
-            if (bit == 8)
+    if (!telegram->needsAnswer())
+        finishSniffedTransaction(QByteArray());
+}
+
+void ModBus::sniffedResponse(const QByteArray &adu)
+{
+    if (m_capture != NULL)
+        m_capture->record(ModBusCapture::DIRECTION_RX, m_captureChannel, adu);
+
+    m_rx_telegrams++;
+    quint8 address = adu.at(0);
+    quint8 functionCode = adu.at(1) & 0x7F;
+    quint64 telegramID = m_sniffedRequest->getID();
+
+    if (adu.at(1) & 0x80)
+    {
+        emit signal_exception(telegramID, adu.at(2));
+        finishSniffedTransaction(adu);
+        return;
+    }
+
+    QByteArray data = adu.mid(2, adu.length() - 4);
+    emit signal_responseRaw(telegramID, address, functionCode, data);
+    parseResponse(m_sniffedRequest, address, functionCode, data, adu);
+    finishSniffedTransaction(adu);
+}
+
+void ModBus::finishSniffedTransaction(const QByteArray &responseAdu)
+{
+    emit signal_sniffedTransaction(m_sniffedRequest->getID(), m_sniffedRequestAdu, responseAdu, m_sniffedRequestTime.nsecsElapsed());
+    delete m_sniffedRequest;
+    m_sniffedRequest = NULL;
+    m_sniffedRequestAdu.clear();
+}
+
+void ModBus::tryToParseServerRequests(QByteArray *buffer)
+{
+    // Requests are handled as soon as they are complete to stay within the turnaround budget.
+    // Responses of other slaves to foreign requests are recognized and skipped.
+    while (buffer->size() >= 4)
+    {
+        const char* adu = buffer->constData();
+        int size = buffer->size();
+        bool needMoreBytes = false;
+
+        int length = ModBusFraming::requestLength(adu, size);
+        if ((length == 0) || (length > size))
+            needMoreBytes = true;
+        else if ((length > 0) && checksumOK(adu, length))
+        {
+            quint8 address = adu[0];
+            m_resynchronizing = false;
+            if ((address == 0) || (m_serverBanks[address] != NULL))
             {
-                bit = 0;
-                byte++;
+                handleServerRequest(adu, length);
             }
+            else
+            {
+                m_serverForeignAddress = address;
+                m_serverForeignFunctionCode = adu[1];
+            }
+            buffer->remove(0, length);
+            continue;
         }
 
-        if (functionCode == 1)
-            emit signal_coilsRead(telegramID, slaveAddress, dataStartAddress, on);
-        else if (functionCode == 2)
-            emit signal_discreteInputsRead(telegramID, slaveAddress, dataStartAddress, on);
-        break;
+        if (((quint8)adu[0] == m_serverForeignAddress) && (((quint8)adu[1] & 0x7F) == m_serverForeignFunctionCode))
+        {
+            length = responseLength(adu, size);
+            if ((length == 0) || (length > size))
+                needMoreBytes = true;
+            else if ((length > 0) && checksumOK(adu, length))
+            {
+                m_resynchronizing = false;
+                m_serverForeignAddress = 0;
+                buffer->remove(0, length);
+                continue;
+            }
+        }
+
+        if (needMoreBytes && (size < 256))
+            return;
+
+        dropByteForResync(buffer);
     }
-    case 3:
-    case 4:
-    {
-        quint8 bytes;
-        quint16 dataStartAddress = m_currentTelegram->requestedDataStartAddress;
-        QList<quint16> data;
+}
+
+void ModBus::dropByteForResync(QByteArray *buffer)
+{
+    // One corrupted frame costs many dropped bytes, but only one CRC error
+    if (!m_resynchronizing)
+        m_crc_errors++;
+    m_resynchronizing = true;
+    m_dropped_bytes++;
+    buffer->remove(0, 1);
+}
+
+void ModBus::handleServerRequest(const char *adu, int length)
+{
+    quint8 address = adu[0];
+    ModBusRegisterBank::Table writtenTable = ModBusRegisterBank::TABLE_COILS;
+    quint16 writtenStart = 0;
+    quint16 writtenCount = 0;
+
+    m_rx_telegrams++;
+    if (m_capture != NULL)
+        m_capture->record(ModBusCapture::DIRECTION_RX, m_captureChannel, QByteArray(adu, length));
 
-        if (payload.length() < 1)
+    if (address == 0)
+    {
+        // Broadcast: execute on every served address, never answer
+        for (int i = 1; i < 256; i++)
         {
-            fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length < 1.\n", functionCode);
-            fflush(stdout);
-            break;
+            if (m_serverBanks[i] != NULL)
+                executeServerRequest(m_serverBanks[i], adu, length, m_serverResponse, &writtenTable, &writtenStart, &writtenCount);
         }
+    }
+    else
+    {
+        int responseLength = executeServerRequest(m_serverBanks[address], adu, length, m_serverResponse, &writtenTable, &writtenStart, &writtenCount);
+        quint16 cs = checksum(m_serverResponse, responseLength);
+        m_serverResponse[responseLength++] = cs & 0xFF;
+        m_serverResponse[responseLength++] = cs >> 8;
+
+        if (portIsOpen())
+            portWrite(m_serverResponse, responseLength);
+        if (m_capture != NULL)
+            m_capture->record(ModBusCapture::DIRECTION_TX, m_captureChannel, QByteArray(m_serverResponse, responseLength));
+    }
 
-        bytes = payload.at(0);
+    // Notify only after the response is on its way
+    if (writtenCount > 0)
+        emit signal_serverDataWritten(address, writtenTable, writtenStart, writtenCount);
+}
+
+int ModBus::executeServerRequest(ModBusRegisterBank *bank, const char *adu, int length, char *response, ModBusRegisterBank::Table *writtenTable, quint16 *writtenStart, quint16 *writtenCount)
+{
+    // Decodes the request, accesses the bank and encodes the response PDU without any allocation.
+    // Returns the length of the response without CRC.
+    const quint8* request = (const quint8*)adu;
+    quint8 functionCode = request[1];
+    quint8 exceptionCode = 0;
+    int responseLength = 2;
+    quint16 words[125];
+
+    response[0] = adu[0];
+    response[1] = functionCode;
+
+    // Most requests start with address and count or value; shorter ones do not use them
+    quint16 start = 0;
+    quint16 count = 0;
+    if (length >= 8)
+    {
+        start = (request[2] << 8) | request[3];
+        count = (request[4] << 8) | request[5];
+    }
 
-        if (payload.length() != (bytes + 1))
+    switch (functionCode)
+    {
+    case 0x01:
+    case 0x02:
+    {
+        ModBusRegisterBank::Table table = (functionCode == 0x01) ? ModBusRegisterBank::TABLE_COILS : ModBusRegisterBank::TABLE_DISCRETE_INPUTS;
+        if ((count < 1) || (count > 2000))
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
+        else if (!bank->readBits(table, start, count, (quint8*)response + 3))
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+        else
         {
-            fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
-            fflush(stdout);
-            break;
+            response[2] = (count + 7) / 8;
+            responseLength = 3 + (count + 7) / 8;
         }
-
-        if (payload.length() != (m_currentTelegram->requestedCount * 2 + 1))
+        break;
+    }
+    case 0x03:
+    case 0x04:
+    {
+        ModBusRegisterBank::Table table = (functionCode == 0x03) ? ModBusRegisterBank::TABLE_HOLDING_REGISTERS : ModBusRegisterBank::TABLE_INPUT_REGISTERS;
+        if ((count < 1) || (count > 125))
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
+        else if (!bank->readRegisters(table, start, count, words))
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+        else
         {
-            fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i requested length mismatch with resonse length.\n", functionCode);
-            fflush(stdout);
+            response[2] = count * 2;
+            for (quint16 i = 0; i < count; i++)
+            {
+                response[3 + i*2] = words[i] >> 8;
+                response[4 + i*2] = words[i] & 0xff;
+            }
+            responseLength = 3 + count * 2;
+        }
+        break;
+    }
+    case 0x05:
+    {
+        quint8 on = 0;
+        if (count == 0xFF00)
+            on = 1;
+        else if (count != 0x0000)
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
             break;
         }
-
-        for (quint16 i = 0; i < m_currentTelegram->requestedCount; i++)
+        if (!bank->writeBits(ModBusRegisterBank::TABLE_COILS, start, 1, &on))
         {
-            quint16 word = 0;
-            word += (quint8)payload.at(i*2 + 1) << 8;
-            word += (quint8)payload.at(i*2 + 2);
-            data.append(word);
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
         }
-
-        if (functionCode == 3)
-            emit signal_holdingRegistersRead(telegramID, slaveAddress, dataStartAddress, data);
-        else if (functionCode == 4)
-            emit signal_inputRegistersRead(telegramID, slaveAddress, dataStartAddress, data);
+        memcpy(response + 2, adu + 2, 4);   // Echo of the request
+        responseLength = 6;
+        *writtenTable = ModBusRegisterBank::TABLE_COILS;
+        *writtenStart = start;
+        *writtenCount = 1;
         break;
     }
-    case 5: // Single coil written
-        break;
-    case 6: // Single holding register written
-        break;
-    case 7:
-        break;
-    case 8:
-        break;
-    case 9:
-        break;
-    case 10:
-        break;
-    case 11:
-        break;
-    case 12:
+    case 0x06:
+        if (!bank->writeRegisters(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, start, 1, &count))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        memcpy(response + 2, adu + 2, 4);
+        responseLength = 6;
+        *writtenTable = ModBusRegisterBank::TABLE_HOLDING_REGISTERS;
+        *writtenStart = start;
+        *writtenCount = 1;
         break;
-    case 13:
+    case 0x0f:
+        if ((count < 1) || (count > 1968) || (request[6] != (count + 7) / 8))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
+            break;
+        }
+        if (!bank->writeBits(ModBusRegisterBank::TABLE_COILS, start, count, request + 7))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        memcpy(response + 2, adu + 2, 4);
+        responseLength = 6;
+        *writtenTable = ModBusRegisterBank::TABLE_COILS;
+        *writtenStart = start;
+        *writtenCount = count;
         break;
-    case 14:
+    case 0x10:
+        if ((count < 1) || (count > 123) || (request[6] != count * 2))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
+            break;
+        }
+        for (quint16 i = 0; i < count; i++)
+            words[i] = (request[7 + i*2] << 8) | request[8 + i*2];
+        if (!bank->writeRegisters(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, start, count, words))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        memcpy(response + 2, adu + 2, 4);
+        responseLength = 6;
+        *writtenTable = ModBusRegisterBank::TABLE_HOLDING_REGISTERS;
+        *writtenStart = start;
+        *writtenCount = count;
         break;
-    case 15: // Multiple coils written
+    case 0x16:
+    {
+        quint16 andMask = count;
+        quint16 orMask = (request[6] << 8) | request[7];
+        if (!bank->contains(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, start, 1))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        {
+            // Read-modify-write must not interleave with other writers
+            ModBusRegisterBank::Update update(bank, ModBusRegisterBank::TABLE_HOLDING_REGISTERS);
+            quint16 value = update.value(start);
+            update.setValue(start, (value & andMask) | (orMask & ~andMask));
+        }
+        memcpy(response + 2, adu + 2, 6);
+        responseLength = 8;
+        *writtenTable = ModBusRegisterBank::TABLE_HOLDING_REGISTERS;
+        *writtenStart = start;
+        *writtenCount = 1;
         break;
-    case 16: // Multiple holding registers written
+    }
+    case 0x17:
+    {
+        quint16 writeStart = (request[6] << 8) | request[7];
+        quint16 writeCount = (request[8] << 8) | request[9];
+        if ((count < 1) || (count > 125) || (writeCount < 1) || (writeCount > 121) || (request[10] != writeCount * 2))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_VALUE;
+            break;
+        }
+        if (!bank->contains(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, start, count) ||
+                !bank->contains(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, writeStart, writeCount))
+        {
+            exceptionCode = ModBusTelegram::E_ILLEGAL_DATA_ADDRESS;
+            break;
+        }
+        // The write operation is performed before the read
+        for (quint16 i = 0; i < writeCount; i++)
+            words[i] = (request[11 + i*2] << 8) | request[12 + i*2];
+        bank->writeRegisters(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, writeStart, writeCount, words);
+        bank->readRegisters(ModBusRegisterBank::TABLE_HOLDING_REGISTERS, start, count, words);
+        response[2] = count * 2;
+        for (quint16 i = 0; i < count; i++)
+        {
+            response[3 + i*2] = words[i] >> 8;
+            response[4 + i*2] = words[i] & 0xff;
+        }
+        responseLength = 3 + count * 2;
+        *writtenTable = ModBusRegisterBank::TABLE_HOLDING_REGISTERS;
+        *writtenStart = writeStart;
+        *writtenCount = writeCount;
         break;
+    }
     default:
+        exceptionCode = ModBusTelegram::E_ILLEGAL_FUNCTION;
         break;
+    }
+
+    if (exceptionCode != 0)
+    {
+        response[1] = functionCode | 0x80;
+        response[2] = exceptionCode;
+        responseLength = 3;
+    }
+
+    return responseLength;
+}
+
+void ModBus::resolveFuture(ModBusTelegram *telegram, ModBusFuture::State state, const QByteArray &response, quint8 exceptionCode)
+{
+    if (telegram->futureState.isNull())
+        return;
 
-        // Todo: Implementation of the following signals
-//        emit signal_exceptionStatusRead(quint64 telegramID, quint8 slaveAddress, quint16 data);
-//        emit signal_diagnosticCounterRead(quint64 telegramID, quint8 slaveAddress, quint8 subFunctionCode, quint16 data);
-//        emit signal_commEventCounterRead(quint64 telegramID, quint8 slaveAddress, quint16 data);
-//        emit signal_commEventLogRead(quint64 telegramID, quint8 slaveAddress, QList<quint16> data);
-//        emit signal_slaveIdRead(quint64 telegramID, quint8 slaveAddress, quint8 data);
+    QSharedPointer<ModBusFutureState> futureState = telegram->futureState;
+    telegram->futureState.clear();
 
+    // Keep a bounded number of resolved futures that have not been fetched yet
+    m_telegramQueueMutex.lock();
+    if (m_futuresEnabled && m_futures.contains(telegram->getID()))
+    {
+        m_finishedFutureIDs.enqueue(telegram->getID());
+        while (m_finishedFutureIDs.size() > 1024)
+            m_futures.remove(m_finishedFutureIDs.dequeue());
     }
+    m_telegramQueueMutex.unlock();
+
+    ModBusFutureState::resolve(futureState, state, response, exceptionCode, telegram->responseTimeNs, telegram->timestamps);
 }
 
-quint16 ModBus::checksum(QByteArray data)
+void ModBus::stampFirstByteReceived(qint64 timestamp)
 {
-    quint16 crc = 0xffff;
-    quint16 i;
+    m_currentTelegram->timestamps.firstByteReceived = timestamp;
+    m_currentTelegram->responseTimeNs = timestamp - m_currentTelegram->timestamps.transmitted;
+    if (!m_currentTelegram->fusedRead.isNull())
+    {
+        m_currentTelegram->fusedRead->timestamps.firstByteReceived = timestamp;
+        m_currentTelegram->fusedRead->responseTimeNs = m_currentTelegram->responseTimeNs;
+    }
+}
 
-    for (i=0;i < data.length(); i++)
+void ModBus::stampCompleted(ModBusTelegram *telegram)
+{
+    telegram->timestamps.completed = monotonicNs();
+    m_currentTimestamps = telegram->timestamps;
+    emit signal_transactionTimestamps(telegram->getID(), telegram->timestamps);
+
+    // The fused read was enqueued on its own but shares the transaction
+    if (!telegram->fusedRead.isNull())
     {
-        const uint16_t polynom = 0xA001;
+        telegram->fusedRead->timestamps.transmitted = telegram->timestamps.transmitted;
+        telegram->fusedRead->timestamps.firstByteReceived = telegram->timestamps.firstByteReceived;
+        telegram->fusedRead->timestamps.completed = telegram->timestamps.completed;
+        emit signal_transactionTimestamps(telegram->fusedRead->getID(), telegram->fusedRead->timestamps);
+    }
+}
 
-        bool c;
-        uint8_t crc_hi, crc_low;
+void ModBus::setFunctionCodeHandler(quint8 functionCode, RequestEncoder encoder, ResponseLengthCalculator responseLength, ResponseDecoder decoder)
+{
+    if ((functionCode == 0) || (functionCode & 0x80))
+        return;
 
-        crc_hi = crc >> 8;
-        crc_low = (crc & 0xFF) ^ (uint8_t)data.at(i);
-        crc = (crc_hi << 8) | crc_low;
+    FunctionCodeHandler &handler = m_functionCodeHandlers[functionCode];
+    if (encoder)
+    {
+        handler.encoder = encoder;
+        handler.encoderInstalled = true;
+    }
+    if (responseLength)
+        handler.responseLength = responseLength;
+    if (decoder)
+        handler.decoder = decoder;
+}
 
-        for (quint8 j=0; j<=7; j++)
-        {
-            c = (crc & 0x001);
-            crc = (crc >> 1);
-            if (c) crc ^= polynom;
-        }
+void ModBus::registerBuiltinFunctionCodeHandlers()
+{
+    for (int i = 0; i < 128; i++)
+        m_functionCodeHandlers[i].encoderInstalled = false;
+
+    static const struct {
+        quint8 functionCode;
+        void (ModBus::*decoder)(ModBusTelegram*, quint8, quint8, const QByteArray&, const QByteArray&);
+    } builtinDecoders[] = {
+        { 0x01, &ModBus::decodeBits },
+        { 0x02, &ModBus::decodeBits },
+        { 0x03, &ModBus::decodeRegisters },
+        { 0x04, &ModBus::decodeRegisters },
+        { 0x07, &ModBus::decodeExceptionStatus },
+        { 0x08, &ModBus::decodeDiagnostics },
+        { 0x0b, &ModBus::decodeCommEventCounter },
+        { 0x0c, &ModBus::decodeCommEventLog },
+        { 0x11, &ModBus::decodeSlaveId },
+        { 0x14, &ModBus::decodeFileRecordRead },
+        { 0x15, &ModBus::decodeFileRecordWritten },
+        { 0x17, &ModBus::decodeRegisters },
+        { 0x18, &ModBus::decodeFIFOqueue },
+        { 0x2b, &ModBus::decodeEncapsulatedInterfaceTransport }
+    };
+
+    for (unsigned int i = 0; i < sizeof(builtinDecoders) / sizeof(builtinDecoders[0]); i++)
+    {
+        void (ModBus::*decoder)(ModBusTelegram*, quint8, quint8, const QByteArray&, const QByteArray&) = builtinDecoders[i].decoder;
+        m_functionCodeHandlers[builtinDecoders[i].functionCode].decoder =
+                [this, decoder](ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame) {
+            (this->*decoder)(telegram, slaveAddress, functionCode, payload, frame);
+        };
     }
 
-    return crc;
+    // Raw requests of the read codes get the requested range from their data, so that their responses are decoded as well
+    RequestEncoder readRangeEncoder = [](ModBusTelegram* telegram) {
+        if ((telegram->requestedCount != 0) || (telegram->data.size() < 4))
+            return;
+        telegram->requestedDataStartAddress = ((quint8)telegram->data.at(0) << 8) | (quint8)telegram->data.at(1);
+        telegram->requestedCount = ((quint8)telegram->data.at(2) << 8) | (quint8)telegram->data.at(3);
+    };
+    for (quint8 functionCode = 0x01; functionCode <= 0x04; functionCode++)
+        m_functionCodeHandlers[functionCode].encoder = readRangeEncoder;
+    m_functionCodeHandlers[0x17].encoder = readRangeEncoder;
 }
 
-bool ModBus::checksumOK(QByteArray data)
+int ModBus::responseLength(const char *adu, int size) const
+{
+    if (size < 2)
+        return 0;
+
+    quint8 functionCode = adu[1];
+    const FunctionCodeHandler &handler = m_functionCodeHandlers[functionCode & 0x7f];
+    if (!(functionCode & 0x80) && handler.responseLength)
+        return handler.responseLength(adu, size);
+
+    return ModBusFraming::responseLength(adu, size);
+}
+
+void ModBus::parseResponse(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, QByteArray payload, const QByteArray &frame)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse() fc%i.\n", functionCode);
+        fflush(stdout);
+    }
+
+    // Codes without decoder, e.g. the write confirmations, are only reported raw
+    const FunctionCodeHandler &handler = m_functionCodeHandlers[functionCode & 0x7f];
+    if (handler.decoder)
+        handler.decoder(telegram, slaveAddress, functionCode, payload, frame);
+}
+
+void ModBus::decodeBits(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+    quint64 telegramID = telegram->getID();
+    quint16 dataStartAddress = telegram->requestedDataStartAddress;
+    QList<bool> on;
+
+    uint8_t bits[MODBUSCORE_MAX_ADU_SIZE];
+    int bytes = ModBusCore::decodeBits((const uint8_t*)frame.constData(), frame.size(), bits, sizeof(bits));
+    if (bytes < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    int requestedBytes = (telegram->requestedCount + 7) / 8;
+    if (bytes < requestedBytes)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i requested length mismatch with resonse length.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    // Wire layout, first coil in bit 0 of the first byte; bits beyond the requested count are cleared
+    if (telegram->requestedCount % 8)
+        bits[requestedBytes - 1] &= (1 << (telegram->requestedCount % 8)) - 1;
+    QByteArray packed((const char*)bits, requestedBytes);
+
+    if (functionCode == 1)
+        emit signal_coilsReadPacked(telegramID, slaveAddress, dataStartAddress, telegram->requestedCount, packed);
+    else if (functionCode == 2)
+        emit signal_discreteInputsReadPacked(telegramID, slaveAddress, dataStartAddress, telegram->requestedCount, packed);
+
+    static const QMetaMethod coilsReadSignal = QMetaMethod::fromSignal(&ModBus::signal_coilsRead);
+    static const QMetaMethod discreteInputsReadSignal = QMetaMethod::fromSignal(&ModBus::signal_discreteInputsRead);
+    if (!isSignalConnected((functionCode == 1) ? coilsReadSignal : discreteInputsReadSignal))
+        return;
+
+    on.reserve(telegram->requestedCount);
+    for (int i = 0; i < telegram->requestedCount; i++)
+        on.append((packed.at(i >> 3) >> (i & 7)) & 1);
+
+    if (functionCode == 1)
+        emit signal_coilsRead(telegramID, slaveAddress, dataStartAddress, on);
+    else if (functionCode == 2)
+        emit signal_discreteInputsRead(telegramID, slaveAddress, dataStartAddress, on);
+}
+
+void ModBus::decodeRegisters(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+    quint64 telegramID = telegram->getID();
+    quint16 dataStartAddress = telegram->requestedDataStartAddress;
+    QList<quint16> data;
+
+    uint16_t words[MODBUSCORE_MAX_ADU_SIZE / 2];
+    int count = ModBusCore::decodeRegisters((const uint8_t*)frame.constData(), frame.size(), words, sizeof(words) / sizeof(words[0]));
+    if (count < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    if (count != telegram->requestedCount)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i requested length mismatch with resonse length.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    // Shared frame delivery; receivers on other threads get the same buffer without a copy
+    static const QMetaMethod registersReadSignal = QMetaMethod::fromSignal(&ModBus::signal_registersRead);
+    if (isSignalConnected(registersReadSignal))
+    {
+        emit signal_registersRead(ModBusRegisterView(frame, 3, telegram->requestedCount, telegramID, slaveAddress, functionCode, dataStartAddress, telegram->timestamps));
+        if (!telegram->fusedRead.isNull())
+            emit signal_registersRead(ModBusRegisterView(frame, 3, telegram->requestedCount, telegram->fusedRead->getID(), slaveAddress, 0x03, dataStartAddress, telegram->fusedRead->timestamps));
+    }
+
+    // The word list is built only if somebody listens to it
+    static const QMetaMethod holdingRegistersReadSignal = QMetaMethod::fromSignal(&ModBus::signal_holdingRegistersRead);
+    static const QMetaMethod inputRegistersReadSignal = QMetaMethod::fromSignal(&ModBus::signal_inputRegistersRead);
+    static const QMetaMethod multipleRegistersReadWrittenSignal = QMetaMethod::fromSignal(&ModBus::signal_multipleRegistersReadWritten);
+    bool holdingWanted = isSignalConnected(holdingRegistersReadSignal) && ((functionCode == 3) || !telegram->fusedRead.isNull());
+    bool inputWanted = isSignalConnected(inputRegistersReadSignal) && (functionCode == 4);
+    bool multipleWanted = isSignalConnected(multipleRegistersReadWrittenSignal) && (functionCode == 0x17);
+    if (!holdingWanted && !inputWanted && !multipleWanted)
+        return;
+
+    data.reserve(count);
+    for (int i = 0; i < count; i++)
+        data.append(words[i]);
+
+    if (functionCode == 3)
+        emit signal_holdingRegistersRead(telegramID, slaveAddress, dataStartAddress, data);
+    else if (functionCode == 4)
+        emit signal_inputRegistersRead(telegramID, slaveAddress, dataStartAddress, data);
+    else if (functionCode == 0x17)
+    {
+        emit signal_multipleRegistersReadWritten(telegramID, slaveAddress, dataStartAddress, data);
+        if (!telegram->fusedRead.isNull())
+            emit signal_holdingRegistersRead(telegram->fusedRead->getID(), slaveAddress, dataStartAddress, data);
+    }
+}
+
+void ModBus::decodeExceptionStatus(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    uint8_t status;
+    if (ModBusCore::decodeExceptionStatus((const uint8_t*)frame.constData(), frame.size(), &status) < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != 1.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    emit signal_exceptionStatusRead(telegram->getID(), slaveAddress, status);
+}
+
+void ModBus::decodeDiagnostics(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    uint16_t subFunctionCode;
+    uint16_t data;
+    if (ModBusCore::decodeDiagnostics((const uint8_t*)frame.constData(), frame.size(), &subFunctionCode, &data) < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != 4.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    emit signal_diagnosticCounterRead(telegram->getID(), slaveAddress, subFunctionCode & 0xff, data);
+}
+
+void ModBus::decodeCommEventCounter(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    uint16_t status;
+    uint16_t eventCount;
+    if (ModBusCore::decodeCommEventCounter((const uint8_t*)frame.constData(), frame.size(), &status, &eventCount) < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != 4.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    emit signal_commEventCounterRead(telegram->getID(), slaveAddress, eventCount);
+}
+
+void ModBus::decodeCommEventLog(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    uint16_t status;
+    uint16_t eventCount;
+    uint16_t messageCount;
+    uint8_t events[MODBUSCORE_MAX_ADU_SIZE];
+    int count = ModBusCore::decodeCommEventLog((const uint8_t*)frame.constData(), frame.size(), &status, &eventCount, &messageCount, events, sizeof(events));
+    if (count < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    // Status, event count and message count, then one entry per event
+    QList<quint16> data;
+    data.reserve(count + 3);
+    data.append(status);
+    data.append(eventCount);
+    data.append(messageCount);
+    for (int i = 0; i < count; i++)
+        data.append(events[i]);
+
+    emit signal_commEventLogRead(telegram->getID(), slaveAddress, data);
+}
+
+void ModBus::decodeSlaveId(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    const uint8_t* data;
+    int length = ModBusCore::decodeSlaveId((const uint8_t*)frame.constData(), frame.size(), &data);
+    if (length < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length != bytecount + 1.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    emit signal_slaveIdRead(telegram->getID(), slaveAddress, QByteArray((const char*)data, length));
+}
+
+void ModBus::decodeFileRecordRead(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
+
+    // The file number is only in the request
+    if (telegram->data.size() < 8)
+        return;
+    quint16 fileNumber = ((quint8)telegram->data.at(2) << 8) | (quint8)telegram->data.at(3);
+
+    uint16_t words[MODBUSCORE_MAX_ADU_SIZE / 2];
+    int count = ModBusCore::decodeFileRecordRead((const uint8_t*)frame.constData(), frame.size(), words, sizeof(words) / sizeof(words[0]));
+    if (count < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length mismatch.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    if (count != telegram->requestedCount)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i requested length mismatch with resonse length.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    QList<quint16> data;
+    data.reserve(count);
+    for (int i = 0; i < count; i++)
+        data.append(words[i]);
+
+    emit signal_fileRecordRead(telegram->getID(), slaveAddress, fileNumber, telegram->requestedDataStartAddress, data);
+}
+
+void ModBus::decodeFileRecordWritten(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
 {
-    quint16 crc = 0;
-    crc = (uint8_t)data.at(data.length() - 2);
-    crc |= ((uint8_t)data.at(data.length() - 1)) << 8;
+    Q_UNUSED(payload);
+
+    if (ModBusCore::decodeFileRecordWritten((const uint8_t*)frame.constData(), frame.size(), (const uint8_t*)telegram->adu.constData(), telegram->adu.size()) < 0)
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i response does not match request.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
 
-    data.remove(data.length() - 2, 2);
+    quint16 fileNumber = ((quint8)telegram->data.at(2) << 8) | (quint8)telegram->data.at(3);
+    emit signal_fileRecordWritten(telegram->getID(), slaveAddress, fileNumber, telegram->requestedDataStartAddress, telegram->requestedCount);
+}
 
-    quint16 crc_calculated = checksum(data);
+void ModBus::decodeFIFOqueue(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(payload);
 
-    if ((crc_calculated != crc) && m_debug)
+    uint16_t words[MODBUSCORE_MAX_ADU_SIZE / 2];
+    int count = ModBusCore::decodeFIFOQueue((const uint8_t*)frame.constData(), frame.size(), words, sizeof(words) / sizeof(words[0]));
+    if (count < 0)
     {
-        fprintf(stdout, "ModBus::checksumOK: Read crc:       %#06x\nModBus::checksumOK: Calculated crc: %#06x\n", crc, crc_calculated);
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i data length mismatch.\n", functionCode);
         fflush(stdout);
+        return;
     }
 
-    return (crc_calculated == crc);
+    quint16 fifoPointerAddress = 0;
+    if (telegram->data.size() >= 2)
+        fifoPointerAddress = ((quint8)telegram->data.at(0) << 8) | (quint8)telegram->data.at(1);
+
+    QList<quint16> data;
+    data.reserve(count);
+    for (int i = 0; i < count; i++)
+        data.append(words[i]);
+
+    emit signal_fifoQueueRead(telegram->getID(), slaveAddress, fifoPointerAddress, data);
+}
+
+void ModBus::decodeEncapsulatedInterfaceTransport(ModBusTelegram *telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)
+{
+    Q_UNUSED(frame);
+
+    if ((payload.length() < 1) || ((quint8)payload.at(0) != 0x0e))
+        return;  // Other MEI types are only reported raw
+
+    quint8 conformityLevel;
+    bool moreFollows;
+    quint8 nextObjectId;
+    QMap<quint8, QByteArray> objects;
+    if (!parseDeviceIdentification(payload, &conformityLevel, &moreFollows, &nextObjectId, &objects))
+    {
+        fprintf(stdout, "DEBUG ModBus::parseResponse: fc%i malformed device identification.\n", functionCode);
+        fflush(stdout);
+        return;
+    }
+
+    emit signal_deviceIdentificationRead(telegram->getID(), slaveAddress, conformityLevel, moreFollows, nextObjectId, objects);
+}
+
+quint16 ModBus::checksum(QByteArray data)
+{
+    return checksum(data.constData(), data.length());
+}
+
+quint16 ModBus::checksum(const char *data, int length)
+{
+    return ModBusCore::crc16((const uint8_t*)data, length);
+}
+
+bool ModBus::checksumOK(QByteArray data)
+{
+    return checksumOK(data.constData(), data.length());
+}
+
+bool ModBus::checksumOK(const char *data, int length)
+{
+    if (length < 2)
+        return false;
+
+    if (ModBusCore::crcOK((const uint8_t*)data, length))
+        return true;
+
+    if (m_debug)
+    {
+        quint16 crc = (uint8_t)data[length - 2] | ((uint8_t)data[length - 1] << 8);
+        fprintf(stdout, "ModBus::checksumOK: Read crc:       %#06x\nModBus::checksumOK: Calculated crc: %#06x\n", crc, checksum(data, length - 2));
+        fflush(stdout);
+    }
+    return false;
 }
 
 void ModBus::slot_readyRead()
 {
+    // Response time of the current transaction is measured up to its first byte
+    if (m_readBuffer.isEmpty() && !m_serverMode && !m_snifferMode && (m_currentTelegram != NULL) && (m_currentTelegram->responseTimeNs < 0))
+        stampFirstByteReceived(monotonicNs());
+
     while (!m_port->atEnd())
     {
         char c;
@@ -978,6 +2792,13 @@ void ModBus::slot_readyRead()
         m_readBuffer.append(c);
         m_rxIdleTimer.start();  // Start resets the timer even if it has not finished in order to run the full time again
     }
+
+    if (m_serverMode)
+        tryToParseServerRequests(&m_readBuffer);
+    else if (m_snifferMode)
+        tryToParseSniffedFrames(&m_readBuffer);
+    else if (stripEcho(false))
+        pollMaster();   // The master completes the response by its length or after the inter-frame timeout
 }
 
 void ModBus::slot_requestTimer_fired()
@@ -987,14 +2808,33 @@ void ModBus::slot_requestTimer_fired()
         fprintf(stdout, "DEBUG ModBus::slot_requestTimer_fired().\n");
         fflush(stdout);
     }
-    if (m_currentTelegram->needsAnswer() && (m_currentTelegram->repeatCount == 0))
+
+    // Nothing followed the copy of the request until the timeout, so it was the response of a line without echo
+    if (echoUndecided())
+        m_expectedEcho.clear();
+    pollMaster();
+}
+
+void ModBus::slot_frameReceived(QByteArray frame, qint64 firstByteNs)
+{
+    // The termios backend delivers complete frames, so no idle timer is needed to find their end
+    if (m_readBuffer.isEmpty() && !m_serverMode && !m_snifferMode && (m_currentTelegram != NULL) && (m_currentTelegram->responseTimeNs < 0))
+        stampFirstByteReceived(firstByteNs);    // Both clocks are CLOCK_MONOTONIC
+
+    m_readBuffer.append(frame);
+    if (m_serverMode)
+        tryToParseServerRequests(&m_readBuffer);
+    else if (m_snifferMode)
+        tryToParseSniffedFrames(&m_readBuffer);
+    else if (!stripEcho(true) && echoUndecided())
     {
-        emit signal_transactionLost(m_currentTelegram->getID());
+        // Frames end after a few character times; whether the copy of the request is echo or
+        // response is only told by the response that follows the echo, or by silence
+        m_rxIdleTimer.start();
+        return;
     }
-//    else
-//    {
-        emit signal_transactionFinished();
-//    }
+    m_rxIdleTimer.stop();
+    slot_rxIdleTimer_fired();
 }
 
 void ModBus::slot_rxIdleTimer_fired()
@@ -1004,5 +2844,44 @@ void ModBus::slot_rxIdleTimer_fired()
         fprintf(stdout, "DEBUG ModBus::slot_rxIdleTimer_fired().\n");
         fflush(stdout);
     }
-    tryToParseResponseRaw(&m_readBuffer);
+    if (m_serverMode)
+    {
+        // Bus went idle; whatever is left can not become a valid request anymore
+        m_readBuffer.clear();
+        return;
+    }
+
+    if (m_snifferMode)
+    {
+        // Bus went idle; whatever is left can not become a valid frame anymore
+        tryToParseSniffedFrames(&m_readBuffer);
+        m_readBuffer.clear();
+        return;
+    }
+
+    if (!stripEcho(true))
+    {
+        if (!echoUndecided())
+            return;
+
+        // The copy of the request was followed by silence, so it was the response of a line without echo
+        m_echoDecided = true;
+        m_echoPresent = false;
+        m_expectedEcho.clear();
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBus::slot_rxIdleTimer_fired: No local echo on %s.\n", m_interface.toLocal8Bit().constData());
+            fflush(stdout);
+        }
+    }
+
+    if ((m_currentTelegram != NULL) && m_currentTelegram->echoProbe && (m_master->state() == ModBusCoreMaster::STATE_WAITING))
+    {
+        m_master->abort();
+        m_requestTimer.stop();
+        finishEchoProbe();
+        return;
+    }
+
+    pollMaster();
 }
@@ -17,14 +17,28 @@
 #define OPENFFUCONTROLMODBUS_H
 
 #include <QObject>
+#include <QBitArray>
 #include <QtSerialPort/QSerialPort>
 #include <QStringList>
 #include <QTimer>
 #include <QList>
 #include <QMutex>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QQueue>
+#include <QMap>
+#include <functional>
 
 #include "modbus_global.h"
 #include "modbustelegram.h"
+#include "modbuscapture.h"
+#include "modbusregisterbank.h"
+#include "modbusfuture.h"
+#include "modbusbatch.h"
+#include "modbuscore.h"
+#include "modbusregisterview.h"
+
+class ModBusTermiosPort;
 
 class MODBUSSHARED_EXPORT ModBus : public QObject
 {
@@ -39,11 +53,48 @@ public:
               QSerialPort::StopBits stopBits = QSerialPort::TwoStop);
     void close();
 
+    // Linux only; the tty is driven directly by a thread of its own instead of QSerialPort.
+    // Must be called before open(). Returns false if the backend is not available.
+    bool setTermiosBackend(bool on, int realtimePriority = 0, int interFrameGapMicroseconds = 0);
+
+    // Port failures; a port that reports an error is closed and, if enabled, reopened with the settings of the
+    // last open(). The delay starts at minimumDelay and doubles with every failed attempt up to maximumDelay.
+    typedef enum {
+        FAILURE_KEEP_QUEUE,     // Telegrams wait for the port with their ids and priorities; the interrupted one is sent again first
+        FAILURE_FAIL_QUEUE      // Telegrams in the queue and those queued while the port is down are lost immediately
+    } FailurePolicy;
+    void setReconnect(bool on, int minimumDelayMilliseconds = 50, int maximumDelayMilliseconds = 1000);
+    void setFailurePolicy(FailurePolicy policy);
+    bool isPortDown() const;
+
+    // Local echo of adapters that receive their own transmission. The echo of every request is
+    // compared with the ADU just written and removed before the response is framed; a difference
+    // is reported as collision. ECHO_AUTO finds out right after open() with a probe to the reserved
+    // address 248, which no slave answers: bytes that come back within the receive idle timeout
+    // are the echo. If the probe is disturbed, the first transaction decides; an exact copy of a
+    // fc 5, 6, 8 or 0x15 request followed by the receive idle timeout is taken as the response.
+    typedef enum {
+        ECHO_OFF,
+        ECHO_ON,
+        ECHO_AUTO
+    } EchoMode;
+    void setEchoMode(EchoMode mode);
+    bool echoDetected() const;
+
     void setDelayTxTimer(quint32 milliseconds);
+    void setRequestTimeout(quint32 milliseconds);
+    int rxIdleTimeout() const;      // Silence after which a response of unknown length is parsed
+    // Time slot after a broadcast before the next telegram may be sent; the slaves need it to process the request
+    void setBroadcastTurnaroundDelay(quint32 milliseconds);
 
     // High level access
     quint64 sendRawRequest(quint8 slaveAddress, quint8 functionCode, QByteArray payload);
     QByteArray sendRawRequestBlocking(quint8 slaveAddress, quint8 functionCode, QByteArray payload);
+    ModBusFuture sendRawRequestAsync(quint8 slaveAddress, quint8 functionCode, QByteArray payload);
+
+    // Futures; when enabled, every telegram gets a completion handle that can be fetched once by its id
+    void setFuturesEnabled(bool on);
+    ModBusFuture future(quint64 telegramID);
 
     quint64 readCoils(quint8 slaveAddress, quint16 dataStartAddress, quint16 count = 1, quint8 functionCode = 0x01);
     quint64 readDiscreteInputs(quint8 slaveAddress, quint16 dataStartAddress, quint16 count = 1, quint8 functionCode = 0x02);
@@ -59,21 +110,56 @@ public:
     quint64 getCommEventCounter(quint8 slaveAddress, quint8 functionCode = 0x0b);
     quint64 getCommEventLog(quint8 slaveAddress, quint8 functionCode = 0x0c);
 
+    // Return 0 if no value is given or the values do not fit into one request
     quint64 writeMultipleCoils(quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on, quint8 functionCode = 0x0f);
+    quint64 writeMultipleCoils(quint8 slaveAddress, quint16 dataStartAddress, const QBitArray &on, quint8 functionCode = 0x0f);
+    quint64 writeMultipleCoilsPacked(quint8 slaveAddress, quint16 dataStartAddress, quint16 count, QByteArray packed, quint8 functionCode = 0x0f); // Wire layout, bit 0 of byte 0 first
     quint64 writeMultipleRegisters(quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data, quint8 functionCode = 0x10);
 
     quint64 reportSlaveID(quint8 slaveAddress, quint8 functionCode = 0x11);
 
-//    quint64 readFileRecord(quint8 slaveAddress, quint8 functionCode = 0x14);
-//    quint64 writeFileRecord(quint8 slaveAddress, quint8 functionCode = 0x15);
+    // One sub request per telegram of 1 to 121 registers read or 1 to 122 written; return 0 otherwise
+    quint64 readFileRecord(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, quint8 recordLength, quint8 functionCode = 0x14);
+    quint64 writeFileRecord(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, QList<quint16> data, quint8 functionCode = 0x15);
 
     quint64 maskWriteRegister(quint8 slaveAddress, quint16 dataAddress, quint16 andMask, quint16 orMask, quint8 functionCode = 0x16);
-//    quint64 readWriteMultipleRegisters(quint8 slaveAddress, quint8 functionCode = 0x17);
+    // Returns 0 unless 1 to 125 registers are read and 1 to 121 written
+    quint64 readWriteMultipleRegisters(quint8 slaveAddress, quint16 readStartAddress, quint8 readCount, quint16 writeStartAddress, QList<quint16> writeData, quint8 functionCode = 0x17);
     quint64 readFIFOqueue(quint8 slaveAddress, quint16 fifoPointerAddress, quint8 functionCode = 0x18);
-//    quint64 encapsulatedInterfaceTransport(quint8 slaveAddress, quint8 functionCode = 0x2b);
+    quint64 encapsulatedInterfaceTransport(quint8 slaveAddress, quint8 meiType, QByteArray data, quint8 functionCode = 0x2b);
 
 //    quint64 canOpenGeneralReferenceRequestAndResponsePDU(quint8 slaveAddress, quint8 functionCode = 0x2b);
-//    quint64 readDeviceIdentification(quint8 slaveAddress, quint8 functionCode = 0x2b);
+    // Read device id code 1..3 streams the basic, regular or extended objects starting at objectId, 4 reads one object
+    quint64 readDeviceIdentification(quint8 slaveAddress, quint8 readDeviceIdCode = 0x01, quint8 objectId = 0x00, quint8 functionCode = 0x2b);
+    // Conversion between QBitArray and the packed wire layout of coils and discrete inputs
+    static QByteArray packBits(const QBitArray &bits);
+    static QBitArray unpackBits(const QByteArray &packed, int count);
+
+    // CRC-16 of an RTU frame, transmitted low byte first
+    static quint16 checksum(const char* data, int length);
+
+    static bool parseDeviceIdentification(const QByteArray &payload, quint8* conformityLevel, bool* moreFollows, quint8* nextObjectId, QMap<quint8, QByteArray>* objects);
+
+    // Batches; high level requests between beginBatch() and endBatch() are collected in the batch
+    // instead of being queued. submitBatch() enqueues all of them with one lock acquisition.
+    void beginBatch(ModBusBatch* batch);
+    void endBatch();
+    bool submitBatch(ModBusBatch* batch, ModBusBatch::Order order = ModBusBatch::ORDER_ANY, bool highPriority = false);
+
+    // Read/write fusion; a queued write to a slave that supports fc 0x17 is combined with the
+    // read holding registers telegram that follows it for the same slave into one transaction.
+    // The write keeps its telegram id and reports through signal_multipleRegistersReadWritten,
+    // the read still gets its own signal_holdingRegistersRead, future, exception or loss.
+    void setReadWriteFusion(quint8 slaveAddress, bool supported);
+
+    // Function code handlers, looked up in a table indexed by function code. The encoder prepares a telegram
+    // when it is queued, the length calculator finds the end of a response as soon as its bytes arrive
+    // (same contract as ModBusFraming::responseLength()) and the decoder turns the payload into signals.
+    // The standard codes have handlers already; empty functions keep the current handler.
+    typedef std::function<void(ModBusTelegram* telegram)> RequestEncoder;
+    typedef std::function<int(const char* adu, int size)> ResponseLengthCalculator;
+    typedef std::function<void(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame)> ResponseDecoder;
+    void setFunctionCodeHandler(quint8 functionCode, RequestEncoder encoder, ResponseLengthCalculator responseLength, ResponseDecoder decoder);
 
     int getSizeOfTelegramQueue(bool highPriorityQueue = false);
     void clearTelegramQueue(bool highPriorityQueue = false);
@@ -82,59 +168,196 @@ public:
     // Returns the assigned telegram id, which is unique
     quint64 writeTelegramToQueue(ModBusTelegram* telegram, bool highPriority = false);
 
+    QString interfaceName() const;
+
+    // Monotonic clock of all telegram timestamps; CLOCK_MONOTONIC on Linux
+    static qint64 monotonicNs();
+    // Timestamps of the transaction whose response signals are being emitted; valid in directly connected slots
+    ModBusTimestamps currentTimestamps() const;
+
     int getTelegramRepeatCount() const;
     void setTelegramRepeatCount(int telegramRepeatCount);
 
     quint64 rx_telegrams() const;
     quint64 crc_errors() const;
+    quint64 dropped_bytes() const;     // Bytes skipped while resynchronizing in sniffer and server mode
 
     QString exceptionToText(quint8 exceptionCode);
+
+    // Traffic capture; every transmitted and received ADU is recorded with the given channel number
+    void setCapture(ModBusCapture* capture, quint8 channel = 0);
+
+    // Replay access; in replay mode the bus does not send on its own but is driven by ModBusReplay
+    void setReplayMode(bool on);
+    void replayTransmittedFrame(const QByteArray &adu);
+    void replayReceivedFrame(const QByteArray &adu);
+
+    // Sniffer mode; listen only on a bus driven by another master and decode its transactions
+    void setSnifferMode(bool on);
+    bool snifferMode() const;
+
+    // Server mode; the bus answers requests for every address that has a register bank assigned.
+    // Passing NULL as bank stops serving that address.
+    void setServerAddress(quint8 slaveAddress, ModBusRegisterBank* bank);
+    bool serverMode() const;
+
 private:
     QString m_interface;
     bool m_debug;
     QSerialPort* m_port;
+    ModBusTermiosPort* m_termiosPort;   // Replaces m_port if set
     QByteArray m_readBuffer;
-    QTimer m_requestTimer;  // This timer controlles timeout of telegrams with answer and sending timeslots for telegrams without answer
+    QTimer m_requestTimer;  // This timer wakes the master up at its next timeout
+    int m_requestTimeout;
+    int m_broadcastTurnaroundDelay;
     QTimer m_delayTxTimer;  // This timer delays switching to rs-485 tx after rs-485 rx (line clearance time)
-    QTimer m_rxIdleTimer;   // This timer fires if receiver does not get any more bytes and telegram should be complete
+    QTimer m_rxIdleTimer;   // This timer fires if receiver does not get any more bytes; decides about the echo, ends frames in sniffer and server mode
+    QTimer m_reconnectTimer;
+    int m_reconnectDelayMinimum;
+    int m_reconnectDelayMaximum;
+    bool m_reconnect;
+    bool m_portDown;        // Port failed and is not open again yet
+    QString m_portFailure;  // Error reported by QSerialPort, handled once control is back in the event loop
+    FailurePolicy m_failurePolicy;
+    EchoMode m_echoMode;
+    bool m_echoDecided;     // ECHO_AUTO only
+    bool m_echoPresent;
+    QByteArray m_expectedEcho;  // Part of the last transmission that has not been echoed yet
+    qint32 m_baudrate;      // Settings of the last open() for reopening
+    QSerialPort::DataBits m_dataBits;
+    QSerialPort::Parity m_parity;
+    QSerialPort::StopBits m_stopBits;
+    ModBusTimestamps m_currentTimestamps;
 
     bool m_transactionPending;
     QMutex m_telegramQueueMutex;
     QList<ModBusTelegram*> m_telegramQueue_standardPriority;
     QList<ModBusTelegram*> m_telegramQueue_highPriority;
     ModBusTelegram* m_currentTelegram;
+    ModBusCoreMaster* m_master;         // Runs the transaction of m_currentTelegram
+    QList<ModBusTelegram*>* m_batchQueue;  // Queue of a contiguous batch in progress, NULL otherwise
+    ModBusBatch* m_collectingBatch;
+    bool m_readWriteFusion[256];
     int m_telegramRepeatCount;
     quint64 m_rx_telegrams;
     quint64 m_crc_errors;
+    quint64 m_dropped_bytes;
+    bool m_resynchronizing;
+    ModBusCapture* m_capture;
+    quint8 m_captureChannel;
+    bool m_replayMode;
+    bool m_snifferMode;
+    ModBusTelegram* m_sniffedRequest;   // Last request seen in sniffer mode that still waits for its response
+    QByteArray m_sniffedRequestAdu;
+    QElapsedTimer m_sniffedRequestTime;
+    bool m_serverMode;
+    ModBusRegisterBank* m_serverBanks[256];
+    quint8 m_serverForeignAddress;      // Last request on the bus that was not for us, its response is skipped
+    quint8 m_serverForeignFunctionCode;
+    char m_serverResponse[256];
+    bool m_futuresEnabled;
+    QHash<quint64, QSharedPointer<ModBusFutureState> > m_futures;  // Futures not yet fetched by future()
+    QQueue<quint64> m_finishedFutureIDs;                            // Resolved but not fetched, oldest first
+
+    typedef struct {
+        RequestEncoder encoder;
+        ResponseLengthCalculator responseLength;
+        ResponseDecoder decoder;
+        bool encoderInstalled;      // Set by setFunctionCodeHandler(); frames built by the core are encoded again
+    } FunctionCodeHandler;
+    FunctionCodeHandler m_functionCodeHandlers[128];
 
     // Low level access; writes immediately to the bus
     quint64 writeTelegramNow(ModBusTelegram* telegram);
     void writeTelegramRawNow(quint8 slaveAddress, quint8 functionCode, QByteArray data);
-    void tryToParseResponseRaw(QByteArray *buffer);
-    void parseResponse(quint64 telegramID, quint8 slaveAddress, quint8 functionCode, QByteArray payload);
+    void writeAduNow(const QByteArray &adu);
+    bool stripEcho(bool frameComplete);
+    bool echoUndecided() const;
+    void queueEchoProbe();
+    void finishEchoProbe();
+    void encodeTelegram(ModBusTelegram* telegram);
+    ModBusTelegram* telegramFromAdu(const uint8_t* adu, size_t size);
+    void pollMaster();
+    void finishTransaction(ModBusCoreMaster::State state);
+    void responseReceived(const QByteArray &frame);
+    static int coreWrite(void* context, const uint8_t* data, size_t length);
+    static int coreRead(void* context, uint8_t* data, size_t capacity);
+    static uint64_t coreNowUs(void* context);
+    static int coreResponseLength(void* context, const uint8_t* adu, size_t size);
+    static void coreFrameReceived(void* context, const uint8_t* adu, size_t size);
+    void tryToFuseReadWrite(QList<ModBusTelegram*>* queue);
+    void stampFirstByteReceived(qint64 timestamp);
+    void stampCompleted(ModBusTelegram* telegram);
+    void resolveFuture(ModBusTelegram* telegram, ModBusFuture::State state, const QByteArray &response = QByteArray(), quint8 exceptionCode = 0);
+    void registerBuiltinFunctionCodeHandlers();
+    int responseLength(const char* adu, int size) const;
+    void parseResponse(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, QByteArray payload, const QByteArray &frame = QByteArray());
+    void decodeBits(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeRegisters(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeExceptionStatus(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeDiagnostics(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeCommEventCounter(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeCommEventLog(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeSlaveId(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeFileRecordRead(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeFileRecordWritten(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeFIFOqueue(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void decodeEncapsulatedInterfaceTransport(ModBusTelegram* telegram, quint8 slaveAddress, quint8 functionCode, const QByteArray &payload, const QByteArray &frame);
+    void tryToParseSniffedFrames(QByteArray *buffer);
+    void sniffedRequest(const QByteArray &adu);
+    void sniffedResponse(const QByteArray &adu);
+    void finishSniffedTransaction(const QByteArray &responseAdu);
+    void tryToParseServerRequests(QByteArray *buffer);
+    void dropByteForResync(QByteArray *buffer);
+    void handleServerRequest(const char* adu, int length);
+    int executeServerRequest(ModBusRegisterBank* bank, const char* adu, int length, char* response, ModBusRegisterBank::Table* writtenTable, quint16* writtenStart, quint16* writtenCount);
+    bool openPort();
+    void portFailed(QString errorString);
+    void failTelegrams(QList<ModBusTelegram*> telegrams);
+    bool portIsOpen() const;
+    void portWrite(const char* data, int length);
     quint16 checksum(QByteArray data);
     bool checksumOK(QByteArray data);
+    bool checksumOK(const char* data, int length);
 
 signals:
     void signal_responseRawComplete(quint64 telegramID, QByteArray data);
     void signal_responseRaw(quint64 telegramID, quint8 address, quint8 functionCode, QByteArray data);
     void signal_transactionFinished();
     void signal_transactionLost(quint64 id);
+    void signal_portError(QString errorString);     // The port was closed; it is reopened if reconnect is enabled
+    void signal_portReopened();
+    void signal_collision(quint64 telegramID, QByteArray transmitted, QByteArray received);    // Echo differs from the request
+    void signal_transactionTimestamps(quint64 telegramID, ModBusTimestamps timestamps);   // Emitted before the response signals or signal_transactionLost
+
+    // Sniffer mode; response is empty if the request was a broadcast or got no answer
+    void signal_sniffedTransaction(quint64 telegramID, QByteArray request, QByteArray response, qint64 responseTimeNs);
+
+    // Server mode; a remote master changed data in the register bank of slaveAddress (0 for broadcast)
+    void signal_serverDataWritten(quint8 slaveAddress, int table, quint16 dataStartAddress, quint16 count);
 
     // High level response signals
     void signal_exception(quint64 telegramID, quint8 exceptionCode);
 
     void signal_coilsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on);
     void signal_discreteInputsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on);
+    void signal_coilsReadPacked(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, quint16 count, QByteArray packed);
+    void signal_discreteInputsReadPacked(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, quint16 count, QByteArray packed);
     void signal_holdingRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data);
     void signal_inputRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data);
+    void signal_registersRead(ModBusRegisterView registers);    // fc 0x03, 0x04 and 0x17 without copying the response
+    void signal_multipleRegistersReadWritten(quint64 telegramID, quint8 slaveAddress, quint16 readStartAddress, QList<quint16> data);
+    void signal_fileRecordRead(quint64 telegramID, quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, QList<quint16> data);
+    void signal_fileRecordWritten(quint64 telegramID, quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, quint16 count);
 
     void signal_exceptionStatusRead(quint64 telegramID, quint8 slaveAddress, quint16 data);
     void signal_diagnosticCounterRead(quint64 telegramID, quint8 slaveAddress, quint8 subFunctionCode, quint16 data);
     void signal_commEventCounterRead(quint64 telegramID, quint8 slaveAddress, quint16 data);
-    void signal_commEventLogRead(quint64 telegramID, quint8 slaveAddress, QList<quint16> data);
+    void signal_commEventLogRead(quint64 telegramID, quint8 slaveAddress, QList<quint16> data);    // Status, event count, message count, then one entry per event byte
+    void signal_fifoQueueRead(quint64 telegramID, quint8 slaveAddress, quint16 fifoPointerAddress, QList<quint16> data);
 
-    void signal_slaveIdRead(quint64 telegramID, quint8 slaveAddress, quint8 data);
+    void signal_slaveIdRead(quint64 telegramID, quint8 slaveAddress, QByteArray data);    // Device specific slave id, run indicator and additional data
+    void signal_deviceIdentificationRead(quint64 telegramID, quint8 slaveAddress, quint8 conformityLevel, bool moreFollows, quint8 nextObjectId, QMap<quint8, QByteArray> objects);
 
 public slots:
 
@@ -143,6 +366,11 @@ private slots:
     void slot_readyRead();
     void slot_requestTimer_fired();
     void slot_rxIdleTimer_fired();
+    void slot_frameReceived(QByteArray frame, qint64 firstByteNs);
+    void slot_portError(QSerialPort::SerialPortError error);
+    void slot_reconnectTimer_fired();
+    void slot_termiosDeviceLost(QString errorString);
+    void slot_portFailure();
 
 };
 
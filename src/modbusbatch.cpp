@@ -0,0 +1,93 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include "modbusbatch.h"
+
+ModBusBatch::ModBusBatch(QObject *parent) : QObject(parent)
+{
+    m_pending = 0;
+    m_submitted = false;
+}
+
+ModBusBatch::~ModBusBatch()
+{
+    // Telegrams of a batch that was never submitted still belong to us
+    foreach (const Entry &entry, m_entries)
+        delete entry.telegram;
+}
+
+quint64 ModBusBatch::append(ModBusTelegram *telegram, bool highPriority)
+{
+    if (m_submitted)
+    {
+        delete telegram;
+        return 0;
+    }
+
+    Entry entry;
+    entry.telegram = telegram;
+    entry.highPriority = highPriority;
+    m_entries.append(entry);
+    m_telegramIDs.append(telegram->getID());
+    return telegram->getID();
+}
+
+int ModBusBatch::count() const
+{
+    return m_telegramIDs.count();
+}
+
+bool ModBusBatch::isSubmitted() const
+{
+    return m_submitted;
+}
+
+bool ModBusBatch::isFinished() const
+{
+    return m_submitted && (m_pending == 0);
+}
+
+QList<quint64> ModBusBatch::telegramIDs() const
+{
+    return m_telegramIDs;
+}
+
+QList<quint64> ModBusBatch::failedTelegramIDs() const
+{
+    return m_failedTelegramIDs;
+}
+
+QList<ModBusFuture> ModBusBatch::futures() const
+{
+    return m_futures;
+}
+
+bool ModBusBatch::waitForFinished(int milliseconds) const
+{
+    if (!m_submitted)
+        return false;
+    return ModBusFuture::waitForAll(m_futures, milliseconds);
+}
+
+void ModBusBatch::telegramFinished(const ModBusFuture &future)
+{
+    // Called on the bus thread by the continuation of every future of this batch
+    if (!future.isSuccessful())
+        m_failedTelegramIDs.append(future.telegramID());
+
+    m_pending--;
+    if (m_pending == 0)
+        emit signal_finished(m_failedTelegramIDs.isEmpty(), m_failedTelegramIDs);
+}
@@ -0,0 +1,77 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSBATCH_H
+#define OPENFFUCONTROLMODBUSBATCH_H
+
+#include <QObject>
+#include <QList>
+
+#include "modbus_global.h"
+#include "modbustelegram.h"
+#include "modbusfuture.h"
+
+// Group of telegrams that is enqueued with one lock acquisition and reports one result.
+//
+// Collect requests either with append() or by calling the normal high level functions of
+// ModBus between ModBus::beginBatch() and ModBus::endBatch(), then hand the batch to
+// ModBus::submitBatch(). The batch must outlive its submission until signal_finished.
+class MODBUSSHARED_EXPORT ModBusBatch : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        ORDER_ANY,          // Every telegram goes to the queue its request would use anyway
+        ORDER_KEEP,         // All telegrams go to one queue in the order they were added
+        ORDER_CONTIGUOUS    // Like ORDER_KEEP, and no other telegram is sent in between
+    } Order;
+
+    explicit ModBusBatch(QObject *parent = nullptr);
+    ~ModBusBatch();
+
+    // The batch takes ownership of the telegram until it is submitted
+    quint64 append(ModBusTelegram* telegram, bool highPriority = false);
+
+    int count() const;
+    bool isSubmitted() const;
+    bool isFinished() const;
+    QList<quint64> telegramIDs() const;
+    QList<quint64> failedTelegramIDs() const;
+    QList<ModBusFuture> futures() const;
+
+    bool waitForFinished(int milliseconds = 10000) const;
+
+private:
+    friend class ModBus;
+
+    typedef struct {
+        ModBusTelegram* telegram;
+        bool highPriority;
+    } Entry;
+
+    QList<Entry> m_entries;             // Until submitted
+    QList<quint64> m_telegramIDs;
+    QList<ModBusFuture> m_futures;
+    QList<quint64> m_failedTelegramIDs;
+    int m_pending;
+    bool m_submitted;
+
+    void telegramFinished(const ModBusFuture &future);
+
+signals:
+    void signal_finished(bool allSucceeded, QList<quint64> failedTelegramIDs);
+};
+
+#endif // OPENFFUCONTROLMODBUSBATCH_H
@@ -0,0 +1,250 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include <QDateTime>
+#include <QtEndian>
+
+#include "modbuscapture.h"
+
+ModBusCapture::ModBusCapture(QObject *parent, QString fileName, bool debug) : QObject(parent)
+{
+    m_fileName = fileName;
+    m_debug = debug;
+    m_flushThreshold = 64 * 1024;
+    m_recordsWritten = 0;
+    m_file.setFileName(fileName);
+
+    // This timer writes out buffered records so that only little data is lost on a crash
+    m_flushTimer.setInterval(1000);
+    connect(&m_flushTimer, SIGNAL(timeout()), this, SLOT(slot_flush()));
+}
+
+ModBusCapture::~ModBusCapture()
+{
+    if (m_file.isOpen())
+        this->close();
+}
+
+bool ModBusCapture::open()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusCapture::open().\n");
+        fflush(stdout);
+    }
+
+    m_mutex.lock();
+    // Unbuffered, because we do our own buffering and want exactly one write syscall per flush
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered))
+    {
+        m_mutex.unlock();
+        return false;
+    }
+
+    m_buffer.clear();
+    m_buffer.reserve(m_flushThreshold + 512);
+    m_clock.start();
+
+    // New file: write header. Existing captures are continued, their timestamps restart at zero.
+    if (m_file.size() == 0)
+    {
+        char header[fileHeaderSize];
+        memcpy(header, "MBCP", 4);
+        qToLittleEndian<quint16>(version, header + 4);
+        qToLittleEndian<quint16>(fileHeaderSize, header + 6);
+        qToLittleEndian<qint64>(QDateTime::currentMSecsSinceEpoch(), header + 8);
+        m_buffer.append(header, fileHeaderSize);
+    }
+
+    m_mutex.unlock();
+    m_flushTimer.start();
+    return true;
+}
+
+void ModBusCapture::close()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusCapture::close().\n");
+        fflush(stdout);
+    }
+
+    m_flushTimer.stop();
+    m_mutex.lock();
+    writeBufferToFile();
+    m_file.close();
+    m_mutex.unlock();
+}
+
+bool ModBusCapture::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+void ModBusCapture::setFlushThreshold(int bytes)
+{
+    m_mutex.lock();
+    m_flushThreshold = bytes;
+    m_buffer.reserve(m_flushThreshold + 512);
+    m_mutex.unlock();
+}
+
+void ModBusCapture::setFlushInterval(int milliseconds)
+{
+    m_flushTimer.setInterval(milliseconds);
+}
+
+void ModBusCapture::record(Direction direction, quint8 channel, const QByteArray &adu)
+{
+    char header[recordHeaderSize];
+
+    m_mutex.lock();
+    if (!m_file.isOpen())
+    {
+        m_mutex.unlock();
+        return;
+    }
+
+    qToLittleEndian<quint64>(m_clock.nsecsElapsed(), header);
+    header[8] = (char)direction;
+    header[9] = (char)channel;
+    qToLittleEndian<quint16>(adu.size(), header + 10);
+    m_buffer.append(header, recordHeaderSize);
+    m_buffer.append(adu);
+    m_recordsWritten++;
+
+    if (m_buffer.size() >= m_flushThreshold)
+        writeBufferToFile();
+    m_mutex.unlock();
+}
+
+quint64 ModBusCapture::recordsWritten() const
+{
+    return m_recordsWritten;
+}
+
+void ModBusCapture::writeBufferToFile()
+{
+    // Must be called with m_mutex locked
+    if (m_buffer.isEmpty() || !m_file.isOpen())
+        return;
+
+    if (m_file.write(m_buffer) != m_buffer.size())
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "ModBusCapture::writeBufferToFile: Write error: %s\n", m_file.errorString().toUtf8().data());
+            fflush(stdout);
+        }
+    }
+    m_buffer.resize(0);  // Keeps the reserved capacity
+}
+
+void ModBusCapture::slot_flush()
+{
+    m_mutex.lock();
+    writeBufferToFile();
+    m_mutex.unlock();
+}
+
+ModBusCaptureReader::ModBusCaptureReader(QString fileName)
+{
+    m_file.setFileName(fileName);
+    m_map = NULL;
+    m_size = 0;
+    m_position = 0;
+    m_startTime = 0;
+}
+
+ModBusCaptureReader::~ModBusCaptureReader()
+{
+    this->close();
+}
+
+bool ModBusCaptureReader::open()
+{
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    m_size = m_file.size();
+    if (m_size < ModBusCapture::fileHeaderSize)
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_map = m_file.map(0, m_size);
+    if (m_map == NULL)
+    {
+        m_file.close();
+        return false;
+    }
+
+    if ((memcmp(m_map, "MBCP", 4) != 0) || (qFromLittleEndian<quint16>(m_map + 4) != ModBusCapture::version))
+    {
+        this->close();
+        return false;
+    }
+
+    m_startTime = qFromLittleEndian<qint64>(m_map + 8);
+    m_position = qFromLittleEndian<quint16>(m_map + 6);
+    return true;
+}
+
+void ModBusCaptureReader::close()
+{
+    if (m_map != NULL)
+    {
+        m_file.unmap((uchar*)m_map);
+        m_map = NULL;
+    }
+    if (m_file.isOpen())
+        m_file.close();
+    m_size = 0;
+    m_position = 0;
+}
+
+qint64 ModBusCaptureReader::startTime() const
+{
+    return m_startTime;
+}
+
+bool ModBusCaptureReader::next(Record *record)
+{
+    if ((m_map == NULL) || (m_position + ModBusCapture::recordHeaderSize > m_size))
+        return false;
+
+    const uchar* header = m_map + m_position;
+    quint16 length = qFromLittleEndian<quint16>(header + 10);
+
+    // A truncated last record may exist if the writer was killed during a flush
+    if (m_position + ModBusCapture::recordHeaderSize + length > m_size)
+        return false;
+
+    record->timestamp = qFromLittleEndian<quint64>(header);
+    record->direction = (ModBusCapture::Direction)header[8];
+    record->channel = header[9];
+    record->length = length;
+    record->adu = (const char*)(header + ModBusCapture::recordHeaderSize);
+
+    m_position += ModBusCapture::recordHeaderSize + length;
+    return true;
+}
+
+void ModBusCaptureReader::rewind()
+{
+    if (m_map != NULL)
+        m_position = qFromLittleEndian<quint16>(m_map + 6);
+}
@@ -0,0 +1,117 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSCAPTURE_H
+#define OPENFFUCONTROLMODBUSCAPTURE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QTimer>
+
+#include "modbus_global.h"
+
+// Capture file layout (all numbers little endian, no padding):
+//
+// File header, 16 bytes:
+//   char    magic[4]           "MBCP"
+//   quint16 version            1
+//   quint16 headerSize         16
+//   qint64  startTime          ms since epoch (wall clock) of the capture start
+//
+// Records, appended one after another:
+//   quint64 timestamp          ns since capture start (monotonic clock)
+//   quint8  direction          0 = tx, 1 = rx
+//   quint8  channel            bus number chosen by the application
+//   quint16 length             length of the following ADU in bytes
+//   char    adu[length]        complete ADU including CRC as seen on the wire
+
+class MODBUSSHARED_EXPORT ModBusCapture : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        DIRECTION_TX = 0,
+        DIRECTION_RX = 1
+    } Direction;
+
+    static const quint16 version = 1;
+    static const int fileHeaderSize = 16;
+    static const int recordHeaderSize = 12;
+
+    explicit ModBusCapture(QObject *parent, QString fileName, bool debug = false);
+    ~ModBusCapture();
+
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    // Records are collected in memory and written to disk when the buffer is full or the flush timer fires
+    void setFlushThreshold(int bytes);
+    void setFlushInterval(int milliseconds);
+
+    void record(Direction direction, quint8 channel, const QByteArray &adu);
+
+    quint64 recordsWritten() const;
+
+private:
+    QString m_fileName;
+    bool m_debug;
+    QFile m_file;
+    QMutex m_mutex;         // A capture can be shared by several buses
+    QByteArray m_buffer;
+    int m_flushThreshold;
+    QTimer m_flushTimer;
+    QElapsedTimer m_clock;
+    quint64 m_recordsWritten;
+
+    void writeBufferToFile();
+
+private slots:
+    void slot_flush();
+};
+
+class MODBUSSHARED_EXPORT ModBusCaptureReader
+{
+public:
+    typedef struct {
+        quint64 timestamp;  // ns since capture start
+        ModBusCapture::Direction direction;
+        quint8 channel;
+        quint16 length;
+        const char* adu;    // Points into the mapped file, valid as long as the reader is open
+    } Record;
+
+    ModBusCaptureReader(QString fileName);
+    ~ModBusCaptureReader();
+
+    bool open();
+    void close();
+
+    qint64 startTime() const;
+    bool next(Record *record);
+    void rewind();
+
+private:
+    QFile m_file;
+    const uchar* m_map;
+    qint64 m_size;
+    qint64 m_position;
+    qint64 m_startTime;
+};
+
+#endif // OPENFFUCONTROLMODBUSCAPTURE_H
@@ -0,0 +1,770 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <string.h>
+
+#include "modbuscore.h"
+
+// CRC-16/MODBUS, reflected polynomial 0xA001, one table lookup per byte
+static const uint16_t crcTable[256] = {
+    0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+    0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+    0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+    0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+    0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+    0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+    0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+    0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+    0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+    0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+    0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+    0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+    0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+    0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+    0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+    0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+    0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+    0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+    0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+    0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+    0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+    0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+    0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+    0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+    0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+    0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+    0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+    0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+    0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+    0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+    0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+    0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+
+uint16_t ModBusCore::crc16(const uint8_t *data, size_t length)
+{
+    uint16_t crc = 0xffff;
+
+    for (size_t i = 0; i < length; i++)
+        crc = (crc >> 8) ^ crcTable[(crc ^ data[i]) & 0xff];
+
+    return crc;
+}
+
+bool ModBusCore::crcOK(const uint8_t *adu, size_t length)
+{
+    if (length < 2)
+        return false;
+
+    uint16_t crc = adu[length - 2] | (adu[length - 1] << 8);
+    return (crc16(adu, length - 2) == crc);
+}
+
+size_t ModBusCore::finish(uint8_t *adu, size_t length)
+{
+    uint16_t crc = crc16(adu, length);
+    adu[length] = crc & 0xff;
+    adu[length + 1] = crc >> 8;
+    return length + 2;
+}
+
+size_t ModBusCore::encodeRequest(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, const uint8_t *data, size_t length)
+{
+    if ((length + 4 > capacity) || (length + 4 > MODBUSCORE_MAX_ADU_SIZE))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    if (length > 0)
+        memmove(adu + 2, data, length);
+    return finish(adu, length + 2);
+}
+
+size_t ModBusCore::encodeReadRequest(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, uint16_t dataStartAddress, uint16_t count)
+{
+    // The response carries at most 250 data bytes
+    uint16_t maximum = ((functionCode == 0x01) || (functionCode == 0x02)) ? 2000 : 125;
+    if ((count == 0) || (count > maximum) || (capacity < 8))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = dataStartAddress >> 8;
+    adu[3] = dataStartAddress & 0xff;
+    adu[4] = count >> 8;
+    adu[5] = count & 0xff;
+    return finish(adu, 6);
+}
+
+size_t ModBusCore::encodeWriteSingle(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, uint16_t dataAddress, uint16_t value)
+{
+    if (capacity < 8)
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = dataAddress >> 8;
+    adu[3] = dataAddress & 0xff;
+    adu[4] = value >> 8;
+    adu[5] = value & 0xff;
+    return finish(adu, 6);
+}
+
+size_t ModBusCore::encodeDiagnostics(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t subFunctionCode, const uint8_t *data, size_t length, uint8_t functionCode)
+{
+    if ((length + 6 > capacity) || (length + 6 > MODBUSCORE_MAX_ADU_SIZE))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = subFunctionCode >> 8;
+    adu[3] = subFunctionCode & 0xff;
+    if (length > 0)
+        memmove(adu + 4, data, length);
+    return finish(adu, 4 + length);
+}
+
+size_t ModBusCore::encodeWriteMultipleCoils(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t dataStartAddress, const uint8_t *packed, uint16_t count, uint8_t functionCode)
+{
+    size_t bytes = (count + 7) / 8;
+    if ((count == 0) || (count > 1968) || (bytes + 9 > capacity))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = dataStartAddress >> 8;
+    adu[3] = dataStartAddress & 0xff;
+    adu[4] = count >> 8;
+    adu[5] = count & 0xff;
+    adu[6] = bytes;
+    memcpy(adu + 7, packed, bytes);
+    if (count % 8)  // Bits beyond count must be zero on the wire
+        adu[6 + bytes] &= (1 << (count % 8)) - 1;
+    return finish(adu, 7 + bytes);
+}
+
+size_t ModBusCore::encodeWriteMultipleRegisters(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t dataStartAddress, const uint16_t *values, uint16_t count, uint8_t functionCode)
+{
+    if ((count == 0) || (count > 123) || ((size_t)count * 2 + 9 > capacity))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = dataStartAddress >> 8;
+    adu[3] = dataStartAddress & 0xff;
+    adu[4] = count >> 8;
+    adu[5] = count & 0xff;
+    adu[6] = count * 2;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        adu[7 + i * 2] = values[i] >> 8;
+        adu[8 + i * 2] = values[i] & 0xff;
+    }
+    return finish(adu, 7 + count * 2);
+}
+
+size_t ModBusCore::encodeReadWriteMultipleRegisters(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t readStartAddress, uint16_t readCount, uint16_t writeStartAddress, const uint16_t *values, uint16_t writeCount, uint8_t functionCode)
+{
+    if ((readCount == 0) || (readCount > 125) || (writeCount == 0) || (writeCount > 121) || ((size_t)writeCount * 2 + 13 > capacity))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = readStartAddress >> 8;
+    adu[3] = readStartAddress & 0xff;
+    adu[4] = readCount >> 8;
+    adu[5] = readCount & 0xff;
+    adu[6] = writeStartAddress >> 8;
+    adu[7] = writeStartAddress & 0xff;
+    adu[8] = writeCount >> 8;
+    adu[9] = writeCount & 0xff;
+    adu[10] = writeCount * 2;
+    for (uint16_t i = 0; i < writeCount; i++)
+    {
+        adu[11 + i * 2] = values[i] >> 8;
+        adu[12 + i * 2] = values[i] & 0xff;
+    }
+    return finish(adu, 11 + writeCount * 2);
+}
+
+// One sub request of reference type 6. The response byte count of fc 0x14 is limited to 0xF5, which
+// leaves 2 + 2N bytes for one sub response; the request data length of fc 0x15 is limited to 0xFB,
+// which leaves 7 + 2N bytes for one sub request.
+size_t ModBusCore::encodeReadFileRecord(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t fileNumber, uint16_t recordNumber, uint16_t recordLength, uint8_t functionCode)
+{
+    if ((recordLength == 0) || (recordLength > 121) || (capacity < 12))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = 7;     // Byte count of one sub request
+    adu[3] = 6;     // Reference type
+    adu[4] = fileNumber >> 8;
+    adu[5] = fileNumber & 0xff;
+    adu[6] = recordNumber >> 8;
+    adu[7] = recordNumber & 0xff;
+    adu[8] = recordLength >> 8;
+    adu[9] = recordLength & 0xff;
+    return finish(adu, 10);
+}
+
+size_t ModBusCore::encodeWriteFileRecord(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t fileNumber, uint16_t recordNumber, const uint16_t *values, uint16_t recordLength, uint8_t functionCode)
+{
+    if ((recordLength == 0) || (recordLength > 122) || ((size_t)recordLength * 2 + 12 > capacity))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = 7 + recordLength * 2;  // Request data length
+    adu[3] = 6;
+    adu[4] = fileNumber >> 8;
+    adu[5] = fileNumber & 0xff;
+    adu[6] = recordNumber >> 8;
+    adu[7] = recordNumber & 0xff;
+    adu[8] = recordLength >> 8;
+    adu[9] = recordLength & 0xff;
+    for (uint16_t i = 0; i < recordLength; i++)
+    {
+        adu[10 + i * 2] = values[i] >> 8;
+        adu[11 + i * 2] = values[i] & 0xff;
+    }
+    return finish(adu, 10 + recordLength * 2);
+}
+
+size_t ModBusCore::encodeMaskWriteRegister(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t dataAddress, uint16_t andMask, uint16_t orMask, uint8_t functionCode)
+{
+    if (capacity < 10)
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = dataAddress >> 8;
+    adu[3] = dataAddress & 0xff;
+    adu[4] = andMask >> 8;
+    adu[5] = andMask & 0xff;
+    adu[6] = orMask >> 8;
+    adu[7] = orMask & 0xff;
+    return finish(adu, 8);
+}
+
+size_t ModBusCore::encodeReadFIFOQueue(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint16_t fifoPointerAddress, uint8_t functionCode)
+{
+    if (capacity < 6)
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = fifoPointerAddress >> 8;
+    adu[3] = fifoPointerAddress & 0xff;
+    return finish(adu, 4);
+}
+
+size_t ModBusCore::encodeEncapsulatedInterfaceTransport(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint8_t meiType, const uint8_t *data, size_t length, uint8_t functionCode)
+{
+    if ((length + 5 > capacity) || (length + 5 > MODBUSCORE_MAX_ADU_SIZE))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = meiType;
+    if (length > 0)
+        memmove(adu + 3, data, length);
+    return finish(adu, 3 + length);
+}
+
+size_t ModBusCore::encodeReadDeviceIdentification(uint8_t *adu, size_t capacity, uint8_t slaveAddress, uint8_t readDeviceIdCode, uint8_t objectId, uint8_t functionCode)
+{
+    // Basic, regular, extended stream access and individual access
+    if ((readDeviceIdCode == 0) || (readDeviceIdCode > 4) || (capacity < 7))
+        return 0;
+
+    adu[0] = slaveAddress;
+    adu[1] = functionCode;
+    adu[2] = 0x0e;
+    adu[3] = readDeviceIdCode;
+    adu[4] = objectId;
+    return finish(adu, 5);
+}
+
+// Length of a frame that carries a byte count at the given position, followed by that many bytes and the CRC
+static int byteCountFrameLength(const uint8_t* adu, size_t size, size_t byteCountPosition)
+{
+    if (size <= byteCountPosition)
+        return 0;
+    return byteCountPosition + 1 + adu[byteCountPosition] + 2;
+}
+
+int ModBusCore::requestLength(const uint8_t *adu, size_t size)
+{
+    if (size < 2)
+        return 0;
+
+    switch (adu[1])
+    {
+    case 0x01:  // Read coils
+    case 0x02:  // Read discrete inputs
+    case 0x03:  // Read holding registers
+    case 0x04:  // Read input registers
+    case 0x05:  // Write single coil
+    case 0x06:  // Write single register
+    case 0x08:  // Diagnostics, sub functions with one data word
+        return 8;
+    case 0x07:  // Read exception status
+    case 0x0b:  // Get comm event counter
+    case 0x0c:  // Get comm event log
+    case 0x11:  // Report slave id
+        return 4;
+    case 0x0f:  // Write multiple coils
+    case 0x10:  // Write multiple registers
+        return byteCountFrameLength(adu, size, 6);
+    case 0x14:  // Read file record
+    case 0x15:  // Write file record
+        return byteCountFrameLength(adu, size, 2);
+    case 0x16:  // Mask write register
+        return 10;
+    case 0x17:  // Read/write multiple registers
+        return byteCountFrameLength(adu, size, 10);
+    case 0x18:  // Read FIFO queue
+        return 6;
+    case 0x2b:  // Encapsulated interface transport
+        if (size < 3)
+            return 0;
+        if (adu[2] == 0x0e)  // Read device identification
+            return 7;
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+int ModBusCore::responseLength(const uint8_t *adu, size_t size)
+{
+    if (size < 2)
+        return 0;
+
+    if (adu[1] & 0x80)  // Exception response
+        return 5;
+
+    switch (adu[1])
+    {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x0c:
+    case 0x11:
+    case 0x14:
+    case 0x15:
+    case 0x17:
+        return byteCountFrameLength(adu, size, 2);
+    case 0x05:
+    case 0x06:
+    case 0x08:
+    case 0x0b:
+    case 0x0f:
+    case 0x10:
+        return 8;
+    case 0x07:
+        return 5;
+    case 0x16:
+        return 10;
+    case 0x18:  // Two byte byte count
+        if (size < 4)
+            return 0;
+        return 4 + ((adu[2] << 8) | adu[3]) + 2;
+    case 0x2b:
+    {
+        // Read device identification: walk the object list
+        if (size < 3)
+            return 0;
+        if (adu[2] != 0x0e)
+            return -1;
+        if (size < 8)
+            return 0;
+        int numberOfObjects = adu[7];
+        size_t position = 8;
+        for (int i = 0; i < numberOfObjects; i++)
+        {
+            if (size < position + 2)
+                return 0;
+            position += 2 + adu[position + 1];
+        }
+        return position + 2;
+    }
+    default:
+        return -1;
+    }
+}
+
+int ModBusCore::decodeRegisters(const uint8_t *adu, size_t size, uint16_t *values, size_t capacity)
+{
+    // Address, function code, byte count, data, CRC
+    if ((size < 5) || (adu[2] % 2) || (size != (size_t)adu[2] + 5))
+        return -1;
+
+    size_t count = adu[2] / 2;
+    if (count > capacity)
+        return -1;
+
+    const uint8_t* data = adu + 3;
+    for (size_t i = 0; i < count; i++)
+        values[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+    return count;
+}
+
+int ModBusCore::decodeBits(const uint8_t *adu, size_t size, uint8_t *packed, size_t capacity)
+{
+    if ((size < 5) || (size != (size_t)adu[2] + 5) || (adu[2] > capacity))
+        return -1;
+
+    memcpy(packed, adu + 3, adu[2]);
+    return adu[2];
+}
+
+bool ModBusCore::isException(const uint8_t *adu, size_t size, uint8_t *exceptionCode)
+{
+    if ((size != 5) || !(adu[1] & 0x80))
+        return false;
+
+    *exceptionCode = adu[2];
+    return true;
+}
+
+int ModBusCore::decodeExceptionStatus(const uint8_t *adu, size_t size, uint8_t *status)
+{
+    // One byte with eight device specific exception status outputs
+    if (size != 5)
+        return -1;
+
+    *status = adu[2];
+    return 0;
+}
+
+int ModBusCore::decodeDiagnostics(const uint8_t *adu, size_t size, uint16_t *subFunctionCode, uint16_t *data)
+{
+    // Echo of the sub function followed by one data word
+    if (size != 8)
+        return -1;
+
+    *subFunctionCode = (adu[2] << 8) | adu[3];
+    *data = (adu[4] << 8) | adu[5];
+    return 0;
+}
+
+int ModBusCore::decodeCommEventCounter(const uint8_t *adu, size_t size, uint16_t *status, uint16_t *eventCount)
+{
+    if (size != 8)
+        return -1;
+
+    *status = (adu[2] << 8) | adu[3];
+    *eventCount = (adu[4] << 8) | adu[5];
+    return 0;
+}
+
+int ModBusCore::decodeCommEventLog(const uint8_t *adu, size_t size, uint16_t *status, uint16_t *eventCount, uint16_t *messageCount, uint8_t *events, size_t capacity)
+{
+    // Byte count, status, event count and message count words, then one byte per event
+    if ((size < 11) || (size != (size_t)adu[2] + 5) || ((size_t)adu[2] - 6 > capacity))
+        return -1;
+
+    *status = (adu[3] << 8) | adu[4];
+    *eventCount = (adu[5] << 8) | adu[6];
+    *messageCount = (adu[7] << 8) | adu[8];
+    memcpy(events, adu + 9, adu[2] - 6);
+    return adu[2] - 6;
+}
+
+int ModBusCore::decodeSlaveId(const uint8_t *adu, size_t size, const uint8_t **data)
+{
+    if ((size < 5) || (size != (size_t)adu[2] + 5))
+        return -1;
+
+    *data = adu + 3;
+    return adu[2];
+}
+
+int ModBusCore::decodeFileRecordRead(const uint8_t *adu, size_t size, uint16_t *values, size_t capacity)
+{
+    // Response data length, file response length, reference type, data
+    if ((size < 6) || (size != (size_t)adu[2] + 5) || (adu[3] != adu[2] - 1) || !(adu[3] & 1) || (adu[4] != 6))
+        return -1;
+
+    size_t count = (adu[3] - 1) / 2;
+    if (count > capacity)
+        return -1;
+
+    const uint8_t* data = adu + 5;
+    for (size_t i = 0; i < count; i++)
+        values[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+    return count;
+}
+
+int ModBusCore::decodeFileRecordWritten(const uint8_t *adu, size_t size, const uint8_t *request, size_t requestSize)
+{
+    // The response is an echo of the request, CRC included
+    if ((requestSize < 12) || (size != requestSize) || (memcmp(adu, request, size) != 0))
+        return -1;
+
+    return (request[8] << 8) | request[9];
+}
+
+int ModBusCore::decodeFIFOQueue(const uint8_t *adu, size_t size, uint16_t *values, size_t capacity)
+{
+    // Two byte byte count, FIFO count and the values
+    if (size < 8)
+        return -1;
+
+    size_t bytes = (adu[2] << 8) | adu[3];
+    size_t count = (adu[4] << 8) | adu[5];
+    if ((size != bytes + 6) || (bytes != count * 2 + 2) || (count > capacity))
+        return -1;
+
+    const uint8_t* data = adu + 6;
+    for (size_t i = 0; i < count; i++)
+        values[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+    return count;
+}
+
+int ModBusCore::decodeDeviceIdentification(const uint8_t *adu, size_t size, DeviceIdentification *identification, DeviceIdentificationObject *objects, size_t capacity)
+{
+    // MEI type, read device id code, conformity level, more follows, next object id, number of objects, objects
+    if ((size < 10) || (adu[2] != 0x0e) || (adu[7] > capacity))
+        return -1;
+
+    identification->readDeviceIdCode = adu[3];
+    identification->conformityLevel = adu[4];
+    identification->moreFollows = (adu[5] == 0xff);
+    identification->nextObjectId = adu[6];
+
+    int numberOfObjects = adu[7];
+    size_t position = 8;
+    for (int i = 0; i < numberOfObjects; i++)
+    {
+        if ((position + 2 > size - 2) || (position + 2 + adu[position + 1] > size - 2))
+            return -1;
+        objects[i].id = adu[position];
+        objects[i].length = adu[position + 1];
+        objects[i].value = adu + position + 2;
+        position += 2 + adu[position + 1];
+    }
+
+    if (position != size - 2)
+        return -1;
+    return numberOfObjects;
+}
+
+ModBusCoreMaster::ModBusCoreMaster(const Io &io)
+{
+    m_io = io;
+    m_state = STATE_IDLE;
+    m_interFrameTimeout = 20000;
+    m_broadcastTurnaroundDelay = 100000;
+    m_timeout = 0;
+    m_repeatCount = 0;
+    m_requestSize = 0;
+    m_responseSize = 0;
+    m_exceptionCode = 0;
+    m_transmitted = 0;
+    m_firstByteReceived = 0;
+    m_lastByteReceived = 0;
+    m_crcErrors = 0;
+}
+
+void ModBusCoreMaster::setInterFrameTimeout(uint32_t microseconds)
+{
+    m_interFrameTimeout = microseconds;
+}
+
+void ModBusCoreMaster::setBroadcastTurnaroundDelay(uint32_t microseconds)
+{
+    m_broadcastTurnaroundDelay = microseconds;
+}
+
+bool ModBusCoreMaster::start(const uint8_t *adu, size_t length, uint32_t timeoutMicroseconds, int repeatCount)
+{
+    if (m_state == STATE_WAITING)
+        return false;
+
+    m_state = STATE_IDLE;
+    if ((length < 4) || (length > MODBUSCORE_MAX_ADU_SIZE))
+        return false;
+
+    memcpy(m_request, adu, length);
+    m_requestSize = length;
+    m_timeout = timeoutMicroseconds;
+    m_repeatCount = (repeatCount > 0) ? repeatCount : 1;
+    m_exceptionCode = 0;
+
+    if (!transmit())
+        return false;
+    m_state = STATE_WAITING;
+    return true;
+}
+
+bool ModBusCoreMaster::transmit()
+{
+    // Whatever is still in the receiver belongs to an earlier transaction
+    uint8_t discard[MODBUSCORE_MAX_ADU_SIZE];
+    while (m_io.read(m_io.context, discard, sizeof(discard)) > 0) {}
+
+    m_repeatCount--;
+    m_responseSize = 0;
+    m_firstByteReceived = 0;
+    m_transmitted = m_io.nowUs(m_io.context);
+    if (m_io.write(m_io.context, m_request, m_requestSize) != (int)m_requestSize)
+    {
+        m_state = STATE_IO_ERROR;
+        return false;
+    }
+    return true;
+}
+
+ModBusCoreMaster::State ModBusCoreMaster::poll()
+{
+    if (m_state != STATE_WAITING)
+        return m_state;
+
+    uint64_t now = m_io.nowUs(m_io.context);
+
+    // A broadcast gets no answer, the slaves only need time to process it
+    if (m_request[0] == 0)
+    {
+        if (now - m_transmitted < m_broadcastTurnaroundDelay)
+            return m_state;
+        if (m_repeatCount == 0)
+            m_state = STATE_FINISHED;
+        else
+            transmit();
+        return m_state;
+    }
+
+    int received = m_io.read(m_io.context, m_response + m_responseSize, sizeof(m_response) - m_responseSize);
+    if (received < 0)
+    {
+        m_state = STATE_IO_ERROR;
+        return m_state;
+    }
+    if (received > 0)
+    {
+        if (m_responseSize == 0)
+            m_firstByteReceived = now;
+        m_lastByteReceived = now;
+        m_responseSize += received;
+    }
+
+    if (m_responseSize > 0)
+    {
+        int length;
+        if (m_io.responseLength != NULL)
+            length = m_io.responseLength(m_io.context, m_response, m_responseSize);
+        else
+            length = ModBusCore::responseLength(m_response, m_responseSize);
+
+        // The frame ends at its length, or when the line goes quiet if the length is unknown or never reached
+        if ((length > 0) && ((size_t)length <= m_responseSize))
+        {
+            if (completeFrame(length))
+                return m_state;
+        }
+        else if ((now - m_lastByteReceived >= m_interFrameTimeout) || (m_responseSize == sizeof(m_response)))
+        {
+            if (completeFrame(m_responseSize))
+                return m_state;
+        }
+    }
+
+    if (now - m_transmitted >= m_timeout)
+    {
+        if (m_repeatCount > 0)
+            transmit();
+        else
+            m_state = STATE_LOST;
+    }
+    return m_state;
+}
+
+bool ModBusCoreMaster::completeFrame(size_t size)
+{
+    if (m_io.frameReceived != NULL)
+        m_io.frameReceived(m_io.context, m_response, size);
+
+    // Frames with CRC error or from another slave are dropped, the transaction waits on
+    bool valid = (size >= 4) && ModBusCore::crcOK(m_response, size);
+    if (!valid || (m_response[0] != m_request[0]) || ((m_response[1] & 0x7f) != (m_request[1] & 0x7f)))
+    {
+        if (!valid)
+            m_crcErrors++;
+        m_responseSize = 0;
+        m_firstByteReceived = 0;
+        return false;
+    }
+
+    m_responseSize = size;
+    if (ModBusCore::isException(m_response, size, &m_exceptionCode))
+        m_state = STATE_EXCEPTION;
+    else
+        m_state = STATE_FINISHED;
+    return true;
+}
+
+void ModBusCoreMaster::abort()
+{
+    m_state = STATE_IDLE;
+    m_responseSize = 0;
+}
+
+uint64_t ModBusCoreMaster::nextPollUs() const
+{
+    if (m_request[0] == 0)
+        return m_transmitted + m_broadcastTurnaroundDelay;
+
+    uint64_t timeout = m_transmitted + m_timeout;
+    if ((m_responseSize > 0) && (m_lastByteReceived + m_interFrameTimeout < timeout))
+        return m_lastByteReceived + m_interFrameTimeout;
+    return timeout;
+}
+
+ModBusCoreMaster::State ModBusCoreMaster::state() const
+{
+    return m_state;
+}
+
+const uint8_t *ModBusCoreMaster::response() const
+{
+    return m_response;
+}
+
+size_t ModBusCoreMaster::responseSize() const
+{
+    return m_responseSize;
+}
+
+uint8_t ModBusCoreMaster::exceptionCode() const
+{
+    return m_exceptionCode;
+}
+
+uint64_t ModBusCoreMaster::responseTimeUs() const
+{
+    if (m_firstByteReceived == 0)
+        return 0;
+    return m_firstByteReceived - m_transmitted;
+}
+
+uint64_t ModBusCoreMaster::crcErrors() const
+{
+    return m_crcErrors;
+}
@@ -0,0 +1,163 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSCORE_H
+#define OPENFFUCONTROLMODBUSCORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The core is plain C++ without Qt, so it does not use modbus_global.h
+#if defined(OPENFFUCONTROL_QTMODBUS_LIBRARY) && defined(_WIN32)
+#  define MODBUSCORE_EXPORT __declspec(dllexport)
+#elif defined(OPENFFUCONTROL_QTMODBUS_LIBRARY)
+#  define MODBUSCORE_EXPORT __attribute__((visibility("default")))
+#else
+#  define MODBUSCORE_EXPORT
+#endif
+
+#define MODBUSCORE_MAX_ADU_SIZE     256
+
+// Protocol functions of Modbus RTU on caller supplied buffers.
+//
+// Nothing here allocates memory or depends on Qt, so the same code runs in the library, on
+// small controllers and in fuzzers. Encoders return the ADU length including CRC, or 0 if the
+// request does not fit into the buffer or its arguments are out of range. ModBus builds all its
+// requests and decodes all standard responses with these; ModBusCoreMaster runs the transactions.
+class MODBUSCORE_EXPORT ModBusCore
+{
+public:
+    static uint16_t crc16(const uint8_t* data, size_t length);
+    static bool crcOK(const uint8_t* adu, size_t length);
+
+    static size_t encodeRequest(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, const uint8_t* data, size_t length);
+    static size_t encodeReadRequest(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, uint16_t dataStartAddress, uint16_t count);     // 1 to 2000 bits for fc 0x01, 0x02, 1 to 125 registers otherwise
+    static size_t encodeWriteSingle(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint8_t functionCode, uint16_t dataAddress, uint16_t value);          // fc 0x05, 0x06
+    static size_t encodeDiagnostics(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t subFunctionCode, const uint8_t* data, size_t length, uint8_t functionCode = 0x08);
+    static size_t encodeWriteMultipleCoils(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t dataStartAddress, const uint8_t* packed, uint16_t count, uint8_t functionCode = 0x0f);
+    static size_t encodeWriteMultipleRegisters(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t dataStartAddress, const uint16_t* values, uint16_t count, uint8_t functionCode = 0x10);
+    static size_t encodeReadFileRecord(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t fileNumber, uint16_t recordNumber, uint16_t recordLength, uint8_t functionCode = 0x14);                     // 1 to 121 registers
+    static size_t encodeWriteFileRecord(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t fileNumber, uint16_t recordNumber, const uint16_t* values, uint16_t recordLength, uint8_t functionCode = 0x15);  // 1 to 122 registers
+    static size_t encodeMaskWriteRegister(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t dataAddress, uint16_t andMask, uint16_t orMask, uint8_t functionCode = 0x16);
+    static size_t encodeReadWriteMultipleRegisters(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t readStartAddress, uint16_t readCount, uint16_t writeStartAddress, const uint16_t* values, uint16_t writeCount, uint8_t functionCode = 0x17);  // Read 1 to 125, write 1 to 121
+    static size_t encodeReadFIFOQueue(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint16_t fifoPointerAddress, uint8_t functionCode = 0x18);
+    static size_t encodeEncapsulatedInterfaceTransport(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint8_t meiType, const uint8_t* data, size_t length, uint8_t functionCode = 0x2b);
+    static size_t encodeReadDeviceIdentification(uint8_t* adu, size_t capacity, uint8_t slaveAddress, uint8_t readDeviceIdCode, uint8_t objectId, uint8_t functionCode = 0x2b);  // Read device id code 1 to 4
+
+    // Total ADU length from the first bytes of a frame; 0 if more bytes are needed, -1 if the function code is unknown
+    static int requestLength(const uint8_t* adu, size_t size);
+    static int responseLength(const uint8_t* adu, size_t size);
+
+    typedef struct {
+        uint8_t readDeviceIdCode;
+        uint8_t conformityLevel;
+        bool moreFollows;
+        uint8_t nextObjectId;
+    } DeviceIdentification;
+
+    typedef struct {
+        uint8_t id;
+        uint8_t length;
+        const uint8_t* value;   // Points into the decoded ADU
+    } DeviceIdentificationObject;
+
+    // Decoders of complete responses with valid CRC; they return -1 if the response is malformed,
+    // otherwise the number of decoded items or 0 for responses of fixed layout
+    static bool isException(const uint8_t* adu, size_t size, uint8_t* exceptionCode);
+    static int decodeRegisters(const uint8_t* adu, size_t size, uint16_t* values, size_t capacity);   // fc 0x03, 0x04, 0x17; number of registers
+    static int decodeBits(const uint8_t* adu, size_t size, uint8_t* packed, size_t capacity);         // fc 0x01, 0x02; number of bytes, bit 0 of byte 0 first
+    static int decodeExceptionStatus(const uint8_t* adu, size_t size, uint8_t* status);               // fc 0x07
+    static int decodeDiagnostics(const uint8_t* adu, size_t size, uint16_t* subFunctionCode, uint16_t* data);     // fc 0x08
+    static int decodeCommEventCounter(const uint8_t* adu, size_t size, uint16_t* status, uint16_t* eventCount);   // fc 0x0b
+    static int decodeCommEventLog(const uint8_t* adu, size_t size, uint16_t* status, uint16_t* eventCount, uint16_t* messageCount, uint8_t* events, size_t capacity);  // fc 0x0c; number of events
+    static int decodeSlaveId(const uint8_t* adu, size_t size, const uint8_t** data);                   // fc 0x11; number of bytes at *data, which points into adu
+    static int decodeFileRecordRead(const uint8_t* adu, size_t size, uint16_t* values, size_t capacity);         // fc 0x14, one sub response; number of registers
+    static int decodeFileRecordWritten(const uint8_t* adu, size_t size, const uint8_t* request, size_t requestSize);  // fc 0x15, echo of the request; number of registers
+    static int decodeFIFOQueue(const uint8_t* adu, size_t size, uint16_t* values, size_t capacity);              // fc 0x18; number of registers
+    static int decodeDeviceIdentification(const uint8_t* adu, size_t size, DeviceIdentification* identification, DeviceIdentificationObject* objects, size_t capacity);  // fc 0x2b/0x0e; number of objects
+
+private:
+    static size_t finish(uint8_t* adu, size_t length);
+};
+
+// Transaction engine of a Modbus RTU master on fixed buffers.
+//
+// start() sends a request, poll() reads what the line delivered and advances the transaction:
+// a response is complete by its length or when the line stays quiet for the inter-frame timeout,
+// frames with CRC error or from another slave are dropped, and the request is repeated when the
+// timeout expires. The caller supplies the clock and the I/O, calls poll() whenever bytes arrive
+// and at nextPollUs() at the latest; nothing blocks and nothing is allocated.
+class MODBUSCORE_EXPORT ModBusCoreMaster
+{
+public:
+    typedef struct {
+        void* context;
+        int (*write)(void* context, const uint8_t* data, size_t length);    // Number of bytes written, -1 on error
+        int (*read)(void* context, uint8_t* data, size_t capacity);         // Number of bytes read, 0 if none, -1 on error
+        uint64_t (*nowUs)(void* context);                                   // Monotonic clock
+        int (*responseLength)(void* context, const uint8_t* adu, size_t size);      // Optional; ModBusCore::responseLength() if NULL
+        void (*frameReceived)(void* context, const uint8_t* adu, size_t size);      // Optional; every received frame, also the dropped ones
+    } Io;
+
+    typedef enum {
+        STATE_IDLE,
+        STATE_WAITING,      // Request sent, response or turnaround delay pending
+        STATE_FINISHED,     // Response received, or turnaround delay of a broadcast over
+        STATE_EXCEPTION,    // Exception response received
+        STATE_LOST,         // No valid response after the last attempt
+        STATE_IO_ERROR      // Write or read failed
+    } State;
+
+    explicit ModBusCoreMaster(const Io &io);
+
+    void setInterFrameTimeout(uint32_t microseconds);       // 0 if read() delivers whole frames
+    void setBroadcastTurnaroundDelay(uint32_t microseconds);
+
+    // Sends the request; repeatCount is the number of attempts, a broadcast is sent that often as well
+    bool start(const uint8_t* adu, size_t length, uint32_t timeoutMicroseconds, int repeatCount);
+    State poll();
+    void abort();
+    uint64_t nextPollUs() const;    // Time of the next timeout while waiting
+
+    State state() const;
+    const uint8_t* response() const;
+    size_t responseSize() const;
+    uint8_t exceptionCode() const;
+    uint64_t responseTimeUs() const;
+    uint64_t crcErrors() const;     // Frames dropped for CRC error or truncation, over all transactions
+
+private:
+    Io m_io;
+    State m_state;
+    uint32_t m_interFrameTimeout;
+    uint32_t m_broadcastTurnaroundDelay;
+    uint32_t m_timeout;
+    int m_repeatCount;
+    uint8_t m_request[MODBUSCORE_MAX_ADU_SIZE];
+    size_t m_requestSize;
+    uint8_t m_response[MODBUSCORE_MAX_ADU_SIZE];
+    size_t m_responseSize;
+    uint8_t m_exceptionCode;
+    uint64_t m_transmitted;
+    uint64_t m_firstByteReceived;
+    uint64_t m_lastByteReceived;
+    uint64_t m_crcErrors;
+
+    bool transmit();
+    bool completeFrame(size_t size);
+};
+
+#endif // OPENFFUCONTROLMODBUSCORE_H
@@ -0,0 +1,203 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSCOROUTINE_H
+#define OPENFFUCONTROLMODBUSCOROUTINE_H
+
+// C++20 coroutine interface. Build the library with "qmake CONFIG+=modbus_coroutines" and
+// compile the application as C++20 to use it. Example:
+//
+//   ModBusTask configureFan(ModBus* bus, quint8 fan)
+//   {
+//       ModBusResult<QList<quint16> > config = co_await ModBusCoroutine::readHoldingRegisters(bus, fan, 0x10, 4);
+//       if (!config.ok())
+//           co_return;
+//       co_await ModBusCoroutine::writeSingleRegister(bus, fan, 0x10, config.value.at(0) | 0x01);
+//   }
+//
+// A procedure is resumed on the bus thread when its transaction has finished, so any number of
+// them can run concurrently without a thread of their own. The awaitables enable futures on the bus.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+
+#include "modbus.h"
+
+template <typename T>
+struct ModBusResult
+{
+    ModBusFuture::State state = ModBusFuture::STATE_CANCELED;
+    quint8 exceptionCode = 0;
+    T value = T();
+
+    bool ok() const { return state == ModBusFuture::STATE_FINISHED; }
+};
+
+// Return type of fire-and-forget bus procedures; the coroutine frame frees itself when done
+struct ModBusTask
+{
+    struct promise_type
+    {
+        ModBusTask get_return_object() { return ModBusTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Awaits a future and decodes its response with the given function
+template <typename T>
+class ModBusAwaitable
+{
+public:
+    typedef T (*Decoder)(const ModBusFuture &future);
+
+    ModBusAwaitable(ModBusFuture future, Decoder decoder) : m_future(future), m_decoder(decoder) {}
+
+    bool await_ready() const { return !m_future.isValid() || m_future.isFinished(); }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // Resumes right away if the future got resolved in the meantime
+        m_future.then([handle](const ModBusFuture &) { handle.resume(); });
+    }
+
+    ModBusResult<T> await_resume() const
+    {
+        ModBusResult<T> result;
+        result.state = m_future.state();
+        result.exceptionCode = m_future.exceptionCode();
+        if (result.ok() && (m_decoder != nullptr))
+            result.value = m_decoder(m_future);
+        return result;
+    }
+
+private:
+    ModBusFuture m_future;
+    Decoder m_decoder;
+};
+
+namespace ModBusCoroutine
+{
+    inline ModBusFuture futureOf(ModBus* bus, quint64 telegramID)
+    {
+        return bus->future(telegramID);
+    }
+
+    inline QList<quint16> decodeRegisters(const ModBusFuture &future)
+    {
+        QList<quint16> data;
+        QByteArray payload = future.payload();
+        if (payload.size() < 1)
+            return data;
+        int count = (quint8)payload.at(0) / 2;
+        if (payload.size() < count * 2 + 1)
+            return data;
+        data.reserve(count);
+        for (int i = 0; i < count; i++)
+            data.append(((quint8)payload.at(i*2 + 1) << 8) | (quint8)payload.at(i*2 + 2));
+        return data;
+    }
+
+    inline QList<bool> decodeBits(const ModBusFuture &future)
+    {
+        // Without the requested count the padding bits of the last byte are returned as well
+        QList<bool> on;
+        QByteArray payload = future.payload();
+        if (payload.size() < 1)
+            return on;
+        int bytes = qMin((int)(quint8)payload.at(0), payload.size() - 1);
+        on.reserve(bytes * 8);
+        for (int i = 0; i < bytes * 8; i++)
+            on.append((quint8)payload.at(1 + i / 8) & (1 << (i % 8)));
+        return on;
+    }
+
+    inline QByteArray decodeRaw(const ModBusFuture &future)
+    {
+        return future.payload();
+    }
+
+    inline bool decodeNothing(const ModBusFuture &future)
+    {
+        return future.isSuccessful();
+    }
+
+    inline ModBusAwaitable<QList<bool> > readCoils(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, quint16 count = 1)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<QList<bool> >(futureOf(bus, bus->readCoils(slaveAddress, dataStartAddress, count)), decodeBits);
+    }
+
+    inline ModBusAwaitable<QList<bool> > readDiscreteInputs(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, quint16 count = 1)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<QList<bool> >(futureOf(bus, bus->readDiscreteInputs(slaveAddress, dataStartAddress, count)), decodeBits);
+    }
+
+    inline ModBusAwaitable<QList<quint16> > readHoldingRegisters(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, quint8 count = 1)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<QList<quint16> >(futureOf(bus, bus->readHoldingRegisters(slaveAddress, dataStartAddress, count)), decodeRegisters);
+    }
+
+    inline ModBusAwaitable<QList<quint16> > readInputRegisters(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, quint8 count = 1)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<QList<quint16> >(futureOf(bus, bus->readInputRegisters(slaveAddress, dataStartAddress, count)), decodeRegisters);
+    }
+
+    inline ModBusAwaitable<bool> writeSingleCoil(ModBus* bus, quint8 slaveAddress, quint16 dataAddress, bool on)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<bool>(futureOf(bus, bus->writeSingleCoil(slaveAddress, dataAddress, on)), decodeNothing);
+    }
+
+    inline ModBusAwaitable<bool> writeSingleRegister(ModBus* bus, quint8 slaveAddress, quint16 dataAddress, quint16 data)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<bool>(futureOf(bus, bus->writeSingleRegister(slaveAddress, dataAddress, data)), decodeNothing);
+    }
+
+    inline ModBusAwaitable<bool> writeMultipleCoils(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<bool>(futureOf(bus, bus->writeMultipleCoils(slaveAddress, dataStartAddress, on)), decodeNothing);
+    }
+
+    inline ModBusAwaitable<bool> writeMultipleRegisters(ModBus* bus, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<bool>(futureOf(bus, bus->writeMultipleRegisters(slaveAddress, dataStartAddress, data)), decodeNothing);
+    }
+
+    inline ModBusAwaitable<bool> maskWriteRegister(ModBus* bus, quint8 slaveAddress, quint16 dataAddress, quint16 andMask, quint16 orMask)
+    {
+        bus->setFuturesEnabled(true);
+        return ModBusAwaitable<bool>(futureOf(bus, bus->maskWriteRegister(slaveAddress, dataAddress, andMask, orMask)), decodeNothing);
+    }
+
+    inline ModBusAwaitable<QByteArray> sendRawRequest(ModBus* bus, quint8 slaveAddress, quint8 functionCode, QByteArray payload)
+    {
+        return ModBusAwaitable<QByteArray>(bus->sendRawRequestAsync(slaveAddress, functionCode, payload), decodeRaw);
+    }
+}
+
+#endif // __cpp_impl_coroutine
+
+#endif // OPENFFUCONTROLMODBUSCOROUTINE_H
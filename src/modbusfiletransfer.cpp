@@ -0,0 +1,304 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QPointer>
+
+#include "modbusfiletransfer.h"
+#include "modbus.h"
+
+// The byte count of fc 0x14 responses is limited to 0xF5 and a read sub response takes 2 + 2N bytes.
+// The request data length of fc 0x15 is limited to 0xFB and a write sub request takes 7 + 2N bytes.
+#define MODBUS_FILE_READ_MAX_REGISTERS  121
+#define MODBUS_FILE_WRITE_MAX_REGISTERS 122
+#define MODBUS_FILE_RECORDS             10000
+
+ModBusFileTransfer::ModBusFileTransfer(QObject *parent, ModBus *bus, bool debug) : QObject(parent)
+{
+    m_bus = bus;
+    m_debug = debug;
+    m_chunksInFlightMax = 2;
+    m_maxRetries = 3;
+    m_write = false;
+    m_slaveAddress = 0;
+    m_byteCount = 0;
+    m_chunksInFlight = 0;
+    m_registersDone = 0;
+    m_running = false;
+    m_failed = false;
+    m_filling = false;
+    m_activeMilliseconds = 0;
+
+    // Chunks report through their futures
+    m_bus->setFuturesEnabled(true);
+}
+
+void ModBusFileTransfer::setChunksInFlight(int count)
+{
+    if (count < 1)
+        count = 1;
+    m_chunksInFlightMax = count;
+}
+
+void ModBusFileTransfer::setMaxRetries(int retries)
+{
+    m_maxRetries = retries;
+}
+
+bool ModBusFileTransfer::startRead(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, int byteCount)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusFileTransfer::startRead() %i bytes from slave %i file %i record %i.\n", byteCount, slaveAddress, fileNumber, recordNumber);
+        fflush(stdout);
+    }
+
+    if (isBusy() || (byteCount <= 0) || (recordNumber >= MODBUS_FILE_RECORDS))
+        return false;
+
+    m_write = false;
+    m_slaveAddress = slaveAddress;
+    m_byteCount = byteCount;
+    m_data = QByteArray(((byteCount + 1) / 2) * 2, 0);
+    return start(fileNumber, recordNumber);
+}
+
+bool ModBusFileTransfer::startWrite(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, QByteArray data)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusFileTransfer::startWrite() %i bytes to slave %i file %i record %i.\n", data.size(), slaveAddress, fileNumber, recordNumber);
+        fflush(stdout);
+    }
+
+    if (isBusy() || data.isEmpty() || (recordNumber >= MODBUS_FILE_RECORDS))
+        return false;
+
+    m_write = true;
+    m_slaveAddress = slaveAddress;
+    m_byteCount = data.size();
+    m_data = data;
+    if (m_data.size() % 2)
+        m_data.append((char)0);
+    return start(fileNumber, recordNumber);
+}
+
+bool ModBusFileTransfer::resume()
+{
+    if (isBusy() || m_chunks.isEmpty() || isComplete())
+        return false;
+
+    m_pendingChunks.clear();
+    for (int i = 0; i < m_chunks.count(); i++)
+    {
+        if (!m_chunks.at(i).done)
+        {
+            m_chunks[i].retries = 0;
+            m_pendingChunks.append(i);
+        }
+    }
+
+    m_failed = false;
+    m_running = true;
+    m_elapsed.start();
+    fillWindow();
+    return true;
+}
+
+void ModBusFileTransfer::abort()
+{
+    if (!m_running)
+        return;
+
+    // Chunks already queued still complete and count for a later resume()
+    m_pendingChunks.clear();
+    stop();
+    emit signal_finished(false);
+}
+
+bool ModBusFileTransfer::isBusy() const
+{
+    return m_running || (m_chunksInFlight > 0);
+}
+
+bool ModBusFileTransfer::isComplete() const
+{
+    return !m_chunks.isEmpty() && (m_registersDone * 2 == m_data.size());
+}
+
+QByteArray ModBusFileTransfer::data() const
+{
+    return m_data.left(m_byteCount);
+}
+
+int ModBusFileTransfer::bytesTransferred() const
+{
+    return qMin(m_registersDone * 2, m_byteCount);
+}
+
+int ModBusFileTransfer::bytesTotal() const
+{
+    return m_byteCount;
+}
+
+double ModBusFileTransfer::bytesPerSecond() const
+{
+    qint64 milliseconds = m_activeMilliseconds;
+    if (m_running)
+        milliseconds += m_elapsed.elapsed();
+    if (milliseconds <= 0)
+        return 0.0;
+    return bytesTransferred() * 1000.0 / milliseconds;
+}
+
+bool ModBusFileTransfer::start(quint16 fileNumber, quint16 recordNumber)
+{
+    int maxRegisters = m_write ? MODBUS_FILE_WRITE_MAX_REGISTERS : MODBUS_FILE_READ_MAX_REGISTERS;
+    int registers = m_data.size() / 2;
+
+    m_chunks.clear();
+    m_pendingChunks.clear();
+    int offset = 0;
+    while (offset < registers)
+    {
+        Chunk chunk;
+        chunk.fileNumber = fileNumber;
+        chunk.recordNumber = recordNumber;
+        chunk.offset = offset;
+        chunk.length = qMin(qMin(maxRegisters, registers - offset), MODBUS_FILE_RECORDS - recordNumber);
+        chunk.retries = 0;
+        chunk.done = false;
+        m_pendingChunks.append(m_chunks.count());
+        m_chunks.append(chunk);
+
+        offset += chunk.length;
+        recordNumber += chunk.length;
+        if (recordNumber >= MODBUS_FILE_RECORDS)
+        {
+            recordNumber = 0;
+            fileNumber++;
+        }
+    }
+
+    m_registersDone = 0;
+    m_failed = false;
+    m_running = true;
+    m_activeMilliseconds = 0;
+    m_elapsed.start();
+    fillWindow();
+    return true;
+}
+
+void ModBusFileTransfer::fillWindow()
+{
+    // A future that is already resolved calls back immediately; the outer call keeps filling
+    if (m_filling)
+        return;
+
+    m_filling = true;
+    while (m_running && !m_failed && !m_pendingChunks.isEmpty() && (m_chunksInFlight < m_chunksInFlightMax))
+        sendChunk(m_pendingChunks.takeFirst());
+    m_filling = false;
+
+    checkFinished();
+}
+
+void ModBusFileTransfer::sendChunk(int index)
+{
+    const Chunk &chunk = m_chunks.at(index);
+    quint64 telegramID;
+
+    if (m_write)
+    {
+        QList<quint16> words;
+        for (int i = chunk.offset; i < chunk.offset + chunk.length; i++)
+            words.append(((quint8)m_data.at(i*2) << 8) | (quint8)m_data.at(i*2 + 1));
+        telegramID = m_bus->writeFileRecord(m_slaveAddress, chunk.fileNumber, chunk.recordNumber, words);
+    }
+    else
+        telegramID = m_bus->readFileRecord(m_slaveAddress, chunk.fileNumber, chunk.recordNumber, chunk.length);
+
+    m_chunksInFlight++;
+
+    QPointer<ModBusFileTransfer> transfer(this);
+    m_bus->future(telegramID).then([transfer, index](const ModBusFuture &future) {
+        if (!transfer.isNull())
+            transfer->chunkFinished(index, future);
+    });
+}
+
+void ModBusFileTransfer::chunkFinished(int index, const ModBusFuture &future)
+{
+    m_chunksInFlight--;
+    Chunk &chunk = m_chunks[index];
+
+    bool ok = future.isSuccessful();
+    if (ok && !m_write)
+    {
+        // Response data length, file response length, reference type, data
+        QByteArray payload = future.payload();
+        ok = (payload.size() == 3 + chunk.length * 2);
+        if (ok)
+            m_data.replace(chunk.offset * 2, chunk.length * 2, payload.mid(3));
+    }
+
+    if (ok)
+    {
+        if (!chunk.done)
+        {
+            chunk.done = true;
+            m_registersDone += chunk.length;
+        }
+        if (m_running)
+            emit signal_progress(bytesTransferred(), bytesTotal(), bytesPerSecond());
+    }
+    else if (m_running)
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusFileTransfer::chunkFinished: Chunk at record %i of file %i failed with state %i.\n", chunk.recordNumber, chunk.fileNumber, future.state());
+            fflush(stdout);
+        }
+
+        // Lost and garbled chunks are asked again, an exception will not go away by that
+        bool retry = (future.state() == ModBusFuture::STATE_LOST) || (future.state() == ModBusFuture::STATE_FINISHED);
+        if (retry && (chunk.retries < m_maxRetries))
+        {
+            chunk.retries++;
+            m_pendingChunks.prepend(index);
+        }
+        else
+            m_failed = true;
+    }
+
+    fillWindow();
+}
+
+void ModBusFileTransfer::checkFinished()
+{
+    if (!m_running || (m_chunksInFlight > 0))
+        return;
+    if (!m_failed && !m_pendingChunks.isEmpty())
+        return;
+
+    stop();
+    emit signal_finished(!m_failed && isComplete());
+}
+
+void ModBusFileTransfer::stop()
+{
+    m_running = false;
+    m_activeMilliseconds += m_elapsed.elapsed();
+}
@@ -0,0 +1,102 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSFILETRANSFER_H
+#define OPENFFUCONTROLMODBUSFILETRANSFER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+
+#include "modbus_global.h"
+#include "modbusfuture.h"
+
+class ModBus;
+
+// Streams a blob from or to the file records of one slave with fc 0x14/0x15.
+//
+// The blob is split into requests of maximum size (121 registers read, 122 written) that do
+// not cross the end of a file; the transfer continues at record 0 of the next file. Several
+// chunks are kept queued so the next request is on the line as soon as the previous response
+// is in. Chunks go to the standard priority queue, so high priority telegrams interleave.
+// A lost chunk is requested again up to the retry limit; if it still fails, the transfer
+// stops and resume() requests only the chunks that are missing.
+class MODBUSSHARED_EXPORT ModBusFileTransfer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ModBusFileTransfer(QObject *parent, ModBus* bus, bool debug = false);
+
+    void setChunksInFlight(int count);
+    void setMaxRetries(int retries);
+
+    // Return false if a transfer is still in progress
+    bool startRead(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, int byteCount);
+    bool startWrite(quint8 slaveAddress, quint16 fileNumber, quint16 recordNumber, QByteArray data); // Odd length is padded with a zero byte
+    bool resume();
+    void abort();
+
+    bool isBusy() const;
+    bool isComplete() const;
+    QByteArray data() const;    // Read blob, valid when complete
+
+    int bytesTransferred() const;
+    int bytesTotal() const;
+    double bytesPerSecond() const;
+
+private:
+    typedef struct {
+        quint16 fileNumber;
+        quint16 recordNumber;
+        int offset;             // In registers from the start of the blob
+        quint8 length;          // In registers
+        int retries;
+        bool done;
+    } Chunk;
+
+    ModBus* m_bus;
+    bool m_debug;
+    int m_chunksInFlightMax;
+    int m_maxRetries;
+
+    bool m_write;
+    quint8 m_slaveAddress;
+    QByteArray m_data;
+    int m_byteCount;
+    QList<Chunk> m_chunks;
+    QList<int> m_pendingChunks; // Chunks to be sent, in order
+    int m_chunksInFlight;
+    int m_registersDone;
+    bool m_running;
+    bool m_failed;
+    bool m_filling;
+    QElapsedTimer m_elapsed;
+    qint64 m_activeMilliseconds; // Transfer time of previous runs before a resume
+
+    bool start(quint16 fileNumber, quint16 recordNumber);
+    void fillWindow();
+    void sendChunk(int index);
+    void stop();
+    void chunkFinished(int index, const ModBusFuture &future);
+    void checkFinished();
+
+signals:
+    void signal_progress(int bytesTransferred, int bytesTotal, double bytesPerSecond);
+    void signal_finished(bool success);
+};
+
+#endif // OPENFFUCONTROLMODBUSFILETRANSFER_H
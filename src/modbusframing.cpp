@@ -0,0 +1,33 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include "modbusframing.h"
+#include "modbuscore.h"
+
+// Frame lengths are computed by the Qt independent core
+
+int ModBusFraming::requestLength(const char *adu, int size)
+{
+    if (size < 0)
+        return 0;
+    return ModBusCore::requestLength((const uint8_t*)adu, size);
+}
+
+int ModBusFraming::responseLength(const char *adu, int size)
+{
+    if (size < 0)
+        return 0;
+    return ModBusCore::responseLength((const uint8_t*)adu, size);
+}
@@ -0,0 +1,35 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSFRAMING_H
+#define OPENFFUCONTROLMODBUSFRAMING_H
+
+#include <QByteArray>
+
+// Length calculation of RTU frames from their first bytes.
+// All functions return the total ADU length including address and CRC,
+// 0 if more bytes are needed to know the length and -1 if the function
+// code is unknown and the length can not be determined.
+class ModBusFraming
+{
+public:
+    static int requestLength(const char* adu, int size);
+    static int responseLength(const char* adu, int size);
+
+    static int requestLength(const QByteArray &adu) { return requestLength(adu.constData(), adu.size()); }
+    static int responseLength(const QByteArray &adu) { return responseLength(adu.constData(), adu.size()); }
+};
+
+#endif // OPENFFUCONTROLMODBUSFRAMING_H
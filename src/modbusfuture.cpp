@@ -0,0 +1,224 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QThread>
+#include <QTimer>
+
+#include "modbusfuture.h"
+
+ModBusFuture::ModBusFuture()
+{
+}
+
+ModBusFuture::ModBusFuture(QSharedPointer<ModBusFutureState> state)
+{
+    d = state;
+}
+
+bool ModBusFuture::isValid() const
+{
+    return !d.isNull();
+}
+
+quint64 ModBusFuture::telegramID() const
+{
+    if (d.isNull())
+        return 0;
+    return d->m_telegramID;
+}
+
+ModBusFuture::State ModBusFuture::state() const
+{
+    if (d.isNull())
+        return STATE_CANCELED;
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_state;
+}
+
+bool ModBusFuture::isFinished() const
+{
+    return (state() != STATE_PENDING);
+}
+
+bool ModBusFuture::isSuccessful() const
+{
+    return (state() == STATE_FINISHED);
+}
+
+quint8 ModBusFuture::slaveAddress() const
+{
+    if (d.isNull())
+        return 0;
+    return d->m_slaveAddress;
+}
+
+quint8 ModBusFuture::functionCode() const
+{
+    if (d.isNull())
+        return 0;
+    return d->m_functionCode;
+}
+
+QByteArray ModBusFuture::response() const
+{
+    if (d.isNull())
+        return QByteArray();
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_response;
+}
+
+QByteArray ModBusFuture::payload() const
+{
+    QByteArray adu = response();
+    if (adu.size() < 4)
+        return QByteArray();
+    return adu.mid(2, adu.size() - 4);
+}
+
+quint8 ModBusFuture::exceptionCode() const
+{
+    if (d.isNull())
+        return 0;
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_exceptionCode;
+}
+
+qint64 ModBusFuture::responseTimeNs() const
+{
+    if (d.isNull())
+        return -1;
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_responseTimeNs;
+}
+
+ModBusTimestamps ModBusFuture::timestamps() const
+{
+    if (d.isNull())
+        return ModBusTimestamps();
+    QMutexLocker locker(&d->m_mutex);
+    return d->m_timestamps;
+}
+
+void ModBusFuture::then(std::function<void (const ModBusFuture &)> continuation)
+{
+    if (d.isNull())
+        return;
+
+    d->m_mutex.lock();
+    if (d->m_state == STATE_PENDING)
+    {
+        d->m_continuations.append(continuation);
+        d->m_mutex.unlock();
+        return;
+    }
+    d->m_mutex.unlock();
+    continuation(*this);
+}
+
+bool ModBusFuture::waitForFinished(int milliseconds) const
+{
+    if (d.isNull())
+        return false;
+
+    QMutexLocker locker(&d->m_mutex);
+    if (d->m_state != STATE_PENDING)
+        return true;
+
+    if (QThread::currentThread() != d->m_busThread)
+    {
+        // The bus thread resolves us and wakes us up; wait again after a spurious wakeup
+        QElapsedTimer clock;
+        clock.start();
+        while (d->m_state == STATE_PENDING)
+        {
+            qint64 remaining = milliseconds - clock.elapsed();
+            if (remaining <= 0)
+                break;
+            d->m_finished.wait(&d->m_mutex, remaining);
+        }
+        return (d->m_state != STATE_PENDING);
+    }
+
+    // On the bus thread the response can only be parsed if events are processed meanwhile
+    QEventLoop loop;
+    QTimer timeout;
+    timeout.setSingleShot(true);
+    QObject::connect(&timeout, SIGNAL(timeout()), &loop, SLOT(quit()));
+    timeout.start(milliseconds);
+    d->m_eventLoops.append(&loop);
+    locker.unlock();
+
+    loop.exec();
+
+    locker.relock();
+    d->m_eventLoops.removeOne(&loop);
+    return (d->m_state != STATE_PENDING);
+}
+
+bool ModBusFuture::waitForAll(const QList<ModBusFuture> &futures, int milliseconds)
+{
+    QElapsedTimer clock;
+    clock.start();
+
+    foreach (const ModBusFuture &future, futures)
+    {
+        int remaining = milliseconds - clock.elapsed();
+        if ((remaining <= 0) && !future.isFinished())
+            return false;
+        if (!future.waitForFinished(qMax(remaining, 0)))
+            return false;
+    }
+    return true;
+}
+
+ModBusFutureState::ModBusFutureState(quint64 telegramID, quint8 slaveAddress, quint8 functionCode, QThread *busThread)
+{
+    m_telegramID = telegramID;
+    m_slaveAddress = slaveAddress;
+    m_functionCode = functionCode;
+    m_busThread = busThread;
+    m_state = ModBusFuture::STATE_PENDING;
+    m_exceptionCode = 0;
+    m_responseTimeNs = -1;
+    m_timestamps = ModBusTimestamps();
+}
+
+void ModBusFutureState::resolve(const QSharedPointer<ModBusFutureState> &state, ModBusFuture::State result, const QByteArray &response, quint8 exceptionCode, qint64 responseTimeNs, const ModBusTimestamps &timestamps)
+{
+    state->m_mutex.lock();
+    if (state->m_state != ModBusFuture::STATE_PENDING)
+    {
+        state->m_mutex.unlock();
+        return;
+    }
+    state->m_state = result;
+    state->m_response = response;
+    state->m_exceptionCode = exceptionCode;
+    state->m_responseTimeNs = responseTimeNs;
+    state->m_timestamps = timestamps;
+    QList<std::function<void(const ModBusFuture&)> > continuations = state->m_continuations;
+    state->m_continuations.clear();
+    foreach (QEventLoop* loop, state->m_eventLoops)
+        loop->quit();
+    state->m_finished.wakeAll();
+    state->m_mutex.unlock();
+
+    // Continuations run outside the lock so that they may enqueue further telegrams
+    ModBusFuture future(state);
+    foreach (const std::function<void(const ModBusFuture&)> &continuation, continuations)
+        continuation(future);
+}
@@ -0,0 +1,102 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSFUTURE_H
+#define OPENFFUCONTROLMODBUSFUTURE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWaitCondition>
+#include <functional>
+
+#include "modbus_global.h"
+#include "modbustelegram.h"
+
+class QEventLoop;
+class QThread;
+class ModBusFutureState;
+
+// Completion handle of one telegram. It is resolved directly by the bus when the response
+// of exactly this telegram has been parsed, when the telegram is lost or when it is discarded.
+// Copies share the same state.
+class MODBUSSHARED_EXPORT ModBusFuture
+{
+public:
+    typedef enum {
+        STATE_PENDING,
+        STATE_FINISHED,     // Response received, or broadcast sent
+        STATE_EXCEPTION,    // Slave answered with an exception
+        STATE_LOST,         // No answer after all repetitions
+        STATE_CANCELED      // Telegram was removed from the queue
+    } State;
+
+    ModBusFuture();
+    explicit ModBusFuture(QSharedPointer<ModBusFutureState> state);
+
+    bool isValid() const;
+    quint64 telegramID() const;
+    State state() const;
+    bool isFinished() const;
+    bool isSuccessful() const;
+
+    quint8 slaveAddress() const;
+    quint8 functionCode() const;
+    QByteArray response() const;    // Complete ADU of the response including CRC
+    QByteArray payload() const;     // Response data without address, function code and CRC
+    quint8 exceptionCode() const;
+    qint64 responseTimeNs() const;  // From the last request to the first byte received, -1 if nothing was received
+    ModBusTimestamps timestamps() const;
+
+    // The continuation is called on the bus thread when the future is resolved,
+    // or immediately if it is already resolved
+    void then(std::function<void(const ModBusFuture&)> continuation);
+
+    // Waits until resolved; returns false on timeout. Called on the bus thread this runs a local event loop.
+    bool waitForFinished(int milliseconds = 10000) const;
+    static bool waitForAll(const QList<ModBusFuture> &futures, int milliseconds = 10000);
+
+private:
+    QSharedPointer<ModBusFutureState> d;
+};
+
+// Shared state of a future; only the bus writes it
+class MODBUSSHARED_EXPORT ModBusFutureState
+{
+public:
+    ModBusFutureState(quint64 telegramID, quint8 slaveAddress, quint8 functionCode, QThread* busThread);
+
+    static void resolve(const QSharedPointer<ModBusFutureState> &state, ModBusFuture::State result, const QByteArray &response = QByteArray(), quint8 exceptionCode = 0, qint64 responseTimeNs = -1, const ModBusTimestamps &timestamps = ModBusTimestamps());
+
+private:
+    friend class ModBusFuture;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_finished;
+    quint64 m_telegramID;
+    quint8 m_slaveAddress;
+    quint8 m_functionCode;
+    QThread* m_busThread;
+    ModBusFuture::State m_state;
+    QByteArray m_response;
+    quint8 m_exceptionCode;
+    qint64 m_responseTimeNs;
+    ModBusTimestamps m_timestamps;
+    QList<std::function<void(const ModBusFuture&)> > m_continuations;
+    QList<QEventLoop*> m_eventLoops;
+};
+
+#endif // OPENFFUCONTROLMODBUSFUTURE_H
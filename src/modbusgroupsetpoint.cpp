@@ -0,0 +1,192 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include "modbusgroupsetpoint.h"
+#include "modbus.h"
+
+ModBusGroupSetpoint::ModBusGroupSetpoint(QObject *parent, ModBus *bus, bool debug) : QObject(parent)
+{
+    m_bus = bus;
+    m_debug = debug;
+    m_verifyEnabled = true;
+    m_step = STEP_IDLE;
+    m_batch = NULL;
+    m_dataAddress = 0;
+}
+
+void ModBusGroupSetpoint::setBusMembers(QList<quint8> slaveAddresses)
+{
+    m_busMembers.clear();
+    foreach (quint8 slaveAddress, slaveAddresses)
+        m_busMembers.insert(slaveAddress);
+}
+
+void ModBusGroupSetpoint::setVerifyEnabled(bool on)
+{
+    m_verifyEnabled = on;
+}
+
+bool ModBusGroupSetpoint::writeRegister(quint16 dataAddress, QList<quint8> slaveAddresses, quint16 value)
+{
+    QMap<quint8, quint16> valuesBySlave;
+    foreach (quint8 slaveAddress, slaveAddresses)
+        valuesBySlave.insert(slaveAddress, value);
+    return writeRegister(dataAddress, valuesBySlave);
+}
+
+bool ModBusGroupSetpoint::writeRegister(quint16 dataAddress, QMap<quint8, quint16> valuesBySlave)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusGroupSetpoint::writeRegister() for %i slaves.\n", valuesBySlave.count());
+        fflush(stdout);
+    }
+
+    if (m_step != STEP_IDLE)
+        return false;
+
+    m_dataAddress = dataAddress;
+    m_values = valuesBySlave;
+    m_broadcastRecipients.clear();
+    m_failedSlaves.clear();
+
+    // Broadcast is possible only if no bus member outside the group would get the value
+    bool coversBus = !m_busMembers.isEmpty();
+    foreach (quint8 member, m_busMembers)
+    {
+        if (!m_values.contains(member))
+            coversBus = false;
+    }
+
+    // The most common value goes by broadcast, if at least two slaves share it
+    bool useBroadcast = false;
+    quint16 broadcastValue = 0;
+    if (coversBus)
+    {
+        QMap<quint16, int> occurrences;
+        foreach (quint16 value, m_values.values())
+            occurrences[value]++;
+        int maximum = 0;
+        for (QMap<quint16, int>::const_iterator it = occurrences.constBegin(); it != occurrences.constEnd(); ++it)
+        {
+            if (it.value() > maximum)
+            {
+                maximum = it.value();
+                broadcastValue = it.key();
+            }
+        }
+        useBroadcast = (maximum >= 2);
+    }
+
+    m_step = STEP_WRITE;
+    startBatch();
+
+    // Broadcast goes first, so unicast writes to the outliers are not overwritten by it.
+    // The bus keeps the turnaround delay after the broadcast before the next telegram.
+    if (useBroadcast)
+        m_bus->writeSingleRegister(0, m_dataAddress, broadcastValue);
+
+    for (QMap<quint8, quint16>::const_iterator it = m_values.constBegin(); it != m_values.constEnd(); ++it)
+    {
+        if (useBroadcast && (it.value() == broadcastValue))
+            m_broadcastRecipients.append(it.key());
+        else
+            m_slaveByTelegramID.insert(m_bus->writeSingleRegister(it.key(), m_dataAddress, it.value()), it.key());
+    }
+
+    submitBatch();
+    return true;
+}
+
+bool ModBusGroupSetpoint::isBusy() const
+{
+    return (m_step != STEP_IDLE);
+}
+
+void ModBusGroupSetpoint::startBatch()
+{
+    m_batch = new ModBusBatch(this);
+    m_slaveByTelegramID.clear();
+    connect(m_batch, SIGNAL(signal_finished(bool,QList<quint64>)), this, SLOT(slot_batchFinished(bool,QList<quint64>)));
+    m_bus->beginBatch(m_batch);
+}
+
+void ModBusGroupSetpoint::submitBatch()
+{
+    m_bus->endBatch();
+    m_bus->submitBatch(m_batch, ModBusBatch::ORDER_KEEP, true);
+}
+
+void ModBusGroupSetpoint::finish()
+{
+    m_step = STEP_IDLE;
+    emit signal_finished(m_failedSlaves.isEmpty(), m_failedSlaves);
+}
+
+void ModBusGroupSetpoint::slot_batchFinished(bool allSucceeded, QList<quint64> failedTelegramIDs)
+{
+    Q_UNUSED(allSucceeded);
+
+    ModBusBatch* batch = m_batch;
+    m_batch = NULL;
+    batch->deleteLater();
+
+    if (m_step == STEP_VERIFY)
+    {
+        // Broadcast recipients that do not report the value get it by unicast
+        QList<quint8> rewrite;
+        foreach (const ModBusFuture &future, batch->futures())
+        {
+            quint8 slaveAddress = m_slaveByTelegramID.value(future.telegramID());
+            QByteArray payload = future.payload();
+            bool ok = future.isSuccessful() && (payload.size() == 3) &&
+                    ((((quint8)payload.at(1) << 8) | (quint8)payload.at(2)) == m_values.value(slaveAddress));
+            if (!ok)
+                rewrite.append(slaveAddress);
+        }
+
+        if (rewrite.isEmpty())
+        {
+            finish();
+            return;
+        }
+
+        m_step = STEP_REWRITE;
+        startBatch();
+        foreach (quint8 slaveAddress, rewrite)
+            m_slaveByTelegramID.insert(m_bus->writeSingleRegister(slaveAddress, m_dataAddress, m_values.value(slaveAddress)), slaveAddress);
+        submitBatch();
+        return;
+    }
+
+    // Unicast writes are acknowledged by the slave; failed ones are final
+    foreach (quint64 id, failedTelegramIDs)
+    {
+        if (m_slaveByTelegramID.contains(id))
+            m_failedSlaves.append(m_slaveByTelegramID.value(id));
+    }
+
+    if ((m_step == STEP_WRITE) && m_verifyEnabled && !m_broadcastRecipients.isEmpty())
+    {
+        m_step = STEP_VERIFY;
+        startBatch();
+        foreach (quint8 slaveAddress, m_broadcastRecipients)
+            m_slaveByTelegramID.insert(m_bus->readHoldingRegisters(slaveAddress, m_dataAddress, 1), slaveAddress);
+        submitBatch();
+        return;
+    }
+
+    finish();
+}
@@ -0,0 +1,82 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSGROUPSETPOINT_H
+#define OPENFFUCONTROLMODBUSGROUPSETPOINT_H
+
+#include <QObject>
+#include <QList>
+#include <QMap>
+#include <QSet>
+
+#include "modbus_global.h"
+#include "modbusbatch.h"
+
+class ModBus;
+
+// Writes one holding register on a group of slaves with as few telegrams as possible.
+//
+// A broadcast reaches every slave on the line, so it is only used if the group covers all
+// bus members given with setBusMembers(). The most common value is then broadcast and the
+// slaves with other values get a unicast write afterwards. Broadcast recipients are verified
+// with read backs if enabled; slaves that did not take the value are written by unicast.
+class MODBUSSHARED_EXPORT ModBusGroupSetpoint : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ModBusGroupSetpoint(QObject *parent, ModBus* bus, bool debug = false);
+
+    void setBusMembers(QList<quint8> slaveAddresses);
+    void setVerifyEnabled(bool on);
+
+    // Returns false if a group write is still in progress
+    bool writeRegister(quint16 dataAddress, QMap<quint8, quint16> valuesBySlave);
+    bool writeRegister(quint16 dataAddress, QList<quint8> slaveAddresses, quint16 value);
+
+    bool isBusy() const;
+
+private:
+    typedef enum {
+        STEP_IDLE,
+        STEP_WRITE,
+        STEP_VERIFY,
+        STEP_REWRITE
+    } Step;
+
+    ModBus* m_bus;
+    bool m_debug;
+    QSet<quint8> m_busMembers;
+    bool m_verifyEnabled;
+
+    Step m_step;
+    ModBusBatch* m_batch;
+    quint16 m_dataAddress;
+    QMap<quint8, quint16> m_values;
+    QList<quint8> m_broadcastRecipients;
+    QMap<quint64, quint8> m_slaveByTelegramID;
+    QList<quint8> m_failedSlaves;
+
+    void startBatch();
+    void submitBatch();
+    void finish();
+
+signals:
+    void signal_finished(bool allSucceeded, QList<quint8> failedSlaves);
+
+private slots:
+    void slot_batchFinished(bool allSucceeded, QList<quint64> failedTelegramIDs);
+};
+
+#endif // OPENFFUCONTROLMODBUSGROUPSETPOINT_H
@@ -0,0 +1,406 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+
+#include <QDateTime>
+#include <algorithm>
+
+#include "modbushistory.h"
+#include "modbus.h"
+
+static void appendVarint(QByteArray* data, quint64 value)
+{
+    while (value >= 0x80)
+    {
+        data->append((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    data->append((char)value);
+}
+
+static quint64 readVarint(const uchar** position)
+{
+    quint64 value = 0;
+    int shift = 0;
+    while (**position & 0x80)
+    {
+        value |= (quint64)(**position & 0x7f) << shift;
+        shift += 7;
+        (*position)++;
+    }
+    value |= (quint64)**position << shift;
+    (*position)++;
+    return value;
+}
+
+ModBusHistory::ModBusHistory(QObject *parent, qint64 retentionMilliseconds, int samplesPerBlock) : QObject(parent)
+{
+    m_retention = retentionMilliseconds;
+    m_samplesPerBlock = qMax(2, samplesPerBlock);
+}
+
+void ModBusHistory::attach(ModBus *bus, quint8 channel)
+{
+    m_mutex.lock();
+    m_channels.insert(bus, channel);
+    m_mutex.unlock();
+    connect(bus, SIGNAL(signal_registersRead(ModBusRegisterView)), this, SLOT(slot_registersRead(ModBusRegisterView)), Qt::UniqueConnection);
+}
+
+void ModBusHistory::detach(ModBus *bus)
+{
+    disconnect(bus, SIGNAL(signal_registersRead(ModBusRegisterView)), this, SLOT(slot_registersRead(ModBusRegisterView)));
+    m_mutex.lock();
+    m_channels.remove(bus);
+    m_mutex.unlock();
+}
+
+void ModBusHistory::slot_registersRead(ModBusRegisterView registers)
+{
+    m_mutex.lock();
+    quint8 channel = m_channels.value(sender(), 0);
+    m_mutex.unlock();
+
+    record(channel, registers, QDateTime::currentMSecsSinceEpoch());
+}
+
+quint64 ModBusHistory::registerKey(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress)
+{
+    if (functionCode == 0x17)   // Read part of read/write multiple registers
+        functionCode = 0x03;
+    return ((quint64)channel << 32) | ((quint64)functionCode << 24) | ((quint64)slaveAddress << 16) | dataAddress;
+}
+
+quint64 ModBusHistory::groupKey(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, quint8 count)
+{
+    return (registerKey(channel, slaveAddress, functionCode, dataStartAddress) << 8) | count;
+}
+
+ModBusHistory::Group *ModBusHistory::group(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, quint8 count)
+{
+    // Must be called with m_mutex locked
+    quint64 key = groupKey(channel, slaveAddress, functionCode, dataStartAddress, count);
+    QHash<quint64, Group>::iterator it = m_groups.find(key);
+    if (it != m_groups.end())
+        return &it.value();
+
+    Group group;
+    group.dataStartAddress = dataStartAddress;
+    group.registerCount = count;
+    for (int i = 0; i < count; i++)
+        m_registerGroups[registerKey(channel, slaveAddress, functionCode, dataStartAddress + i)].append(key);
+    return &m_groups.insert(key, group).value();
+}
+
+void ModBusHistory::record(quint8 channel, const ModBusRegisterView &registers, qint64 timestamp)
+{
+    if ((registers.count() == 0) || (registers.count() > 255))
+        return;
+
+    quint16 values[255];
+    for (int i = 0; i < registers.count(); i++)
+        values[i] = registers.at(i);
+
+    m_mutex.lock();
+    append(group(channel, registers.slaveAddress(), registers.functionCode(), registers.dataStartAddress(), registers.count()), timestamp, values);
+    m_mutex.unlock();
+}
+
+void ModBusHistory::record(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, quint16 value, qint64 timestamp)
+{
+    m_mutex.lock();
+    append(group(channel, slaveAddress, functionCode, dataAddress, 1), timestamp, &value);
+    m_mutex.unlock();
+}
+
+void ModBusHistory::append(Group *group, qint64 timestamp, const quint16 *values)
+{
+    if (group->blocks.isEmpty() || (group->blocks.last().count >= m_samplesPerBlock))
+    {
+        if (!group->blocks.isEmpty())
+        {
+            // A full block does not grow anymore
+            Block &full = group->blocks.last();
+            full.times.squeeze();
+            for (int i = 0; i < full.series.size(); i++)
+                full.series[i].values.squeeze();
+            timestamp = qMax(timestamp, full.lastTimestamp);
+        }
+
+        // Expire only when a block is started; the oldest block is the first one
+        while (!group->blocks.isEmpty() && (group->blocks.first().lastTimestamp < timestamp - m_retention))
+            group->blocks.removeFirst();
+
+        Block block;
+        block.firstTimestamp = timestamp;
+        block.lastTimestamp = timestamp;
+        block.lastTimeDelta = 0;
+        block.count = 1;
+        block.timeZeros = 0;
+        block.series.resize(group->registerCount);
+        for (int i = 0; i < group->registerCount; i++)
+        {
+            Series &series = block.series[i];
+            series.firstValue = values[i];
+            series.lastValue = values[i];
+            series.min = values[i];
+            series.max = values[i];
+            series.sum = values[i];
+            series.valueZeros = 0;
+        }
+        group->blocks.append(block);
+        return;
+    }
+
+    Block &block = group->blocks.last();
+    timestamp = qMax(timestamp, block.lastTimestamp);
+    qint64 timeDelta = timestamp - block.lastTimestamp;
+    appendDelta(&block.times, &block.timeZeros, timeDelta - block.lastTimeDelta);
+    block.lastTimestamp = timestamp;
+    block.lastTimeDelta = timeDelta;
+    block.count++;
+
+    for (int i = 0; i < group->registerCount; i++)
+    {
+        Series &series = block.series[i];
+        appendDelta(&series.values, &series.valueZeros, (qint32)values[i] - (qint32)series.lastValue);
+        series.lastValue = values[i];
+        series.min = qMin(series.min, values[i]);
+        series.max = qMax(series.max, values[i]);
+        series.sum += values[i];
+    }
+}
+
+void ModBusHistory::appendDelta(QByteArray *stream, quint32 *zeros, qint64 delta)
+{
+    if (delta == 0)
+    {
+        (*zeros)++;
+        return;
+    }
+
+    if (*zeros > 0)
+    {
+        stream->append((char)0);
+        appendVarint(stream, *zeros);
+        *zeros = 0;
+    }
+    appendVarint(stream, ((quint64)delta << 1) ^ (quint64)(delta >> 63));
+}
+
+// Reads one stream of a block; the zero run at its end is not written, so reading past the end gives 0
+class ModBusHistoryDeltaReader
+{
+public:
+    ModBusHistoryDeltaReader(const QByteArray &stream)
+    {
+        m_position = (const uchar*)stream.constData();
+        m_end = m_position + stream.size();
+        m_zeros = 0;
+    }
+
+    qint64 next()
+    {
+        if (m_zeros > 0)
+        {
+            m_zeros--;
+            return 0;
+        }
+        if (m_position >= m_end)
+            return 0;
+
+        quint64 zigzag = readVarint(&m_position);
+        if (zigzag == 0)
+        {
+            m_zeros = readVarint(&m_position) - 1;
+            return 0;
+        }
+        return (qint64)(zigzag >> 1) ^ -(qint64)(zigzag & 1);
+    }
+
+private:
+    const uchar* m_position;
+    const uchar* m_end;
+    quint64 m_zeros;
+};
+
+template<typename F>
+void ModBusHistory::forEachGroup(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, F function) const
+{
+    // Must be called with m_mutex locked; the function gets the group and the index of the register in it
+    foreach (quint64 key, m_registerGroups.value(registerKey(channel, slaveAddress, functionCode, dataAddress)))
+    {
+        const Group &group = m_groups.constFind(key).value();
+        function(group, dataAddress - group.dataStartAddress);
+    }
+}
+
+template<typename F>
+void ModBusHistory::forEachSample(const Block &block, int index, F function)
+{
+    const Series &series = block.series.at(index);
+    qint64 timestamp = block.firstTimestamp;
+    qint64 timeDelta = 0;
+    qint32 value = series.firstValue;
+    function(timestamp, (quint16)value);
+
+    ModBusHistoryDeltaReader times(block.times);
+    ModBusHistoryDeltaReader values(series.values);
+    for (int i = 1; i < block.count; i++)
+    {
+        timeDelta += times.next();
+        timestamp += timeDelta;
+        value += (qint32)values.next();
+        function(timestamp, (quint16)value);
+    }
+}
+
+QList<ModBusHistory::Aggregate> ModBusHistory::aggregate(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, qint64 from, qint64 to, qint64 interval) const
+{
+    QList<Aggregate> aggregates;
+    if ((interval <= 0) || (to <= from))
+        return aggregates;
+
+    int intervals = (to - from + interval - 1) / interval;
+    aggregates.reserve(intervals);
+    QList<qint64> sums;
+    sums.reserve(intervals);
+    for (int i = 0; i < intervals; i++)
+    {
+        Aggregate aggregate;
+        aggregate.start = from + i * interval;
+        aggregate.end = qMin(aggregate.start + interval, to);
+        aggregate.count = 0;
+        aggregate.min = 0xffff;
+        aggregate.max = 0;
+        aggregate.average = 0;
+        aggregates.append(aggregate);
+        sums.append(0);
+    }
+
+    m_mutex.lock();
+    forEachGroup(channel, slaveAddress, functionCode, dataAddress, [&](const Group &group, int index) {
+        foreach (const Block &block, group.blocks)
+        {
+            if ((block.lastTimestamp < from) || (block.firstTimestamp >= to))
+                continue;
+
+            // A block within one interval is taken from its summary without decoding it
+            if ((block.firstTimestamp >= from) && (block.lastTimestamp < to) &&
+                    ((block.firstTimestamp - from) / interval == (block.lastTimestamp - from) / interval))
+            {
+                const Series &series = block.series.at(index);
+                int i = (block.firstTimestamp - from) / interval;
+                Aggregate &aggregate = aggregates[i];
+                aggregate.count += block.count;
+                aggregate.min = qMin(aggregate.min, series.min);
+                aggregate.max = qMax(aggregate.max, series.max);
+                sums[i] += series.sum;
+                continue;
+            }
+
+            forEachSample(block, index, [&](qint64 timestamp, quint16 value) {
+                if ((timestamp < from) || (timestamp >= to))
+                    return;
+                int i = (timestamp - from) / interval;
+                Aggregate &aggregate = aggregates[i];
+                aggregate.count++;
+                aggregate.min = qMin(aggregate.min, value);
+                aggregate.max = qMax(aggregate.max, value);
+                sums[i] += value;
+            });
+        }
+    });
+    m_mutex.unlock();
+
+    for (int i = 0; i < intervals; i++)
+    {
+        if (aggregates.at(i).count > 0)
+            aggregates[i].average = (double)sums.at(i) / aggregates.at(i).count;
+    }
+
+    return aggregates;
+}
+
+QList<ModBusHistory::Sample> ModBusHistory::samples(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, qint64 from, qint64 to) const
+{
+    QList<Sample> samples;
+    int groups = 0;
+
+    m_mutex.lock();
+    forEachGroup(channel, slaveAddress, functionCode, dataAddress, [&](const Group &group, int index) {
+        groups++;
+        foreach (const Block &block, group.blocks)
+        {
+            if ((block.lastTimestamp < from) || (block.firstTimestamp >= to))
+                continue;
+
+            forEachSample(block, index, [&](qint64 timestamp, quint16 value) {
+                if ((timestamp < from) || (timestamp >= to))
+                    return;
+                Sample sample;
+                sample.timestamp = timestamp;
+                sample.value = value;
+                samples.append(sample);
+            });
+        }
+    });
+    m_mutex.unlock();
+
+    // Samples of one group are in order; those of several groups are merged
+    if (groups > 1)
+        std::stable_sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) { return a.timestamp < b.timestamp; });
+
+    return samples;
+}
+
+void ModBusHistory::clear()
+{
+    m_mutex.lock();
+    m_groups.clear();
+    m_registerGroups.clear();
+    m_mutex.unlock();
+}
+
+int ModBusHistory::columnCount() const
+{
+    m_mutex.lock();
+    int count = m_registerGroups.size();
+    m_mutex.unlock();
+    return count;
+}
+
+qint64 ModBusHistory::memoryUsage() const
+{
+    qint64 bytes = 0;
+
+    m_mutex.lock();
+    for (QHash<quint64, Group>::const_iterator it = m_groups.constBegin(); it != m_groups.constEnd(); ++it)
+    {
+        bytes += sizeof(quint64) + sizeof(Group);
+        foreach (const Block &block, it.value().blocks)
+        {
+            bytes += sizeof(Block) + block.times.capacity() + block.series.capacity() * sizeof(Series);
+            foreach (const Series &series, block.series)
+                bytes += series.values.capacity();
+        }
+    }
+    for (QHash<quint64, QList<quint64> >::const_iterator it = m_registerGroups.constBegin(); it != m_registerGroups.constEnd(); ++it)
+        bytes += sizeof(quint64) + sizeof(QList<quint64>) + it.value().size() * sizeof(quint64);
+    m_mutex.unlock();
+
+    return bytes;
+}
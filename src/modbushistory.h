@@ -0,0 +1,129 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSHISTORY_H
+#define OPENFFUCONTROLMODBUSHISTORY_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QVector>
+
+#include "modbus_global.h"
+#include "modbusregisterview.h"
+
+class ModBus;
+
+// In-memory history of polled registers for trending.
+//
+// Samples are kept in groups; a group holds the registers that are recorded together, i.e. one
+// response of one slave. A group is a list of blocks with a fixed number of samples. All
+// registers of a block share one timestamp stream, the differences of the time differences, and
+// every register has its own value stream, the differences of its values. Both are zigzag
+// varints in which a run of zeros takes two bytes. So a value that does not change costs almost
+// nothing even when the poll timing jitters, and the timestamps cost about one byte per
+// response and not per register. A block keeps its time range and min, max and sum of every
+// register uncompressed; range queries use these summaries where a block lies completely within
+// one interval and only decode the blocks at the interval borders. Blocks older than the
+// retention time are dropped.
+//
+// A register that is read with responses of different ranges is part of several groups; its
+// queries merge them. Timestamps are milliseconds since epoch; a timestamp older than the last
+// one of the group is recorded with the last timestamp. All functions are thread safe.
+class MODBUSSHARED_EXPORT ModBusHistory : public QObject
+{
+    Q_OBJECT
+public:
+    typedef struct {
+        qint64 start;       // Interval [start, end)
+        qint64 end;
+        int count;          // 0 if there is no sample in the interval; min, max and average are invalid then
+        quint16 min;
+        quint16 max;
+        double average;
+    } Aggregate;
+
+    typedef struct {
+        qint64 timestamp;
+        quint16 value;
+    } Sample;
+
+    explicit ModBusHistory(QObject *parent, qint64 retentionMilliseconds = 24 * 3600 * 1000LL, int samplesPerBlock = 256);
+
+    // Records every signal_registersRead of the bus; the channel tells several buses apart
+    void attach(ModBus* bus, quint8 channel = 0);
+    void detach(ModBus* bus);
+
+    void record(quint8 channel, const ModBusRegisterView &registers, qint64 timestamp);
+    void record(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, quint16 value, qint64 timestamp);
+
+    // Function code 0x03 for holding registers, 0x04 for input registers
+    QList<Aggregate> aggregate(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, qint64 from, qint64 to, qint64 interval) const;
+    QList<Sample> samples(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, qint64 from, qint64 to) const;
+
+    void clear();
+    int columnCount() const;        // Number of registers with samples
+    qint64 memoryUsage() const;     // Approximate bytes used by all groups
+
+private:
+    typedef struct {
+        quint16 firstValue;
+        quint16 lastValue;
+        quint16 min;
+        quint16 max;
+        qint64 sum;
+        QByteArray values;      // Zigzag varints of the value deltas; 0 is followed by the length of the zero run
+        quint32 valueZeros;     // Zero run at the end of values that is not yet written; decoders read missing entries as 0
+    } Series;
+
+    typedef struct {
+        qint64 firstTimestamp;
+        qint64 lastTimestamp;
+        qint64 lastTimeDelta;
+        int count;
+        QByteArray times;       // Zigzag varints of the time delta changes, zero runs as in values
+        quint32 timeZeros;
+        QVector<Series> series; // One per register of the group
+    } Block;
+
+    typedef struct {
+        quint16 dataStartAddress;
+        int registerCount;
+        QList<Block> blocks;
+    } Group;
+
+    mutable QMutex m_mutex;
+    qint64 m_retention;
+    int m_samplesPerBlock;
+    QHash<quint64, Group> m_groups;
+    QHash<quint64, QList<quint64> > m_registerGroups;  // Keys of the groups that contain a register
+    QHash<QObject*, quint8> m_channels;
+
+    static quint64 registerKey(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress);
+    static quint64 groupKey(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, quint8 count);
+    Group* group(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, quint8 count);
+    void append(Group* group, qint64 timestamp, const quint16* values);
+    static void appendDelta(QByteArray* stream, quint32* zeros, qint64 delta);
+    template<typename F> void forEachGroup(quint8 channel, quint8 slaveAddress, quint8 functionCode, quint16 dataAddress, F function) const;
+    template<typename F> static void forEachSample(const Block &block, int index, F function);
+
+private slots:
+    void slot_registersRead(ModBusRegisterView registers);
+};
+
+#endif // OPENFFUCONTROLMODBUSHISTORY_H
@@ -0,0 +1,337 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QPointer>
+#include <QSaveFile>
+
+#include "modbusidentification.h"
+#include "modbus.h"
+
+#define MODBUS_IDENTCACHE_MAGIC     0x4d424944  // "MBID"
+#define MODBUS_IDENTCACHE_VERSION   1
+
+ModBusIdentity::ModBusIdentity()
+{
+    conformityLevel = 0;
+    verifiedAt = 0;
+}
+
+bool ModBusIdentity::isValid() const
+{
+    return !objects.isEmpty();
+}
+
+QString ModBusIdentity::vendorName() const
+{
+    return QString::fromLatin1(objects.value(0x00));
+}
+
+QString ModBusIdentity::productCode() const
+{
+    return QString::fromLatin1(objects.value(0x01));
+}
+
+QString ModBusIdentity::majorMinorRevision() const
+{
+    return QString::fromLatin1(objects.value(0x02));
+}
+
+ModBusIdentCache::ModBusIdentCache(QString fileName)
+{
+    m_fileName = fileName;
+    m_modified = false;
+}
+
+bool ModBusIdentCache::load()
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if ((stream.status() != QDataStream::Ok) || (magic != MODBUS_IDENTCACHE_MAGIC) || (version != MODBUS_IDENTCACHE_VERSION))
+        return false;
+
+    QHash<QString, ModBusIdentity> identities;
+    for (quint32 i = 0; i < count; i++)
+    {
+        QString key;
+        ModBusIdentity identity;
+        stream >> key >> identity.conformityLevel >> identity.objects >> identity.fingerprint >> identity.verifiedAt;
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        identities.insert(key, identity);
+    }
+
+    m_identities = identities;
+    m_modified = false;
+    return true;
+}
+
+bool ModBusIdentCache::save()
+{
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    stream << (quint32)MODBUS_IDENTCACHE_MAGIC << (quint32)MODBUS_IDENTCACHE_VERSION << (quint32)m_identities.count();
+    for (QHash<QString, ModBusIdentity>::const_iterator it = m_identities.constBegin(); it != m_identities.constEnd(); ++it)
+    {
+        const ModBusIdentity &identity = it.value();
+        stream << it.key() << identity.conformityLevel << identity.objects << identity.fingerprint << identity.verifiedAt;
+    }
+
+    if (!file.commit())
+        return false;
+
+    m_modified = false;
+    return true;
+}
+
+bool ModBusIdentCache::isModified() const
+{
+    return m_modified;
+}
+
+bool ModBusIdentCache::contains(QString bus, quint8 slaveAddress) const
+{
+    return m_identities.contains(key(bus, slaveAddress));
+}
+
+ModBusIdentity ModBusIdentCache::identity(QString bus, quint8 slaveAddress) const
+{
+    return m_identities.value(key(bus, slaveAddress));
+}
+
+void ModBusIdentCache::insert(QString bus, quint8 slaveAddress, const ModBusIdentity &identity)
+{
+    m_identities.insert(key(bus, slaveAddress), identity);
+    m_modified = true;
+}
+
+void ModBusIdentCache::remove(QString bus, quint8 slaveAddress)
+{
+    if (m_identities.remove(key(bus, slaveAddress)))
+        m_modified = true;
+}
+
+void ModBusIdentCache::clear()
+{
+    if (!m_identities.isEmpty())
+        m_modified = true;
+    m_identities.clear();
+}
+
+QString ModBusIdentCache::key(QString bus, quint8 slaveAddress)
+{
+    return bus + QString("#%1").arg(slaveAddress);
+}
+
+ModBusIdentification::ModBusIdentification(QObject *parent, ModBus *bus, ModBusIdentCache *cache, bool debug) : QObject(parent)
+{
+    m_bus = bus;
+    m_cache = cache;
+    m_debug = debug;
+    m_fingerprint = FINGERPRINT_OBJECT;
+    m_fingerprintObjectId = 0x02;
+    m_category = 0x02;
+    m_pending = 0;
+    qRegisterMetaType<ModBusIdentity>("ModBusIdentity");
+
+    // Requests report through their futures
+    m_bus->setFuturesEnabled(true);
+}
+
+void ModBusIdentification::setFingerprint(Fingerprint fingerprint, quint8 objectId)
+{
+    // The fingerprint must not contain volatile data, like the run indicator some slaves put into their slave id
+    m_fingerprint = fingerprint;
+    m_fingerprintObjectId = objectId;
+}
+
+void ModBusIdentification::setCategory(quint8 readDeviceIdCode)
+{
+    if ((readDeviceIdCode >= 0x01) && (readDeviceIdCode <= 0x03))
+        m_category = readDeviceIdCode;
+}
+
+bool ModBusIdentification::identify(QList<quint8> slaveAddresses)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusIdentification::identify() %i slaves.\n", slaveAddresses.count());
+        fflush(stdout);
+    }
+
+    if (isBusy())
+        return false;
+
+    m_busName = m_bus->interfaceName();
+    m_reading.clear();
+    m_failedSlaves.clear();
+    m_pending = slaveAddresses.count();
+
+    if (m_pending == 0)
+    {
+        emit signal_finished(m_failedSlaves);
+        return true;
+    }
+
+    foreach (quint8 slaveAddress, slaveAddresses)
+        requestFingerprint(slaveAddress);
+    return true;
+}
+
+bool ModBusIdentification::isBusy() const
+{
+    return (m_pending > 0);
+}
+
+void ModBusIdentification::requestFingerprint(quint8 slaveAddress)
+{
+    quint64 telegramID;
+    if (m_fingerprint == FINGERPRINT_SLAVE_ID)
+        telegramID = m_bus->reportSlaveID(slaveAddress);
+    else
+        telegramID = m_bus->readDeviceIdentification(slaveAddress, 0x04, m_fingerprintObjectId);
+
+    QPointer<ModBusIdentification> identification(this);
+    m_bus->future(telegramID).then([identification, slaveAddress](const ModBusFuture &future) {
+        if (!identification.isNull())
+            identification->fingerprintFinished(slaveAddress, future);
+    });
+}
+
+void ModBusIdentification::fingerprintFinished(quint8 slaveAddress, const ModBusFuture &future)
+{
+    if ((future.state() == ModBusFuture::STATE_LOST) || (future.state() == ModBusFuture::STATE_CANCELED))
+    {
+        slaveDone(slaveAddress, false);
+        return;
+    }
+
+    // A slave that rejects the fingerprint request is read completely every time
+    QByteArray fingerprint;
+    if (future.isSuccessful())
+    {
+        QByteArray payload = future.payload();
+        if (m_fingerprint == FINGERPRINT_SLAVE_ID)
+        {
+            if ((payload.length() >= 1) && (payload.length() == (quint8)payload.at(0) + 1))
+                fingerprint = payload.mid(1);
+        }
+        else
+        {
+            quint8 conformityLevel;
+            bool moreFollows;
+            quint8 nextObjectId;
+            QMap<quint8, QByteArray> objects;
+            if (ModBus::parseDeviceIdentification(payload, &conformityLevel, &moreFollows, &nextObjectId, &objects))
+                fingerprint = objects.value(m_fingerprintObjectId);
+        }
+    }
+
+    ModBusIdentity cached = m_cache->identity(m_busName, slaveAddress);
+    if (!fingerprint.isEmpty() && cached.isValid() && (cached.fingerprint == fingerprint))
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusIdentification::fingerprintFinished: Slave %i matches cache.\n", slaveAddress);
+            fflush(stdout);
+        }
+
+        cached.verifiedAt = QDateTime::currentMSecsSinceEpoch();
+        m_cache->insert(m_busName, slaveAddress, cached);
+        emit signal_slaveIdentified(slaveAddress, cached, true);
+        slaveDone(slaveAddress, true);
+        return;
+    }
+
+    ModBusIdentity identity;
+    identity.fingerprint = fingerprint;
+    m_reading.insert(slaveAddress, identity);
+    requestObjects(slaveAddress, 0x00);
+}
+
+void ModBusIdentification::requestObjects(quint8 slaveAddress, quint8 objectId)
+{
+    quint64 telegramID = m_bus->readDeviceIdentification(slaveAddress, m_category, objectId);
+
+    QPointer<ModBusIdentification> identification(this);
+    m_bus->future(telegramID).then([identification, slaveAddress](const ModBusFuture &future) {
+        if (!identification.isNull())
+            identification->objectsFinished(slaveAddress, future);
+    });
+}
+
+void ModBusIdentification::objectsFinished(quint8 slaveAddress, const ModBusFuture &future)
+{
+    ModBusIdentity &identity = m_reading[slaveAddress];
+
+    quint8 conformityLevel;
+    bool moreFollows;
+    quint8 nextObjectId;
+    QMap<quint8, QByteArray> objects;
+    if (!future.isSuccessful() || !ModBus::parseDeviceIdentification(future.payload(), &conformityLevel, &moreFollows, &nextObjectId, &objects))
+    {
+        m_reading.remove(slaveAddress);
+        slaveDone(slaveAddress, false);
+        return;
+    }
+
+    identity.conformityLevel = conformityLevel;
+    int countBefore = identity.objects.count();
+    for (QMap<quint8, QByteArray>::const_iterator it = objects.constBegin(); it != objects.constEnd(); ++it)
+        identity.objects.insert(it.key(), it.value());
+
+    // Continue only while the slave makes progress, a broken slave could otherwise loop forever
+    if (moreFollows && (identity.objects.count() > countBefore) && !identity.objects.contains(nextObjectId))
+    {
+        requestObjects(slaveAddress, nextObjectId);
+        return;
+    }
+
+    identity.verifiedAt = QDateTime::currentMSecsSinceEpoch();
+    ModBusIdentity result = m_reading.take(slaveAddress);
+    m_cache->insert(m_busName, slaveAddress, result);
+    emit signal_slaveIdentified(slaveAddress, result, false);
+    slaveDone(slaveAddress, result.isValid());
+}
+
+void ModBusIdentification::slaveDone(quint8 slaveAddress, bool ok)
+{
+    if (!ok)
+        m_failedSlaves.append(slaveAddress);
+
+    m_pending--;
+    if (m_pending > 0)
+        return;
+
+    if (m_cache->isModified())
+        m_cache->save();
+
+    emit signal_finished(m_failedSlaves);
+}
@@ -0,0 +1,125 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSIDENTIFICATION_H
+#define OPENFFUCONTROLMODBUSIDENTIFICATION_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMetaType>
+#include <QString>
+
+#include "modbus_global.h"
+#include "modbusfuture.h"
+
+class ModBus;
+
+// Identity of one slave as read with fc 0x2B/0x0E
+class MODBUSSHARED_EXPORT ModBusIdentity
+{
+public:
+    ModBusIdentity();
+
+    bool isValid() const;
+    QString vendorName() const;             // Object 0x00
+    QString productCode() const;            // Object 0x01
+    QString majorMinorRevision() const;     // Object 0x02
+
+    quint8 conformityLevel;
+    QMap<quint8, QByteArray> objects;
+    QByteArray fingerprint;                 // Answer to the fingerprint request when the objects were read
+    qint64 verifiedAt;                      // Milliseconds since epoch of the last fingerprint match or full read
+};
+
+Q_DECLARE_METATYPE(ModBusIdentity)
+
+// Identities by bus and slave address, stored in a file so they survive a restart
+class MODBUSSHARED_EXPORT ModBusIdentCache
+{
+public:
+    explicit ModBusIdentCache(QString fileName);
+
+    bool load();
+    bool save();    // Replaces the file atomically
+    bool isModified() const;
+
+    bool contains(QString bus, quint8 slaveAddress) const;
+    ModBusIdentity identity(QString bus, quint8 slaveAddress) const;
+    void insert(QString bus, quint8 slaveAddress, const ModBusIdentity &identity);
+    void remove(QString bus, quint8 slaveAddress);
+    void clear();
+
+private:
+    QString m_fileName;
+    QHash<QString, ModBusIdentity> m_identities;    // Key is bus and address
+    bool m_modified;
+
+    static QString key(QString bus, quint8 slaveAddress);
+};
+
+// Identifies slaves of one bus with the help of the cache.
+//
+// Every slave first gets one cheap fingerprint request: a single object read (default object
+// 0x02, the revision) or a report slave id. If the answer equals the fingerprint stored with
+// the cached identity, the cached objects are reported and nothing else is read. Otherwise all
+// objects of the configured category are streamed and the cache is updated. The fingerprint
+// requests of all slaves are queued at once, so a warm start costs one short transaction per slave.
+class MODBUSSHARED_EXPORT ModBusIdentification : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        FINGERPRINT_OBJECT,         // One device identification object, read by individual access
+        FINGERPRINT_SLAVE_ID        // Response of report slave id (fc 0x11)
+    } Fingerprint;
+
+    explicit ModBusIdentification(QObject *parent, ModBus* bus, ModBusIdentCache* cache, bool debug = false);
+
+    void setFingerprint(Fingerprint fingerprint, quint8 objectId = 0x02);
+    void setCategory(quint8 readDeviceIdCode);  // 1 basic, 2 regular, 3 extended
+
+    // Returns false if an identification is still in progress
+    bool identify(QList<quint8> slaveAddresses);
+    bool isBusy() const;
+
+private:
+    ModBus* m_bus;
+    ModBusIdentCache* m_cache;
+    bool m_debug;
+    Fingerprint m_fingerprint;
+    quint8 m_fingerprintObjectId;
+    quint8 m_category;
+
+    QString m_busName;
+    QMap<quint8, ModBusIdentity> m_reading;     // Slaves whose objects are being streamed
+    QList<quint8> m_failedSlaves;
+    int m_pending;
+
+    void requestFingerprint(quint8 slaveAddress);
+    void fingerprintFinished(quint8 slaveAddress, const ModBusFuture &future);
+    void requestObjects(quint8 slaveAddress, quint8 objectId);
+    void objectsFinished(quint8 slaveAddress, const ModBusFuture &future);
+    void slaveDone(quint8 slaveAddress, bool ok);
+
+signals:
+    void signal_slaveIdentified(quint8 slaveAddress, ModBusIdentity identity, bool fromCache);
+    void signal_finished(QList<quint8> failedSlaves);
+};
+
+#endif // OPENFFUCONTROLMODBUSIDENTIFICATION_H
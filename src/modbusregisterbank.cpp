@@ -0,0 +1,253 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include <thread>
+
+#include "modbusregisterbank.h"
+
+ModBusRegisterBank::ModBusRegisterBank(int coils, int discreteInputs, int holdingRegisters, int inputRegisters)
+{
+    int sizes[4] = { coils, discreteInputs, holdingRegisters, inputRegisters };
+
+    for (int table = 0; table < 4; table++)
+    {
+        m_tables[table].sequence.store(0);
+        m_tables[table].size = sizes[table];
+        m_tables[table].bits = NULL;
+        m_tables[table].registers = NULL;
+        if (isBitTable((Table)table))
+            m_tables[table].bits = new std::atomic<quint8>[sizes[table]]();
+        else
+            m_tables[table].registers = new std::atomic<quint16>[sizes[table]]();
+    }
+}
+
+ModBusRegisterBank::~ModBusRegisterBank()
+{
+    for (int table = 0; table < 4; table++)
+    {
+        delete[] m_tables[table].bits;
+        delete[] m_tables[table].registers;
+    }
+}
+
+int ModBusRegisterBank::size(Table table) const
+{
+    return m_tables[table].size;
+}
+
+bool ModBusRegisterBank::contains(Table table, quint16 start, quint16 count) const
+{
+    return (count > 0) && ((int)start + (int)count <= size(table));
+}
+
+bool ModBusRegisterBank::bit(Table table, quint16 address) const
+{
+    if (!isBitTable(table) || !contains(table, address, 1))
+        return false;
+    // A single byte can not tear, no need for the sequence counter
+    return m_tables[table].bits[address].load(std::memory_order_relaxed);
+}
+
+bool ModBusRegisterBank::setBit(Table table, quint16 address, bool on)
+{
+    quint8 packed = on;
+    return writeBits(table, address, 1, &packed);
+}
+
+bool ModBusRegisterBank::readBits(Table table, quint16 start, quint16 count, quint8 *packed) const
+{
+    if (!isBitTable(table) || !contains(table, start, count))
+        return false;
+
+    const std::atomic<quint8>* bits = m_tables[table].bits + start;
+    quint32 sequence;
+    do
+    {
+        sequence = beginRead(table);
+        for (quint16 i = 0; i < count; i += 8)
+        {
+            quint8 byte = 0;
+            for (quint16 bit = 0; (bit < 8) && (i + bit < count); bit++)
+            {
+                if (bits[i + bit].load(std::memory_order_relaxed))
+                    byte |= 1 << bit;
+            }
+            packed[i / 8] = byte;
+        }
+    } while (!endRead(table, sequence));
+    return true;
+}
+
+bool ModBusRegisterBank::writeBits(Table table, quint16 start, quint16 count, const quint8 *packed)
+{
+    if (!isBitTable(table) || !contains(table, start, count))
+        return false;
+
+    beginWrite(table);
+    storeBits(table, start, count, packed);
+    endWrite(table);
+    return true;
+}
+
+quint16 ModBusRegisterBank::value(Table table, quint16 address) const
+{
+    if (isBitTable(table) || !contains(table, address, 1))
+        return 0;
+    return m_tables[table].registers[address].load(std::memory_order_relaxed);
+}
+
+bool ModBusRegisterBank::setValue(Table table, quint16 address, quint16 value)
+{
+    return writeRegisters(table, address, 1, &value);
+}
+
+bool ModBusRegisterBank::readRegisters(Table table, quint16 start, quint16 count, quint16 *data) const
+{
+    if (isBitTable(table) || !contains(table, start, count))
+        return false;
+
+    const std::atomic<quint16>* registers = m_tables[table].registers + start;
+    quint32 sequence;
+    do
+    {
+        sequence = beginRead(table);
+        for (quint16 i = 0; i < count; i++)
+            data[i] = registers[i].load(std::memory_order_relaxed);
+    } while (!endRead(table, sequence));
+    return true;
+}
+
+bool ModBusRegisterBank::writeRegisters(Table table, quint16 start, quint16 count, const quint16 *data)
+{
+    if (isBitTable(table) || !contains(table, start, count))
+        return false;
+
+    beginWrite(table);
+    storeRegisters(table, start, count, data);
+    endWrite(table);
+    return true;
+}
+
+quint32 ModBusRegisterBank::generation(Table table) const
+{
+    return m_tables[table].sequence.load(std::memory_order_acquire) / 2;
+}
+
+quint32 ModBusRegisterBank::beginRead(Table table) const
+{
+    quint32 sequence = m_tables[table].sequence.load(std::memory_order_acquire);
+    while (sequence & 1)    // Writer active, wait for it to finish
+    {
+        std::this_thread::yield();
+        sequence = m_tables[table].sequence.load(std::memory_order_acquire);
+    }
+    return sequence;
+}
+
+bool ModBusRegisterBank::endRead(Table table, quint32 sequence) const
+{
+    // Data loads must not move behind the second sequence load
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return m_tables[table].sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+void ModBusRegisterBank::beginWrite(Table table)
+{
+    std::atomic<quint32> &sequence = m_tables[table].sequence;
+    quint32 expected = sequence.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        if (!(expected & 1) && sequence.compare_exchange_weak(expected, expected + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            break;
+        if (expected & 1)   // Another writer holds the table
+        {
+            std::this_thread::yield();
+            expected = sequence.load(std::memory_order_relaxed);
+        }
+    }
+    // Data stores must not move before the odd sequence becomes visible
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void ModBusRegisterBank::endWrite(Table table)
+{
+    m_tables[table].sequence.fetch_add(1, std::memory_order_release);
+}
+
+void ModBusRegisterBank::storeBits(Table table, quint16 start, quint16 count, const quint8 *packed)
+{
+    std::atomic<quint8>* bits = m_tables[table].bits + start;
+    for (quint16 i = 0; i < count; i++)
+        bits[i].store((packed[i / 8] >> (i % 8)) & 1, std::memory_order_relaxed);
+}
+
+void ModBusRegisterBank::storeRegisters(Table table, quint16 start, quint16 count, const quint16 *data)
+{
+    std::atomic<quint16>* registers = m_tables[table].registers + start;
+    for (quint16 i = 0; i < count; i++)
+        registers[i].store(data[i], std::memory_order_relaxed);
+}
+
+ModBusRegisterBank::Update::Update(ModBusRegisterBank *bank, Table table)
+{
+    m_bank = bank;
+    m_table = table;
+    m_bank->beginWrite(m_table);
+}
+
+ModBusRegisterBank::Update::~Update()
+{
+    m_bank->endWrite(m_table);
+}
+
+quint16 ModBusRegisterBank::Update::value(quint16 address) const
+{
+    // The writer holds the table, so it reads its own data without the sequence counter
+    if (isBitTable(m_table))
+    {
+        if (!m_bank->contains(m_table, address, 1))
+            return 0;
+        return m_bank->m_tables[m_table].bits[address].load(std::memory_order_relaxed);
+    }
+    return m_bank->value(m_table, address);
+}
+
+bool ModBusRegisterBank::Update::setValue(quint16 address, quint16 value)
+{
+    return writeRegisters(address, 1, &value);
+}
+
+bool ModBusRegisterBank::Update::writeRegisters(quint16 start, quint16 count, const quint16 *data)
+{
+    if (isBitTable(m_table) || !m_bank->contains(m_table, start, count))
+        return false;
+    m_bank->storeRegisters(m_table, start, count, data);
+    return true;
+}
+
+bool ModBusRegisterBank::Update::setBit(quint16 address, bool on)
+{
+    quint8 packed = on;
+    return writeBits(address, 1, &packed);
+}
+
+bool ModBusRegisterBank::Update::writeBits(quint16 start, quint16 count, const quint8 *packed)
+{
+    if (!isBitTable(m_table) || !m_bank->contains(m_table, start, count))
+        return false;
+    m_bank->storeBits(m_table, start, count, packed);
+    return true;
+}
@@ -0,0 +1,106 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSREGISTERBANK_H
+#define OPENFFUCONTROLMODBUSREGISTERBANK_H
+
+#include <QtGlobal>
+#include <atomic>
+
+#include "modbus_global.h"
+
+// In-memory data model of a Modbus server. All storage is allocated in the constructor,
+// so reading and writing never allocates and can be done while answering a request.
+//
+// The bank can be shared between threads without locks. Every table is guarded by a
+// sequence counter (seqlock): readers copy a block and retry if a writer was active
+// meanwhile, so a block read is never torn and readers never block the writer.
+// Writers exclude each other by taking the sequence counter with compare-and-swap.
+// Use Update to change many values of one table so that readers see all or none of them.
+class MODBUSSHARED_EXPORT ModBusRegisterBank
+{
+public:
+    typedef enum {
+        TABLE_COILS = 0,
+        TABLE_DISCRETE_INPUTS = 1,
+        TABLE_HOLDING_REGISTERS = 2,
+        TABLE_INPUT_REGISTERS = 3
+    } Table;
+
+    ModBusRegisterBank(int coils = 2000, int discreteInputs = 2000, int holdingRegisters = 1000, int inputRegisters = 1000);
+    ~ModBusRegisterBank();
+
+    int size(Table table) const;
+    bool contains(Table table, quint16 start, quint16 count) const;
+
+    // Bit tables; packed data uses the wire layout, LSB of the first byte is the bit at start
+    bool bit(Table table, quint16 address) const;
+    bool setBit(Table table, quint16 address, bool on);
+    bool readBits(Table table, quint16 start, quint16 count, quint8* packed) const;
+    bool writeBits(Table table, quint16 start, quint16 count, const quint8* packed);
+
+    // Register tables
+    quint16 value(Table table, quint16 address) const;
+    bool setValue(Table table, quint16 address, quint16 value);
+    bool readRegisters(Table table, quint16 start, quint16 count, quint16* data) const;
+    bool writeRegisters(Table table, quint16 start, quint16 count, const quint16* data);
+
+    // Number of times the content of a table has changed; cheap way for readers to detect updates
+    quint32 generation(Table table) const;
+
+    // Batched update of one table; readers see the complete batch when the Update is destroyed
+    class MODBUSSHARED_EXPORT Update
+    {
+    public:
+        Update(ModBusRegisterBank* bank, Table table);
+        ~Update();
+
+        quint16 value(quint16 address) const;
+        bool setValue(quint16 address, quint16 value);
+        bool writeRegisters(quint16 start, quint16 count, const quint16* data);
+        bool setBit(quint16 address, bool on);
+        bool writeBits(quint16 start, quint16 count, const quint8* packed);
+
+    private:
+        ModBusRegisterBank* m_bank;
+        Table m_table;
+
+        Q_DISABLE_COPY(Update)
+    };
+
+private:
+    typedef struct {
+        std::atomic<quint32> sequence;  // Odd while a writer is active
+        int size;
+        std::atomic<quint8>* bits;      // One byte per bit; NULL for register tables
+        std::atomic<quint16>* registers;// NULL for bit tables
+    } TableStorage;
+
+    TableStorage m_tables[4];
+
+    static bool isBitTable(Table table) { return (table == TABLE_COILS) || (table == TABLE_DISCRETE_INPUTS); }
+
+    quint32 beginRead(Table table) const;
+    bool endRead(Table table, quint32 sequence) const;
+    void beginWrite(Table table);
+    void endWrite(Table table);
+
+    void storeBits(Table table, quint16 start, quint16 count, const quint8* packed);
+    void storeRegisters(Table table, quint16 start, quint16 count, const quint16* data);
+
+    Q_DISABLE_COPY(ModBusRegisterBank)
+};
+
+#endif // OPENFFUCONTROLMODBUSREGISTERBANK_H
@@ -0,0 +1,274 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSREGISTERMAP_H
+#define OPENFFUCONTROLMODBUSREGISTERMAP_H
+
+// Typed register maps, declared once per device and resolved at compile time. Example:
+//
+//   struct FanStatus {
+//       double speed;          // 0.1 rpm per digit
+//       qint32 energy;         // Two registers, high word first
+//       bool running;          // Bit 0 of the status register
+//       quint16 errorCode;     // Bits 4..11 of the status register
+//   };
+//
+//   typedef ModBusRegisterMap<FanStatus,
+//       ModBusField<ModBusU16, MODBUS_MEMBER(FanStatus, speed), 0xd010, std::ratio<1, 10> >,
+//       ModBusField<ModBusS32, MODBUS_MEMBER(FanStatus, energy), 0xd012>,
+//       ModBusField<ModBusBits<0, 1>, MODBUS_MEMBER(FanStatus, running), 0xd011>,
+//       ModBusField<ModBusBits<4, 8>, MODBUS_MEMBER(FanStatus, errorCode), 0xd011>
+//   > FanStatusMap;
+//
+//   FanStatusMap::read(bus, fan);      // Reads 0xd010..0xd013 with one request
+//   ...
+//   FanStatus status;
+//   FanStatusMap::decode(dataStartAddress, data, &status);
+//
+// The fields are read as one contiguous span, split into requests of up to 125 registers at
+// field boundaries, so no field is cut in two. Declare separate maps for register groups that
+// are far apart. Every field is decoded with a fixed
+// offset into the response; there are no lookups at runtime.
+
+#include <QByteArray>
+#include <QList>
+#include <cstring>
+#include <ratio>
+
+#include "modbus.h"
+
+#define MODBUS_MEMBER(Struct, member) Struct, decltype(Struct::member), &Struct::member
+
+typedef enum {
+    WORDS_HIGH_FIRST,   // Most significant register at the lower address
+    WORDS_LOW_FIRST
+} ModBusWordOrder;
+
+// Register data as received, two bytes per register in big endian
+class ModBusRegisterBytes
+{
+public:
+    ModBusRegisterBytes(const char* data) : m_data((const uchar*)data) {}
+    quint16 word(int index) const { return (m_data[index * 2] << 8) | m_data[index * 2 + 1]; }
+
+private:
+    const uchar* m_data;
+};
+
+// Register data as emitted by the signals of ModBus
+class ModBusRegisterList
+{
+public:
+    ModBusRegisterList(const QList<quint16> &data) : m_data(data) {}
+    quint16 word(int index) const { return m_data.at(index); }
+
+private:
+    const QList<quint16> &m_data;
+};
+
+// Codecs; each one reads its raw value from the registers starting at index
+
+struct ModBusU16
+{
+    typedef quint16 Type;
+    static constexpr int words() { return 1; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder) { return source.word(index); }
+};
+
+struct ModBusS16
+{
+    typedef qint16 Type;
+    static constexpr int words() { return 1; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder) { return (qint16)source.word(index); }
+};
+
+struct ModBusU32
+{
+    typedef quint32 Type;
+    static constexpr int words() { return 2; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder order)
+    {
+        if (order == WORDS_HIGH_FIRST)
+            return ((quint32)source.word(index) << 16) | source.word(index + 1);
+        return ((quint32)source.word(index + 1) << 16) | source.word(index);
+    }
+};
+
+struct ModBusS32
+{
+    typedef qint32 Type;
+    static constexpr int words() { return 2; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder order) { return (qint32)ModBusU32::decode(source, index, order); }
+};
+
+struct ModBusF32
+{
+    typedef float Type;
+    static constexpr int words() { return 2; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder order)
+    {
+        quint32 bits = ModBusU32::decode(source, index, order);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+template <int Shift, int Width>
+struct ModBusBits
+{
+    static_assert((Shift >= 0) && (Width >= 1) && (Shift + Width <= 16), "Bit field must fit into one register");
+
+    typedef quint16 Type;
+    static constexpr int words() { return 1; }
+    template <typename Source>
+    static Type decode(const Source &source, int index, ModBusWordOrder) { return (source.word(index) >> Shift) & ((1u << Width) - 1); }
+};
+
+// One member of the struct, found at a register address
+template <typename Codec, typename Struct, typename Member, Member Struct::*Pointer, quint16 Address,
+          typename Scale = std::ratio<1>, ModBusWordOrder Order = WORDS_HIGH_FIRST>
+struct ModBusField
+{
+    typedef Struct StructType;
+
+    static constexpr quint16 address() { return Address; }
+    static constexpr quint32 end() { return (quint32)Address + Codec::words(); }
+
+    template <typename Source>
+    static void decode(const Source &source, int index, Struct* out)
+    {
+        typename Codec::Type raw = Codec::decode(source, index, Order);
+        if (Scale::num == Scale::den)
+            out->*Pointer = static_cast<Member>(raw);
+        else
+            out->*Pointer = static_cast<Member>(static_cast<Member>(raw) * Scale::num / Scale::den);
+    }
+};
+
+template <typename... Fields>
+struct ModBusFieldList;
+
+template <>
+struct ModBusFieldList<>
+{
+    static constexpr quint16 first() { return 0xffff; }
+    static constexpr quint32 end() { return 0; }
+    static constexpr bool splits(quint32) { return false; }
+    static constexpr int overlapping(quint32, quint32) { return 0; }
+
+    template <typename Struct, typename Source>
+    static int decode(const Source &, quint32, quint32, Struct*) { return 0; }
+};
+
+template <typename Field, typename... Rest>
+struct ModBusFieldList<Field, Rest...>
+{
+    static constexpr quint16 first() { return (Field::address() < ModBusFieldList<Rest...>::first()) ? Field::address() : ModBusFieldList<Rest...>::first(); }
+    static constexpr quint32 end() { return (Field::end() > ModBusFieldList<Rest...>::end()) ? Field::end() : ModBusFieldList<Rest...>::end(); }
+
+    // True if a field has registers on both sides of the address
+    static constexpr bool splits(quint32 address) { return ((Field::address() < address) && (Field::end() > address)) || ModBusFieldList<Rest...>::splits(address); }
+
+    // Number of fields with at least one register in [start, end)
+    static constexpr int overlapping(quint32 start, quint32 end)
+    {
+        return (((Field::address() < end) && (Field::end() > start)) ? 1 : 0) + ModBusFieldList<Rest...>::overlapping(start, end);
+    }
+
+    // Decodes the fields that lie completely in [start, end) and returns their number
+    template <typename Struct, typename Source>
+    static int decode(const Source &source, quint32 start, quint32 end, Struct* out)
+    {
+        int decoded = 0;
+        if ((Field::address() >= start) && (Field::end() <= end))
+        {
+            Field::decode(source, Field::address() - start, out);
+            decoded = 1;
+        }
+        return decoded + ModBusFieldList<Rest...>::decode(source, start, end, out);
+    }
+};
+
+template <typename Struct, typename... Fields>
+class ModBusRegisterMap
+{
+public:
+    typedef ModBusFieldList<Fields...> List;
+
+    static_assert(sizeof...(Fields) > 0, "Register map needs at least one field");
+    static_assert(List::end() <= 0x10000, "Register map exceeds the address range");
+
+    static constexpr quint16 firstAddress() { return List::first(); }
+    static constexpr int count() { return List::end() - List::first(); }
+    static constexpr int requestCount() { return chunkCount(firstAddress()); }
+    static constexpr int fieldCount() { return sizeof...(Fields); }
+
+    // End of the request starting at start: at most 125 registers, moved back to a field boundary
+    static constexpr quint32 chunkEnd(quint32 start) { return boundaryBefore((start + 125 < List::end()) ? start + 125 : List::end()); }
+
+    // Queues the read requests of the map and returns their telegram ids
+    static QList<quint64> read(ModBus* bus, quint8 slaveAddress, quint8 functionCode = 0x03)
+    {
+        QList<quint64> telegramIDs;
+        for (quint32 start = firstAddress(); start < List::end(); start = chunkEnd(start))
+        {
+            int chunk = chunkEnd(start) - start;
+            if (functionCode == 0x04)
+                telegramIDs.append(bus->readInputRegisters(slaveAddress, start, chunk));
+            else
+                telegramIDs.append(bus->readHoldingRegisters(slaveAddress, start, chunk, functionCode));
+        }
+        return telegramIDs;
+    }
+
+    // Decode the fields that are covered by the data; the others are left as they are.
+    // Return true if every field that overlaps the data was decoded, which holds for each
+    // response to read().
+    static bool decode(quint16 dataStartAddress, const QList<quint16> &data, Struct* out)
+    {
+        ModBusRegisterList source(data);
+        quint32 end = (quint32)dataStartAddress + data.count();
+        return List::decode(source, dataStartAddress, end, out) == List::overlapping(dataStartAddress, end);
+    }
+
+    static bool decode(quint16 dataStartAddress, const char* registerBytes, int count, Struct* out)
+    {
+        ModBusRegisterBytes source(registerBytes);
+        quint32 end = (quint32)dataStartAddress + count;
+        return List::decode(source, dataStartAddress, end, out) == List::overlapping(dataStartAddress, end);
+    }
+
+    // Payload of a fc 0x03/0x04 response as delivered by ModBusFuture::payload(), starting with the byte count
+    static bool decodeResponse(quint16 dataStartAddress, const QByteArray &payload, Struct* out)
+    {
+        if ((payload.size() < 1) || ((quint8)payload.at(0) != payload.size() - 1) || (payload.size() % 2 == 0))
+            return false;
+        return decode(dataStartAddress, payload.constData() + 1, (payload.size() - 1) / 2, out);
+    }
+
+private:
+    // Fields are at most two registers wide, so this steps back at most one register
+    static constexpr quint32 boundaryBefore(quint32 address) { return List::splits(address) ? boundaryBefore(address - 1) : address; }
+    static constexpr int chunkCount(quint32 start) { return (start >= List::end()) ? 0 : 1 + chunkCount(chunkEnd(start)); }
+};
+
+#endif // OPENFFUCONTROLMODBUSREGISTERMAP_H
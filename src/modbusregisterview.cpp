@@ -0,0 +1,71 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QtEndian>
+
+#include "modbusregisterview.h"
+
+ModBusRegisterView::ModBusRegisterView()
+{
+    m_offset = 0;
+    m_count = 0;
+    m_telegramID = 0;
+    m_slaveAddress = 0;
+    m_functionCode = 0;
+    m_dataStartAddress = 0;
+    m_timestamps = ModBusTimestamps();
+}
+
+ModBusRegisterView::ModBusRegisterView(const QByteArray &frame, int offset, int count, quint64 telegramID, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, const ModBusTimestamps &timestamps)
+{
+    m_frame = frame;
+    m_offset = offset;
+    m_count = count;
+    if ((m_offset < 0) || (m_count < 0) || (m_offset + m_count * 2 > m_frame.size()))
+        m_count = 0;
+    m_telegramID = telegramID;
+    m_slaveAddress = slaveAddress;
+    m_functionCode = functionCode;
+    m_dataStartAddress = dataStartAddress;
+    m_timestamps = timestamps;
+}
+
+quint16 ModBusRegisterView::value(quint16 address, quint16 defaultValue) const
+{
+    int index = (int)address - m_dataStartAddress;
+    if ((index < 0) || (index >= m_count))
+        return defaultValue;
+    return at(index);
+}
+
+void ModBusRegisterView::copyTo(quint16 *target) const
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    qFromBigEndian<quint16>(constData(), m_count, target);
+#else
+    for (int i = 0; i < m_count; i++)
+        target[i] = at(i);
+#endif
+}
+
+QList<quint16> ModBusRegisterView::toList() const
+{
+    QList<quint16> data;
+    data.reserve(m_count);
+    for (int i = 0; i < m_count; i++)
+        data.append(at(i));
+    return data;
+}
@@ -0,0 +1,74 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSREGISTERVIEW_H
+#define OPENFFUCONTROLMODBUSREGISTERVIEW_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMetaType>
+
+#include "modbus_global.h"
+#include "modbustelegram.h"
+
+// Registers of one response, read directly from the received frame.
+//
+// The view shares the frame buffer instead of copying it; the frame is never modified after
+// reception. Copying a view, also for every queued connection, only increments a reference
+// count. Words are converted from big endian when they are accessed.
+class MODBUSSHARED_EXPORT ModBusRegisterView
+{
+public:
+    ModBusRegisterView();
+    ModBusRegisterView(const QByteArray &frame, int offset, int count, quint64 telegramID, quint8 slaveAddress, quint8 functionCode, quint16 dataStartAddress, const ModBusTimestamps &timestamps = ModBusTimestamps());
+
+    bool isValid() const { return m_count > 0; }
+    quint64 telegramID() const { return m_telegramID; }
+    quint8 slaveAddress() const { return m_slaveAddress; }
+    quint8 functionCode() const { return m_functionCode; }
+    quint16 dataStartAddress() const { return m_dataStartAddress; }
+    int count() const { return m_count; }
+    ModBusTimestamps timestamps() const { return m_timestamps; }    // The slave sampled the registers between transmitted and firstByteReceived
+
+    quint16 at(int index) const
+    {
+        const uchar* word = (const uchar*)m_frame.constData() + m_offset + index * 2;
+        return (word[0] << 8) | word[1];
+    }
+    quint16 operator[](int index) const { return at(index); }
+    quint16 value(quint16 address, quint16 defaultValue = 0) const;     // By register address
+
+    const char* constData() const { return m_frame.constData() + m_offset; }    // Big endian register data
+    QByteArray frame() const { return m_frame; }                                // Complete ADU including CRC
+
+    // Converts all registers into host byte order; target must hold count() words
+    void copyTo(quint16* target) const;
+    QList<quint16> toList() const;
+
+private:
+    QByteArray m_frame;
+    int m_offset;
+    int m_count;
+    quint64 m_telegramID;
+    quint8 m_slaveAddress;
+    quint8 m_functionCode;
+    quint16 m_dataStartAddress;
+    ModBusTimestamps m_timestamps;
+};
+
+Q_DECLARE_METATYPE(ModBusRegisterView)
+
+#endif // OPENFFUCONTROLMODBUSREGISTERVIEW_H
@@ -0,0 +1,165 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include "modbusreplay.h"
+#include "modbus.h"
+
+ModBusReplay::ModBusReplay(QObject *parent, ModBus *bus, QString fileName, bool debug) : QObject(parent),
+    m_reader(fileName)
+{
+    m_bus = bus;
+    m_debug = debug;
+    m_speed = 1.0;
+    m_channel = -1;
+    m_running = false;
+    m_timeOffset = 0;
+    m_lastTimestamp = 0;
+    m_recordsReplayed = 0;
+    m_havePendingRecord = false;
+
+    m_stepTimer.setSingleShot(true);
+    m_stepTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_stepTimer, SIGNAL(timeout()), this, SLOT(slot_step()));
+}
+
+ModBusReplay::~ModBusReplay()
+{
+    if (m_running)
+        this->stop();
+}
+
+void ModBusReplay::setSpeed(double speed)
+{
+    m_speed = speed;
+}
+
+void ModBusReplay::setChannel(int channel)
+{
+    m_channel = channel;
+}
+
+bool ModBusReplay::start()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusReplay::start().\n");
+        fflush(stdout);
+    }
+
+    if (m_running)
+        return true;
+
+    if (!m_reader.open())
+        return false;
+
+    m_running = true;
+    m_havePendingRecord = false;
+    m_recordsReplayed = 0;
+    m_timeOffset = 0;
+    m_lastTimestamp = 0;
+    m_bus->setReplayMode(true);
+    m_clock.start();
+    m_stepTimer.start(0);
+    return true;
+}
+
+void ModBusReplay::stop()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusReplay::stop().\n");
+        fflush(stdout);
+    }
+
+    m_stepTimer.stop();
+    m_reader.close();
+    m_running = false;
+    m_bus->setReplayMode(false);
+}
+
+bool ModBusReplay::isRunning() const
+{
+    return m_running;
+}
+
+quint64 ModBusReplay::recordsReplayed() const
+{
+    return m_recordsReplayed;
+}
+
+void ModBusReplay::replayRecord(const ModBusCaptureReader::Record &record)
+{
+    // fromRawData does not copy; the bus copies whatever it keeps beyond this call
+    QByteArray adu = QByteArray::fromRawData(record.adu, record.length);
+
+    if (record.direction == ModBusCapture::DIRECTION_TX)
+        m_bus->replayTransmittedFrame(adu);
+    else
+        m_bus->replayReceivedFrame(adu);
+
+    m_recordsReplayed++;
+}
+
+void ModBusReplay::slot_step()
+{
+    // Replay everything that is due now, then sleep until the next record is due.
+    // When running as fast as possible, return to the event loop every few records.
+    int batch = 0;
+
+    while (m_running)
+    {
+        if (!m_havePendingRecord)
+        {
+            if (!m_reader.next(&m_pendingRecord))
+            {
+                m_reader.close();
+                m_running = false;
+                m_bus->setReplayMode(false);
+                emit signal_finished(m_recordsReplayed);
+                return;
+            }
+            if ((m_channel >= 0) && (m_pendingRecord.channel != m_channel))
+                continue;
+
+            // Appended captures restart their clock at zero; continue seamlessly
+            if (m_pendingRecord.timestamp < m_lastTimestamp)
+                m_timeOffset -= m_lastTimestamp - m_pendingRecord.timestamp;
+            else if (m_recordsReplayed == 0)
+                m_timeOffset = m_pendingRecord.timestamp;
+            m_lastTimestamp = m_pendingRecord.timestamp;
+            m_havePendingRecord = true;
+        }
+
+        if (m_speed > 0.0)
+        {
+            qint64 due = (qint64)((m_pendingRecord.timestamp - m_timeOffset) / m_speed);
+            qint64 now = m_clock.nsecsElapsed();
+            if (due > now)
+            {
+                m_stepTimer.start((int)((due - now) / 1000000));
+                return;
+            }
+        }
+        else if (batch >= 64)
+        {
+            m_stepTimer.start(0);
+            return;
+        }
+
+        replayRecord(m_pendingRecord);
+        m_havePendingRecord = false;
+        batch++;
+    }
+}
@@ -0,0 +1,73 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSREPLAY_H
+#define OPENFFUCONTROLMODBUSREPLAY_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+
+#include "modbus_global.h"
+#include "modbuscapture.h"
+
+class ModBus;
+
+// Feeds a capture file into a ModBus instance that has been put into replay mode.
+// Transmitted ADUs become the current telegram of the bus, received ADUs are parsed
+// as if they came from the port, so all response signals fire as they did in the field.
+class MODBUSSHARED_EXPORT ModBusReplay : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ModBusReplay(QObject *parent, ModBus* bus, QString fileName, bool debug = false);
+    ~ModBusReplay();
+
+    // 1.0 replays at original speed, 10.0 ten times faster, 0.0 as fast as possible
+    void setSpeed(double speed);
+    // Only replay records of this channel, -1 replays all channels
+    void setChannel(int channel);
+
+    bool start();
+    void stop();
+    bool isRunning() const;
+
+    quint64 recordsReplayed() const;
+
+private:
+    ModBus* m_bus;
+    bool m_debug;
+    ModBusCaptureReader m_reader;
+    double m_speed;
+    int m_channel;
+    bool m_running;
+    QTimer m_stepTimer;
+    QElapsedTimer m_clock;
+    quint64 m_timeOffset;       // Capture time that corresponds to m_clock == 0
+    quint64 m_lastTimestamp;
+    quint64 m_recordsReplayed;
+    bool m_havePendingRecord;
+    ModBusCaptureReader::Record m_pendingRecord;
+
+    void replayRecord(const ModBusCaptureReader::Record &record);
+
+signals:
+    void signal_finished(quint64 recordsReplayed);
+
+private slots:
+    void slot_step();
+};
+
+#endif // OPENFFUCONTROLMODBUSREPLAY_H
@@ -0,0 +1,201 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QPointer>
+
+#include "modbusscanner.h"
+#include "modbus.h"
+#include "modbusframing.h"
+
+// Time to receive a response after the bus went idle
+#define MODBUSSCANNER_IDLE_MARGIN 50
+
+ModBusScanner::ModBusScanner(QObject *parent, QList<ModBus *> buses, bool debug) : QObject(parent)
+{
+    m_buses = buses;
+    m_debug = debug;
+    m_firstAddress = 1;
+    m_lastAddress = 247;
+    m_probeFunctionCode = 0x03;
+    m_probePayload = QByteArray("\x00\x00\x00\x01", 4);
+    m_timeout = 50;
+    m_retryTimeout = 500;
+    m_retryRepeatCount = 3;
+    m_retrying = false;
+    m_pending = 0;
+
+    // Probes report through their futures
+    foreach (ModBus* bus, m_buses)
+        bus->setFuturesEnabled(true);
+}
+
+void ModBusScanner::setAddressRange(quint8 firstAddress, quint8 lastAddress)
+{
+    if (firstAddress == 0)  // Broadcast gets no answer
+        firstAddress = 1;
+    m_firstAddress = firstAddress;
+    m_lastAddress = lastAddress;
+}
+
+void ModBusScanner::setProbe(quint8 functionCode, QByteArray payload)
+{
+    m_probeFunctionCode = functionCode;
+    m_probePayload = payload;
+}
+
+void ModBusScanner::setTimeout(int milliseconds)
+{
+    m_timeout = milliseconds;
+}
+
+void ModBusScanner::setRetry(int milliseconds, int repeatCount)
+{
+    m_retryTimeout = milliseconds;
+    m_retryRepeatCount = repeatCount;
+}
+
+bool ModBusScanner::scan()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusScanner::scan() addresses %i to %i on %i buses.\n", m_firstAddress, m_lastAddress, m_buses.count());
+        fflush(stdout);
+    }
+
+    if (isBusy())
+        return false;
+
+    m_liveSlaves.clear();
+    m_ambiguousSlaves.clear();
+    m_previousSilentSlave.clear();
+    m_retrying = false;
+
+    // Count first, a probe may be resolved before the next one is queued
+    m_pending = 1;
+    foreach (ModBus* bus, m_buses)
+    {
+        for (int slaveAddress = m_firstAddress; slaveAddress <= m_lastAddress; slaveAddress++)
+        {
+            m_pending++;
+            probe(bus, slaveAddress, m_timeout, 1);
+        }
+    }
+    passFinished();
+    return true;
+}
+
+bool ModBusScanner::isBusy() const
+{
+    return (m_pending > 0);
+}
+
+QMap<quint8, qint64> ModBusScanner::liveSlaves(ModBus *bus) const
+{
+    return m_liveSlaves.value(bus);
+}
+
+QList<quint8> ModBusScanner::ambiguousSlaves(ModBus *bus) const
+{
+    return m_ambiguousSlaves.value(bus);
+}
+
+void ModBusScanner::probe(ModBus *bus, quint8 slaveAddress, int timeout, int repeatCount)
+{
+    // A response whose length can not be told from its header is only parsed when the bus goes idle
+    char header[8] = { (char)slaveAddress, (char)m_probeFunctionCode, 0, 0, 0, 0, 0, 0 };
+    if ((ModBusFraming::responseLength(header, sizeof(header)) <= 0) && (timeout <= bus->rxIdleTimeout()))
+        timeout = bus->rxIdleTimeout() + MODBUSSCANNER_IDLE_MARGIN;
+
+    ModBusTelegram* telegram = new ModBusTelegram(slaveAddress, m_probeFunctionCode, m_probePayload, repeatCount);
+    telegram->requestTimeout = timeout;
+    quint64 telegramID = bus->writeTelegramToQueue(telegram);
+
+    QPointer<ModBusScanner> scanner(this);
+    bus->future(telegramID).then([scanner, bus, slaveAddress](const ModBusFuture &future) {
+        if (!scanner.isNull())
+            scanner->probeFinished(bus, slaveAddress, future);
+    });
+}
+
+void ModBusScanner::probeFinished(ModBus *bus, quint8 slaveAddress, const ModBusFuture &future)
+{
+    bool answered = (future.state() == ModBusFuture::STATE_FINISHED) || (future.state() == ModBusFuture::STATE_EXCEPTION);
+
+    // The bus only accepts responses from the probed address
+    if (answered)
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusScanner::probeFinished: Slave %i answered after %lli ns.\n", slaveAddress, (long long)future.responseTimeNs());
+            fflush(stdout);
+        }
+        m_liveSlaves[bus].insert(slaveAddress, future.responseTimeNs());
+        emit signal_slaveFound(bus, slaveAddress, future.responseTimeNs());
+    }
+    else if ((future.state() == ModBusFuture::STATE_LOST) && (future.responseTimeNs() >= 0))
+    {
+        m_ambiguousSlaves[bus].append(slaveAddress);
+
+        // The bytes may be the late answer to the previous probe, which then looked silent
+        int previousSlave = m_previousSilentSlave.value(bus, -1);
+        if (!m_retrying && (previousSlave >= 0) && !m_ambiguousSlaves[bus].contains(previousSlave))
+        {
+            if (m_debug)
+            {
+                fprintf(stdout, "DEBUG ModBusScanner::probeFinished: Slave %i may have answered late, probing it again.\n", previousSlave);
+                fflush(stdout);
+            }
+            m_ambiguousSlaves[bus].append(previousSlave);
+        }
+    }
+
+    // Probes of one bus finish in the order they were queued
+    if ((future.state() == ModBusFuture::STATE_LOST) && (future.responseTimeNs() < 0))
+        m_previousSilentSlave[bus] = slaveAddress;
+    else
+        m_previousSilentSlave[bus] = -1;
+
+    passFinished();
+}
+
+void ModBusScanner::passFinished()
+{
+    m_pending--;
+    if (m_pending > 0)
+        return;
+
+    if (!m_retrying)
+    {
+        m_retrying = true;
+        QHash<ModBus*, QList<quint8> > ambiguousSlaves = m_ambiguousSlaves;
+        m_ambiguousSlaves.clear();
+        m_previousSilentSlave.clear();
+
+        m_pending = 1;
+        for (QHash<ModBus*, QList<quint8> >::const_iterator it = ambiguousSlaves.constBegin(); it != ambiguousSlaves.constEnd(); ++it)
+        {
+            foreach (quint8 slaveAddress, it.value())
+            {
+                m_pending++;
+                probe(it.key(), slaveAddress, m_retryTimeout, m_retryRepeatCount);
+            }
+        }
+        passFinished();
+        return;
+    }
+
+    emit signal_finished();
+}
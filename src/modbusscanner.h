@@ -0,0 +1,86 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSSCANNER_H
+#define OPENFFUCONTROLMODBUSSCANNER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMap>
+
+#include "modbus_global.h"
+#include "modbusfuture.h"
+
+class ModBus;
+
+// Finds the populated addresses on one or more buses.
+//
+// Every address gets one probe with a short timeout and without repetition; the probes of
+// all buses are queued at once, so the buses are scanned in parallel. Any answer, also an
+// exception, proves a live slave. An address is ambiguous if bytes were received for its
+// probe but no valid answer, which happens with slow slaves, noise or two slaves sharing
+// the address. A slave that answers after its timeout puts its bytes into the probe of the
+// next address, so a silent address followed by an ambiguous one is ambiguous as well. Only
+// the ambiguous addresses are probed again with a longer timeout and repetitions. Silent
+// addresses are not asked again. Probes whose response length is not
+// known from its header wait at least for the receive idle timeout of the bus.
+class MODBUSSHARED_EXPORT ModBusScanner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ModBusScanner(QObject *parent, QList<ModBus*> buses, bool debug = false);
+
+    void setAddressRange(quint8 firstAddress, quint8 lastAddress);
+    void setProbe(quint8 functionCode, QByteArray payload);    // Default is reading holding register 0
+    void setTimeout(int milliseconds);
+    void setRetry(int milliseconds, int repeatCount);           // Timeout and number of sends for ambiguous addresses
+
+    // Returns false if a scan is still in progress
+    bool scan();
+    bool isBusy() const;
+
+    QMap<quint8, qint64> liveSlaves(ModBus* bus) const;    // Address and response time in ns
+    QList<quint8> ambiguousSlaves(ModBus* bus) const;       // Still ambiguous after the retry
+
+private:
+    QList<ModBus*> m_buses;
+    bool m_debug;
+    quint8 m_firstAddress;
+    quint8 m_lastAddress;
+    quint8 m_probeFunctionCode;
+    QByteArray m_probePayload;
+    int m_timeout;
+    int m_retryTimeout;
+    int m_retryRepeatCount;
+
+    QHash<ModBus*, QMap<quint8, qint64> > m_liveSlaves;
+    QHash<ModBus*, QList<quint8> > m_ambiguousSlaves;
+    QHash<ModBus*, int> m_previousSilentSlave;  // Address of the last probe on the bus if it got no bytes, else -1
+    bool m_retrying;
+    int m_pending;
+
+    void probe(ModBus* bus, quint8 slaveAddress, int timeout, int repeatCount);
+    void probeFinished(ModBus* bus, quint8 slaveAddress, const ModBusFuture &future);
+    void passFinished();
+
+signals:
+    void signal_slaveFound(ModBus* bus, quint8 slaveAddress, qint64 responseTimeNs);
+    void signal_finished();
+};
+
+#endif // OPENFFUCONTROLMODBUSSCANNER_H
@@ -0,0 +1,351 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#include <QDateTime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modbusshmpublisher.h"
+#include "modbus.h"
+
+static quint32 validBytes(quint32 registersPerTable)
+{
+    return ((registersPerTable + 63) / 64) * 8;
+}
+
+static quint32 blockSizeFor(quint32 registersPerTable)
+{
+    quint32 size = sizeof(ModBusShmBlockHeader) + validBytes(registersPerTable) + registersPerTable * sizeof(quint16);
+    return (size + 63) & ~63u;  // Cache line aligned blocks avoid false sharing between slaves
+}
+
+static quint32 headerSizeAligned()
+{
+    return (sizeof(ModBusShmHeader) + 63) & ~63u;
+}
+
+ModBusShmPublisher::ModBusShmPublisher(QObject *parent, ModBus *bus, QString busName, int registersPerTable, bool debug) : QObject(parent)
+{
+    m_bus = bus;
+    m_busName = busName;
+    m_registersPerTable = registersPerTable;
+    m_debug = debug;
+    m_map = NULL;
+    m_mapSize = 0;
+    m_blockSize = blockSizeFor(registersPerTable);
+}
+
+ModBusShmPublisher::~ModBusShmPublisher()
+{
+    if (m_map != NULL)
+        this->close();
+}
+
+QString ModBusShmPublisher::segmentName(QString busName)
+{
+    QString name = busName;
+    name.replace('/', '_');
+    return "/openffucontrol-qtmodbus" + name;
+}
+
+bool ModBusShmPublisher::open()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusShmPublisher::open().\n");
+        fflush(stdout);
+    }
+
+    if (m_map != NULL)
+        return true;
+
+    // Never resize or clear a segment that readers may have mapped: shrinking it would make their
+    // accesses fault and clearing it would tear the snapshots they are copying. Unlink the old
+    // segment instead; existing mappings stay valid and readers pick up the new one on reopen.
+    QByteArray name = segmentName(m_busName).toLocal8Bit();
+    shm_unlink(name.constData());
+    int fd = shm_open(name.constData(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return false;
+
+    m_mapSize = headerSizeAligned() + (size_t)256 * 4 * m_blockSize;
+    if (ftruncate(fd, m_mapSize) != 0)
+    {
+        ::close(fd);
+        shm_unlink(name.constData());
+        return false;
+    }
+
+    void* map = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name.constData());
+        return false;
+    }
+    m_map = (uchar*)map;
+
+    // The new segment is zero filled; readers accept it only when the magic is there
+    ModBusShmHeader* header = (ModBusShmHeader*)m_map;
+    header->version = version;
+    header->headerSize = headerSizeAligned();
+    header->slaveCount = 256;
+    header->tableCount = 4;
+    header->registersPerTable = m_registersPerTable;
+    header->blockSize = m_blockSize;
+    QByteArray busName = m_busName.toUtf8();
+    strncpy(header->busName, busName.constData(), sizeof(header->busName) - 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, "MBSHM", 5);
+
+    // Direct connections; publishing is cheap and must see the data of the response being parsed
+    connect(m_bus, SIGNAL(signal_coilsRead(quint64,quint8,quint16,QList<bool>)), this, SLOT(slot_coilsRead(quint64,quint8,quint16,QList<bool>)), Qt::DirectConnection);
+    connect(m_bus, SIGNAL(signal_discreteInputsRead(quint64,quint8,quint16,QList<bool>)), this, SLOT(slot_discreteInputsRead(quint64,quint8,quint16,QList<bool>)), Qt::DirectConnection);
+    connect(m_bus, SIGNAL(signal_holdingRegistersRead(quint64,quint8,quint16,QList<quint16>)), this, SLOT(slot_holdingRegistersRead(quint64,quint8,quint16,QList<quint16>)), Qt::DirectConnection);
+    connect(m_bus, SIGNAL(signal_inputRegistersRead(quint64,quint8,quint16,QList<quint16>)), this, SLOT(slot_inputRegistersRead(quint64,quint8,quint16,QList<quint16>)), Qt::DirectConnection);
+
+    return true;
+}
+
+void ModBusShmPublisher::close()
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusShmPublisher::close().\n");
+        fflush(stdout);
+    }
+
+    disconnect(m_bus, 0, this, 0);
+    if (m_map != NULL)
+    {
+        munmap(m_map, m_mapSize);
+        m_map = NULL;
+    }
+    // The segment itself stays, so readers keep the last values until the publisher is restarted
+}
+
+bool ModBusShmPublisher::isOpen() const
+{
+    return (m_map != NULL);
+}
+
+ModBusShmBlockHeader *ModBusShmPublisher::block(quint8 slaveAddress, ModBusRegisterBank::Table table)
+{
+    return (ModBusShmBlockHeader*)(m_map + headerSizeAligned() + ((size_t)slaveAddress * 4 + table) * m_blockSize);
+}
+
+void ModBusShmPublisher::beginWrite(ModBusShmBlockHeader *block)
+{
+    // Only one publisher writes a segment, no compare-and-swap needed
+    block->sequence.store(block->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void ModBusShmPublisher::endWrite(ModBusShmBlockHeader *block)
+{
+    quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
+    block->timestampLow.store(timestamp & 0xffffffff, std::memory_order_relaxed);
+    block->timestampHigh.store(timestamp >> 32, std::memory_order_relaxed);
+    block->updates.fetch_add(1, std::memory_order_relaxed);
+    block->sequence.fetch_add(1, std::memory_order_release);
+}
+
+void ModBusShmPublisher::publish(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, const QList<quint16> &values)
+{
+    if ((m_map == NULL) || (dataStartAddress >= m_registersPerTable))
+        return;
+
+    int count = qMin(values.count(), m_registersPerTable - dataStartAddress);
+    ModBusShmBlockHeader* header = block(slaveAddress, table);
+    std::atomic<quint8>* valid = (std::atomic<quint8>*)(header + 1);
+    std::atomic<quint16>* data = (std::atomic<quint16>*)((uchar*)valid + validBytes(m_registersPerTable));
+
+    beginWrite(header);
+    for (int i = 0; i < count; i++)
+    {
+        int address = dataStartAddress + i;
+        data[address].store(values.at(i), std::memory_order_relaxed);
+        valid[address / 8].fetch_or(1 << (address % 8), std::memory_order_relaxed);
+    }
+    endWrite(header);
+}
+
+void ModBusShmPublisher::publish(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, const QList<bool> &values)
+{
+    QList<quint16> words;
+    words.reserve(values.count());
+    foreach (bool value, values)
+        words.append(value ? 1 : 0);
+    publish(slaveAddress, table, dataStartAddress, words);
+}
+
+void ModBusShmPublisher::slot_coilsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on)
+{
+    Q_UNUSED(telegramID);
+    publish(slaveAddress, ModBusRegisterBank::TABLE_COILS, dataStartAddress, on);
+}
+
+void ModBusShmPublisher::slot_discreteInputsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on)
+{
+    Q_UNUSED(telegramID);
+    publish(slaveAddress, ModBusRegisterBank::TABLE_DISCRETE_INPUTS, dataStartAddress, on);
+}
+
+void ModBusShmPublisher::slot_holdingRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data)
+{
+    Q_UNUSED(telegramID);
+    publish(slaveAddress, ModBusRegisterBank::TABLE_HOLDING_REGISTERS, dataStartAddress, data);
+}
+
+void ModBusShmPublisher::slot_inputRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data)
+{
+    Q_UNUSED(telegramID);
+    publish(slaveAddress, ModBusRegisterBank::TABLE_INPUT_REGISTERS, dataStartAddress, data);
+}
+
+ModBusShmReader::ModBusShmReader(QString busName)
+{
+    m_busName = busName;
+    m_map = NULL;
+    m_mapSize = 0;
+    m_header = NULL;
+    m_device = 0;
+    m_inode = 0;
+}
+
+ModBusShmReader::~ModBusShmReader()
+{
+    this->close();
+}
+
+bool ModBusShmReader::open()
+{
+    if (m_map != NULL)
+        return true;
+
+    QByteArray name = ModBusShmPublisher::segmentName(m_busName).toLocal8Bit();
+    int fd = shm_open(name.constData(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || ((size_t)info.st_size < sizeof(ModBusShmHeader)))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    m_map = (const uchar*)map;
+    m_mapSize = info.st_size;
+    m_device = info.st_dev;
+    m_inode = info.st_ino;
+    m_header = (const ModBusShmHeader*)m_map;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((memcmp(m_header->magic, "MBSHM", 5) != 0) ||
+            (m_header->version != ModBusShmPublisher::version) ||
+            (m_header->headerSize + (size_t)m_header->slaveCount * m_header->tableCount * m_header->blockSize > m_mapSize))
+    {
+        this->close();
+        return false;
+    }
+
+    return true;
+}
+
+void ModBusShmReader::close()
+{
+    if (m_map != NULL)
+        munmap((void*)m_map, m_mapSize);
+    m_map = NULL;
+    m_header = NULL;
+    m_mapSize = 0;
+}
+
+bool ModBusShmReader::isStale() const
+{
+    if (m_map == NULL)
+        return true;
+
+    QByteArray name = ModBusShmPublisher::segmentName(m_busName).toLocal8Bit();
+    int fd = shm_open(name.constData(), O_RDONLY, 0);
+    if (fd < 0)
+        return true;
+
+    struct stat info;
+    bool stale = (fstat(fd, &info) != 0) || (info.st_dev != m_device) || (info.st_ino != m_inode);
+    ::close(fd);
+    return stale;
+}
+
+int ModBusShmReader::registersPerTable() const
+{
+    if (m_header == NULL)
+        return 0;
+    return m_header->registersPerTable;
+}
+
+const ModBusShmBlockHeader *ModBusShmReader::block(quint8 slaveAddress, ModBusRegisterBank::Table table) const
+{
+    return (const ModBusShmBlockHeader*)(m_map + m_header->headerSize + ((size_t)slaveAddress * m_header->tableCount + table) * m_header->blockSize);
+}
+
+bool ModBusShmReader::read(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, quint16 count, quint16 *values, qint64 *timestamp) const
+{
+    if ((m_header == NULL) || (count == 0) || ((quint32)dataStartAddress + count > m_header->registersPerTable))
+        return false;
+
+    const ModBusShmBlockHeader* header = block(slaveAddress, table);
+    const std::atomic<quint8>* valid = (const std::atomic<quint8>*)(header + 1);
+    const std::atomic<quint16>* data = (const std::atomic<quint16>*)((const uchar*)valid + validBytes(m_header->registersPerTable));
+    bool allValid;
+    quint32 sequence;
+
+    do
+    {
+        sequence = header->sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+            continue;
+
+        allValid = true;
+        for (quint16 i = 0; i < count; i++)
+        {
+            int address = dataStartAddress + i;
+            if (!(valid[address / 8].load(std::memory_order_relaxed) & (1 << (address % 8))))
+                allValid = false;
+            values[i] = data[address].load(std::memory_order_relaxed);
+        }
+        if (timestamp != NULL)
+            *timestamp = ((qint64)header->timestampHigh.load(std::memory_order_relaxed) << 32) | header->timestampLow.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) || (header->sequence.load(std::memory_order_relaxed) != sequence));
+
+    return allValid;
+}
+
+quint32 ModBusShmReader::updates(quint8 slaveAddress, ModBusRegisterBank::Table table) const
+{
+    if (m_header == NULL)
+        return 0;
+    return block(slaveAddress, table)->updates.load(std::memory_order_acquire);
+}
@@ -0,0 +1,130 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+#ifndef OPENFFUCONTROLMODBUSSHMPUBLISHER_H
+#define OPENFFUCONTROLMODBUSSHMPUBLISHER_H
+
+#include <QObject>
+#include <QList>
+#include <atomic>
+#include <sys/types.h>
+
+#include "modbus_global.h"
+#include "modbusregisterbank.h"
+
+class ModBus;
+
+// Layout of the POSIX shared memory segment "/openffucontrol-qtmodbus<bus>", where <bus> is the
+// bus name with '/' replaced by '_' (e.g. "/openffucontrol-qtmodbus_dev_ttyUSB0").
+//
+// The segment starts with ModBusShmHeader, followed by one block for every slave address (0-255)
+// and table (coils, discrete inputs, holding registers, input registers as in ModBusRegisterBank).
+// Block n = slaveAddress * 4 + table starts at headerSize + n * blockSize.
+// Bits of coils and discrete inputs are stored as one value (0 or 1) each.
+//
+// Every block is guarded by its own sequence counter. Readers copy what they need and retry
+// if the counter was odd or has changed meanwhile; ModBusShmReader does exactly that.
+//
+// A publisher never resizes or clears an existing segment. open() unlinks it and creates a new
+// one, so readers keep a valid (but no longer updated) mapping until they reopen the name.
+
+typedef struct {
+    char magic[8];                  // "MBSHM" followed by zeros, written last on creation
+    quint32 version;                // 1
+    quint32 headerSize;
+    quint32 slaveCount;             // 256
+    quint32 tableCount;             // 4
+    quint32 registersPerTable;      // Data addresses 0 .. registersPerTable - 1 are published
+    quint32 blockSize;
+    char busName[64];
+} ModBusShmHeader;
+
+typedef struct {
+    std::atomic<quint32> sequence;  // Odd while the publisher writes the block
+    std::atomic<quint32> updates;   // Number of responses published into this block
+    std::atomic<quint32> timestampLow;  // ms since epoch of the last update
+    std::atomic<quint32> timestampHigh;
+    // Followed by: std::atomic<quint8> valid[registersPerTable / 8], one bit per value that has ever been read
+    //              std::atomic<quint16> values[registersPerTable]
+} ModBusShmBlockHeader;
+
+class MODBUSSHARED_EXPORT ModBusShmPublisher : public QObject
+{
+    Q_OBJECT
+public:
+    static const quint32 version = 1;
+
+    explicit ModBusShmPublisher(QObject *parent, ModBus* bus, QString busName, int registersPerTable = 1024, bool debug = false);
+    ~ModBusShmPublisher();
+
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    static QString segmentName(QString busName);
+
+private:
+    ModBus* m_bus;
+    QString m_busName;
+    int m_registersPerTable;
+    bool m_debug;
+    uchar* m_map;
+    size_t m_mapSize;
+    quint32 m_blockSize;
+
+    void publish(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, const QList<quint16> &values);
+    void publish(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, const QList<bool> &values);
+    ModBusShmBlockHeader* block(quint8 slaveAddress, ModBusRegisterBank::Table table);
+    void beginWrite(ModBusShmBlockHeader* block);
+    void endWrite(ModBusShmBlockHeader* block);
+
+private slots:
+    void slot_coilsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on);
+    void slot_discreteInputsRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<bool> on);
+    void slot_holdingRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data);
+    void slot_inputRegistersRead(quint64 telegramID, quint8 slaveAddress, quint16 dataStartAddress, QList<quint16> data);
+};
+
+// Consumer side; maps a segment read-only and copies consistent snapshots out of it
+class MODBUSSHARED_EXPORT ModBusShmReader
+{
+public:
+    ModBusShmReader(QString busName);
+    ~ModBusShmReader();
+
+    bool open();
+    void close();
+
+    // True if the segment was recreated by a publisher since open(); close() and open() again
+    bool isStale() const;
+
+    int registersPerTable() const;
+
+    // Returns false if the range is outside the published area or no value of it has ever been read
+    bool read(quint8 slaveAddress, ModBusRegisterBank::Table table, quint16 dataStartAddress, quint16 count, quint16* values, qint64* timestamp = NULL) const;
+    quint32 updates(quint8 slaveAddress, ModBusRegisterBank::Table table) const;
+
+private:
+    QString m_busName;
+    const uchar* m_map;
+    size_t m_mapSize;
+    const ModBusShmHeader* m_header;
+    dev_t m_device;
+    ino_t m_inode;
+
+    const ModBusShmBlockHeader* block(quint8 slaveAddress, ModBusRegisterBank::Table table) const;
+};
+
+#endif // OPENFFUCONTROLMODBUSSHMPUBLISHER_H
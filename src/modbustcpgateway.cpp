@@ -0,0 +1,435 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+
+#include <QPointer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QVariant>
+
+#include "modbustcpgateway.h"
+#include "modbus.h"
+#include "modbusframing.h"
+
+#define MODBUS_MBAP_HEADER_SIZE     7
+#define MODBUS_MAX_PDU_SIZE         253
+
+ModBusTcpGateway::ModBusTcpGateway(QObject *parent, ModBus *bus, Framing framing, bool debug) : QObject(parent)
+{
+    m_bus = bus;
+    m_framing = framing;
+    m_debug = debug;
+    m_nextClient = 0;
+    m_nextClientID = 1;
+    m_maxTelegramsInQueue = 4;
+    m_maxRequestsPerClient = 32;
+    m_maxRequestsInFlightPerClient = 2;
+    m_readMerging = true;
+    m_telegramsInQueue = 0;
+    m_mergedReads = 0;
+
+    m_server = new QTcpServer(this);
+    m_server->setMaxPendingConnections(256);
+    connect(m_server, SIGNAL(newConnection()), this, SLOT(slot_newConnection()));
+
+    // Responses are routed back through the futures of the telegrams
+    m_bus->setFuturesEnabled(true);
+}
+
+ModBusTcpGateway::~ModBusTcpGateway()
+{
+    close();
+}
+
+bool ModBusTcpGateway::listen(const QHostAddress &address, quint16 port)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusTcpGateway::listen() on %s port %i.\n", address.toString().toLocal8Bit().constData(), port);
+        fflush(stdout);
+    }
+
+    if (!m_server->listen(address, port))
+    {
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusTcpGateway::listen: Error: %s\n", m_server->errorString().toLocal8Bit().constData());
+            fflush(stdout);
+        }
+        return false;
+    }
+    return true;
+}
+
+void ModBusTcpGateway::close()
+{
+    m_server->close();
+
+    // Telegrams already in the queue of the bus finish without anyone to answer to
+    foreach (Client* client, m_clients.values())
+        removeClient(client);
+}
+
+bool ModBusTcpGateway::isListening() const
+{
+    return m_server->isListening();
+}
+
+quint16 ModBusTcpGateway::serverPort() const
+{
+    return m_server->serverPort();
+}
+
+void ModBusTcpGateway::setMaxTelegramsInQueue(int count)
+{
+    m_maxTelegramsInQueue = qMax(1, count);
+}
+
+void ModBusTcpGateway::setMaxRequestsPerClient(int count)
+{
+    m_maxRequestsPerClient = qMax(1, count);
+}
+
+void ModBusTcpGateway::setMaxRequestsInFlightPerClient(int count)
+{
+    m_maxRequestsInFlightPerClient = qMax(1, count);
+}
+
+void ModBusTcpGateway::setReadMerging(bool on)
+{
+    m_readMerging = on;
+}
+
+int ModBusTcpGateway::clientCount() const
+{
+    return m_clients.size();
+}
+
+quint64 ModBusTcpGateway::mergedReads() const
+{
+    return m_mergedReads;
+}
+
+void ModBusTcpGateway::slot_newConnection()
+{
+    while (m_server->hasPendingConnections())
+    {
+        QTcpSocket* socket = m_server->nextPendingConnection();
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+        Client* client = new Client;
+        client->clientID = m_nextClientID++;
+        client->socket = socket;
+        client->inFlight = 0;
+        m_clients.insert(client->clientID, client);
+        m_clientIDs.insert(socket, client->clientID);
+        m_clientOrder.append(client->clientID);
+
+        connect(socket, SIGNAL(readyRead()), this, SLOT(slot_readyRead()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(slot_disconnected()));
+
+        if (m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusTcpGateway::slot_newConnection() from %s port %i, %i clients.\n", socket->peerAddress().toString().toLocal8Bit().constData(), socket->peerPort(), m_clients.size());
+            fflush(stdout);
+        }
+        emit signal_clientConnected(socket->peerAddress(), socket->peerPort());
+    }
+}
+
+void ModBusTcpGateway::slot_readyRead()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    Client* client = m_clients.value(m_clientIDs.value(socket), NULL);
+    if (client == NULL)
+        return;
+
+    client->rxBuffer.append(socket->readAll());
+    parseRequests(client);
+    dispatch();
+}
+
+void ModBusTcpGateway::slot_disconnected()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    Client* client = m_clients.value(m_clientIDs.value(socket), NULL);
+    if (client == NULL)
+        return;
+
+    emit signal_clientDisconnected(socket->peerAddress(), socket->peerPort());
+    removeClient(client);
+}
+
+void ModBusTcpGateway::removeClient(Client *client)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusTcpGateway::removeClient() %llu with %i requests waiting.\n", (unsigned long long)client->clientID, client->requests.size());
+        fflush(stdout);
+    }
+
+    m_clients.remove(client->clientID);
+    m_clientIDs.remove(client->socket);
+    m_clientOrder.removeAll(client->clientID);
+    client->socket->disconnect(this);
+    client->socket->abort();
+    client->socket->deleteLater();
+    delete client;
+}
+
+void ModBusTcpGateway::parseRequests(Client *client)
+{
+    QByteArray &buffer = client->rxBuffer;
+
+    if (m_framing == FRAMING_MBAP)
+    {
+        while (buffer.size() >= MODBUS_MBAP_HEADER_SIZE)
+        {
+            const quint8* header = (const quint8*)buffer.constData();
+            quint16 protocolID = (header[2] << 8) | header[3];
+            quint16 length = (header[4] << 8) | header[5];
+
+            // A stream that is out of sync can not be recovered
+            if ((protocolID != 0) || (length < 2) || (length > MODBUS_MAX_PDU_SIZE + 1))
+            {
+                if (m_debug)
+                {
+                    fprintf(stdout, "DEBUG ModBusTcpGateway::parseRequests: Invalid MBAP header %s, closing connection.\n", buffer.left(MODBUS_MBAP_HEADER_SIZE).toHex().constData());
+                    fflush(stdout);
+                }
+                removeClient(client);
+                return;
+            }
+
+            if (buffer.size() < 6 + length)
+                return;
+
+            Request request;
+            request.clientID = client->clientID;
+            request.transactionID = (header[0] << 8) | header[1];
+            request.unitID = header[6];
+            request.pdu = buffer.mid(MODBUS_MBAP_HEADER_SIZE, length - 1);
+            buffer.remove(0, 6 + length);
+
+            enqueueRequest(client, request);
+        }
+    }
+    else
+    {
+        while (buffer.size() >= 4)
+        {
+            int length = ModBusFraming::requestLength(buffer);
+            if (length == 0)
+                return;
+
+            // Without a known length the frame end can not be found; drop what was received
+            if ((length < 0) || (length > MODBUS_MAX_PDU_SIZE + 3))
+            {
+                if (m_debug)
+                {
+                    fprintf(stdout, "DEBUG ModBusTcpGateway::parseRequests: Unknown frame %s dropped.\n", buffer.toHex().constData());
+                    fflush(stdout);
+                }
+                buffer.clear();
+                return;
+            }
+
+            if (buffer.size() < length)
+                return;
+
+            quint16 crc = (quint8)buffer.at(length - 2) | ((quint8)buffer.at(length - 1) << 8);
+            if (crc != ModBus::checksum(buffer.constData(), length - 2))
+            {
+                // A device would stay silent as well
+                if (m_debug)
+                {
+                    fprintf(stdout, "DEBUG ModBusTcpGateway::parseRequests: CRC error in %s, dropped.\n", buffer.left(length).toHex().constData());
+                    fflush(stdout);
+                }
+                buffer.clear();
+                return;
+            }
+
+            Request request;
+            request.clientID = client->clientID;
+            request.transactionID = 0;
+            request.unitID = buffer.at(0);
+            request.pdu = buffer.mid(1, length - 3);
+            buffer.remove(0, length);
+
+            enqueueRequest(client, request);
+        }
+    }
+}
+
+void ModBusTcpGateway::enqueueRequest(Client *client, const Request &request)
+{
+    if (client->requests.size() >= m_maxRequestsPerClient)
+    {
+        sendException(client, request, 0x06);   // E_SERVER_DEVICE_BUSY
+        return;
+    }
+
+    client->requests.enqueue(request);
+}
+
+bool ModBusTcpGateway::isMergeable(const QByteArray &pdu)
+{
+    if (pdu.size() != 5)
+        return false;
+
+    quint8 functionCode = pdu.at(0);
+    return (functionCode >= 0x01) && (functionCode <= 0x04);
+}
+
+void ModBusTcpGateway::dispatch()
+{
+    int clientCount = m_clientOrder.size();
+    int idleClients = 0;
+
+    // One request per client and turn; stop after a full round without anything to send
+    while ((m_telegramsInQueue < m_maxTelegramsInQueue) && (clientCount > 0) && (idleClients < clientCount))
+    {
+        if (m_nextClient >= clientCount)
+            m_nextClient = 0;
+        Client* client = m_clients.value(m_clientOrder.at(m_nextClient));
+        m_nextClient++;
+
+        int maxInFlight = (m_framing == FRAMING_RTU) ? 1 : m_maxRequestsInFlightPerClient;
+        if (client->requests.isEmpty() || (client->inFlight >= maxInFlight))
+        {
+            idleClients++;
+            continue;
+        }
+        idleClients = 0;
+
+        Request request = client->requests.dequeue();
+        client->inFlight++;
+        submit(request);
+    }
+}
+
+void ModBusTcpGateway::submit(const Request &request)
+{
+    QByteArray key;
+    if (m_readMerging && isMergeable(request.pdu) && (request.unitID != 0))
+    {
+        key.append(request.unitID);
+        key.append(request.pdu);
+
+        QHash<QByteArray, QList<Request> >::iterator it = m_pendingReads.find(key);
+        if (it != m_pendingReads.end())
+        {
+            it.value().append(request);
+            m_mergedReads++;
+            return;
+        }
+        m_pendingReads.insert(key, QList<Request>() << request);
+    }
+
+    ModBusTelegram* telegram = new ModBusTelegram(request.unitID, request.pdu.at(0), request.pdu.mid(1), m_bus->getTelegramRepeatCount());
+    quint64 telegramID = m_bus->writeTelegramToQueue(telegram);
+    m_telegramsInQueue++;
+
+    QPointer<ModBusTcpGateway> gateway(this);
+    QList<Request> requests;
+    requests.append(request);
+    m_bus->future(telegramID).then([gateway, key, requests](const ModBusFuture &future) {
+        if (gateway.isNull())
+            return;
+        if (key.isEmpty())
+            gateway->telegramFinished(requests, future);
+        else
+            gateway->telegramFinished(gateway->m_pendingReads.take(key), future);
+    });
+}
+
+void ModBusTcpGateway::telegramFinished(const QList<Request> &requests, const ModBusFuture &future)
+{
+    m_telegramsInQueue--;
+
+    foreach (const Request &request, requests)
+    {
+        Client* client = m_clients.value(request.clientID, NULL);
+        if (client == NULL)
+            continue;   // Disconnected meanwhile
+        client->inFlight--;
+
+        if (request.unitID == 0)
+            continue;   // Broadcast
+
+        QByteArray response = future.response();
+        switch (future.state())
+        {
+        case ModBusFuture::STATE_FINISHED:
+        case ModBusFuture::STATE_EXCEPTION:
+            if (response.size() >= 4)
+                sendResponse(client, request, response.mid(1, response.size() - 3));
+            else
+                sendException(client, request, future.exceptionCode());
+            break;
+        case ModBusFuture::STATE_LOST:
+            // An RTU device that does not answer stays silent, a Modbus TCP gateway reports it
+            if (m_framing == FRAMING_MBAP)
+                sendException(client, request, 0x0b);   // E_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND
+            break;
+        default:
+            if (m_framing == FRAMING_MBAP)
+                sendException(client, request, 0x0a);   // E_GATEWAY_PATH_UNAVAILABLE
+            break;
+        }
+    }
+
+    dispatch();
+}
+
+void ModBusTcpGateway::sendException(Client *client, const Request &request, quint8 exceptionCode)
+{
+    QByteArray pdu;
+    pdu.append((char)(request.pdu.isEmpty() ? 0x80 : (request.pdu.at(0) | 0x80)));
+    pdu.append(exceptionCode);
+    sendResponse(client, request, pdu);
+}
+
+void ModBusTcpGateway::sendResponse(Client *client, const Request &request, const QByteArray &pdu)
+{
+    QByteArray adu;
+
+    if (m_framing == FRAMING_MBAP)
+    {
+        quint16 length = pdu.size() + 1;
+        adu.reserve(MODBUS_MBAP_HEADER_SIZE + pdu.size());
+        adu.append(request.transactionID >> 8);
+        adu.append(request.transactionID & 0xff);
+        adu.append((char)0x00);
+        adu.append((char)0x00);
+        adu.append(length >> 8);
+        adu.append(length & 0xff);
+        adu.append(request.unitID);
+        adu.append(pdu);
+    }
+    else
+    {
+        adu.reserve(pdu.size() + 3);
+        adu.append(request.unitID);
+        adu.append(pdu);
+        quint16 crc = ModBus::checksum(adu.constData(), adu.size());
+        adu.append(crc & 0xff);
+        adu.append(crc >> 8);
+    }
+
+    client->socket->write(adu);
+}
@@ -0,0 +1,125 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSTCPGATEWAY_H
+#define OPENFFUCONTROLMODBUSTCPGATEWAY_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <QHostAddress>
+
+#include "modbus_global.h"
+#include "modbusfuture.h"
+
+class ModBus;
+class QTcpServer;
+class QTcpSocket;
+
+// Gives many TCP clients access to one serial bus.
+//
+// Every client connection is served from the thread of the gateway, which must be the thread
+// of the bus. Clients speak Modbus TCP (MBAP header, responses are matched by transaction id)
+// or RTU over TCP (plain RTU frames with CRC, answered in order). The unit id of a request is
+// the slave address on the bus; unit id 0 is sent as broadcast and gets no answer.
+//
+// Requests of a client wait in a queue of that client. The gateway keeps only a few telegrams
+// in the queue of the bus and refills it round robin over the clients, so a client with a
+// long pipeline of requests can not starve the others. A read of coils, discrete inputs, holding
+// or input registers that is identical to a read already in the queue of the bus is not sent
+// again; all clients waiting for it get the same response.
+class MODBUSSHARED_EXPORT ModBusTcpGateway : public QObject
+{
+    Q_OBJECT
+public:
+    typedef enum {
+        FRAMING_MBAP,   // Modbus TCP
+        FRAMING_RTU     // RTU over TCP
+    } Framing;
+
+    explicit ModBusTcpGateway(QObject *parent, ModBus* bus, Framing framing = FRAMING_MBAP, bool debug = false);
+    ~ModBusTcpGateway();
+
+    bool listen(const QHostAddress &address = QHostAddress::Any, quint16 port = 502);
+    void close();
+    bool isListening() const;
+    quint16 serverPort() const;
+
+    void setMaxTelegramsInQueue(int count);         // Telegrams of all clients in the queue of the bus, default 4
+    void setMaxRequestsPerClient(int count);        // Requests a client may have waiting, more are rejected with exception 0x06; default 32
+    void setMaxRequestsInFlightPerClient(int count);// Modbus TCP clients only, RTU clients always get one at a time; default 2
+    void setReadMerging(bool on);
+
+    int clientCount() const;
+    quint64 mergedReads() const;
+
+private:
+    // One request of a client; for RTU clients the transaction id is unused
+    typedef struct {
+        quint64 clientID;
+        quint16 transactionID;
+        quint8 unitID;
+        QByteArray pdu;     // Function code and data
+    } Request;
+
+    typedef struct {
+        quint64 clientID;
+        QTcpSocket* socket;
+        QByteArray rxBuffer;
+        QQueue<Request> requests;   // Not yet handed to the bus
+        int inFlight;
+    } Client;
+
+    ModBus* m_bus;
+    Framing m_framing;
+    bool m_debug;
+    QTcpServer* m_server;
+    QHash<quint64, Client*> m_clients;
+    QHash<QTcpSocket*, quint64> m_clientIDs;
+    QList<quint64> m_clientOrder;       // Round robin order of the clients
+    int m_nextClient;
+    quint64 m_nextClientID;
+    int m_maxTelegramsInQueue;
+    int m_maxRequestsPerClient;
+    int m_maxRequestsInFlightPerClient;
+    bool m_readMerging;
+    int m_telegramsInQueue;
+    QHash<QByteArray, QList<Request> > m_pendingReads;  // Mergeable reads in the queue of the bus by unit id and pdu
+    quint64 m_mergedReads;
+
+    void parseRequests(Client* client);
+    void enqueueRequest(Client* client, const Request &request);
+    void dispatch();
+    void submit(const Request &request);
+    void telegramFinished(const QList<Request> &requests, const ModBusFuture &future);
+    void sendResponse(Client* client, const Request &request, const QByteArray &pdu);
+    void sendException(Client* client, const Request &request, quint8 exceptionCode);
+    void removeClient(Client* client);
+    static bool isMergeable(const QByteArray &pdu);
+
+signals:
+    void signal_clientConnected(QHostAddress address, quint16 port);
+    void signal_clientDisconnected(QHostAddress address, quint16 port);
+
+private slots:
+    void slot_newConnection();
+    void slot_readyRead();
+    void slot_disconnected();
+};
+
+#endif // OPENFFUCONTROLMODBUSTCPGATEWAY_H
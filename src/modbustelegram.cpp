@@ -26,6 +26,11 @@ ModBusTelegram::ModBusTelegram()
     repeatCount = 1;
     requestedDataStartAddress = 0;
     requestedCount = 0;
+    requestTimeout = 0;
+    responseTimeNs = -1;
+    timestamps = ModBusTimestamps();
+    batchContinues = false;
+    echoProbe = false;
 }
 
 ModBusTelegram::ModBusTelegram(quint8 slaveAddress, quint8 functionCode, QByteArray data, int repeatCount)
@@ -42,6 +47,11 @@ ModBusTelegram::ModBusTelegram(quint8 slaveAddress, quint8 functionCode, QByteAr
     this->repeatCount = repeatCount;
     requestedDataStartAddress = 0;
     requestedCount = 0;
+    requestTimeout = 0;
+    responseTimeNs = -1;
+    timestamps = ModBusTimestamps();
+    batchContinues = false;
+    echoProbe = false;
 }
 
 bool ModBusTelegram::needsAnswer()
@@ -17,6 +17,18 @@
 #define OPENFFUCONTROLMODBUSTELEGRAM_H
 
 #include <QByteArray>
+#include <QSharedPointer>
+#include <QMetaType>
+
+class ModBusFutureState;
+
+// Monotonic timestamps of a transaction in ns, on the clock of ModBus::monotonicNs(); 0 if the event has not happened
+typedef struct {
+    qint64 enqueued;
+    qint64 transmitted;         // Last transmission handed to the port
+    qint64 firstByteReceived;   // First byte of the response
+    qint64 completed;           // Response parsed, or telegram lost after the last transmission
+} ModBusTimestamps;
 
 class ModBusTelegram
 {
@@ -41,8 +53,21 @@ public:
     quint16 requestedDataStartAddress;
     quint16 requestedCount;
     QByteArray data;
+    QByteArray adu;     // Complete frame including CRC, encoded by the bus when queued; must be encoded again if the fields above change
 
     int repeatCount;    // Set to different value if that telegram is important and should be autorepeated
+    int requestTimeout; // Milliseconds to wait for the answer, 0 uses the timeout of the bus
+
+    qint64 responseTimeNs;  // From writing the last request to the first byte received, -1 if nothing was received
+    ModBusTimestamps timestamps;
+
+    bool batchContinues;    // Part of a contiguous batch and not its last telegram; the scheduler must send the next one of the batch afterwards
+
+    QSharedPointer<ModBusFutureState> futureState;  // Set if somebody waits for this telegram with a ModBusFuture
+
+    QSharedPointer<ModBusTelegram> fusedRead;   // Read holding registers telegram that rides along in this fc 0x17 telegram
+
+    bool echoProbe;     // Sent by the bus itself to find out whether the adapter echoes; reports nothing
 
     bool needsAnswer();
 
@@ -52,4 +77,6 @@ private:
     quint64 m_id; // Telegram id is unique accross all telegrams per bus
 };
 
+Q_DECLARE_METATYPE(ModBusTimestamps)
+
 #endif // OPENFFUCONTROLMODBUSTELEGRAM_H
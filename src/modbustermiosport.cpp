@@ -0,0 +1,392 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "modbustermiosport.h"
+
+ModBusTermiosPort::ModBusTermiosPort(QObject *parent, QString interface, bool debug) : QObject(parent)
+{
+    m_interface = interface;
+    m_debug = debug;
+    m_realtimePriority = 0;
+    m_interFrameGapConfigured = 0;
+    m_interFrameGap = 1750;
+    m_fd = -1;
+    m_epollFd = -1;
+    m_timerFd = -1;
+    m_eventFd = -1;
+    m_running = false;
+    m_deviceLost = false;
+}
+
+ModBusTermiosPort::~ModBusTermiosPort()
+{
+    close();
+}
+
+void ModBusTermiosPort::setRealtimePriority(int priority)
+{
+    m_realtimePriority = priority;
+}
+
+void ModBusTermiosPort::setInterFrameGap(int microseconds)
+{
+    m_interFrameGapConfigured = microseconds;
+}
+
+bool ModBusTermiosPort::open(qint32 baudrate, QSerialPort::DataBits dataBits, QSerialPort::Parity parity, QSerialPort::StopBits stopBits)
+{
+    if (m_debug)
+    {
+        fprintf(stdout, "DEBUG ModBusTermiosPort::open() %s.\n", m_interface.toLocal8Bit().constData());
+        fflush(stdout);
+    }
+
+    // Also cleans up after a lost device, which is no longer open but still holds its descriptors
+    close();
+
+    m_fd = ::open(m_interface.toLocal8Bit().constData(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (m_fd < 0)
+    {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    if (!configure(baudrate, dataBits, parity, stopBits))
+    {
+        closeDescriptors();
+        return false;
+    }
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((m_epollFd < 0) || (m_timerFd < 0) || (m_eventFd < 0))
+    {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        closeDescriptors();
+        return false;
+    }
+
+    int fds[3] = { m_fd, m_timerFd, m_eventFd };
+    for (int i = 0; i < 3; i++)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fds[i];
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fds[i], &event) < 0)
+        {
+            m_errorString = QString::fromLocal8Bit(strerror(errno));
+            closeDescriptors();
+            return false;
+        }
+    }
+
+    m_running = true;
+    m_deviceLost = false;
+    m_thread = std::thread(&ModBusTermiosPort::run, this);
+    return true;
+}
+
+void ModBusTermiosPort::close()
+{
+    if (m_thread.joinable())
+    {
+        m_running = false;
+        quint64 wake = 1;
+        if (::write(m_eventFd, &wake, sizeof(wake)) < 0) {}
+        m_thread.join();
+    }
+
+    closeDescriptors();
+
+    m_txMutex.lock();
+    m_txQueue.clear();
+    m_txMutex.unlock();
+}
+
+bool ModBusTermiosPort::isOpen() const
+{
+    return (m_fd >= 0) && !m_deviceLost;
+}
+
+QString ModBusTermiosPort::errorString() const
+{
+    return m_errorString;
+}
+
+void ModBusTermiosPort::write(const QByteArray &frame)
+{
+    if (!isOpen())
+        return;
+
+    m_txMutex.lock();
+    m_txQueue.append(frame);
+    m_txMutex.unlock();
+
+    quint64 wake = 1;
+    if (::write(m_eventFd, &wake, sizeof(wake)) < 0) {}
+}
+
+qint64 ModBusTermiosPort::monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (qint64)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool ModBusTermiosPort::configure(qint32 baudrate, QSerialPort::DataBits dataBits, QSerialPort::Parity parity, QSerialPort::StopBits stopBits)
+{
+    speed_t speed;
+    switch (baudrate)
+    {
+    case 1200: speed = B1200; break;
+    case 2400: speed = B2400; break;
+    case 4800: speed = B4800; break;
+    case 9600: speed = B9600; break;
+    case 19200: speed = B19200; break;
+    case 38400: speed = B38400; break;
+    case 57600: speed = B57600; break;
+    case 115200: speed = B115200; break;
+    case 230400: speed = B230400; break;
+    case 460800: speed = B460800; break;
+    case 921600: speed = B921600; break;
+    default:
+        m_errorString = QString("Unsupported baudrate %1").arg(baudrate);
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(m_fd, &tio) < 0)
+    {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CMSPAR | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CLOCAL | CREAD;
+
+    switch (dataBits)
+    {
+    case QSerialPort::Data5: tio.c_cflag |= CS5; break;
+    case QSerialPort::Data6: tio.c_cflag |= CS6; break;
+    case QSerialPort::Data7: tio.c_cflag |= CS7; break;
+    default: tio.c_cflag |= CS8; break;
+    }
+
+    switch (parity)
+    {
+    case QSerialPort::EvenParity: tio.c_cflag |= PARENB; break;
+    case QSerialPort::OddParity: tio.c_cflag |= PARENB | PARODD; break;
+    case QSerialPort::SpaceParity: tio.c_cflag |= PARENB | CMSPAR; break;
+    case QSerialPort::MarkParity: tio.c_cflag |= PARENB | CMSPAR | PARODD; break;
+    default: break;
+    }
+
+    if (stopBits == QSerialPort::TwoStop)
+        tio.c_cflag |= CSTOPB;
+
+    // Reads never block; frame ends are timed with the timerfd
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(m_fd, TCSANOW, &tio) < 0)
+    {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    tcflush(m_fd, TCIOFLUSH);
+
+    // t3.5 is fixed to 1750 us above 19200 baud by the specification
+    int bitsPerCharacter = 1 + (int)dataBits + ((parity == QSerialPort::NoParity) ? 0 : 1) + ((stopBits == QSerialPort::TwoStop) ? 2 : 1);
+    if (m_interFrameGapConfigured > 0)
+        m_interFrameGap = m_interFrameGapConfigured;
+    else if (baudrate > 19200)
+        m_interFrameGap = 1750;
+    else
+        m_interFrameGap = (int)((35LL * bitsPerCharacter * 1000000LL + baudrate * 10LL - 1) / (baudrate * 10LL));
+
+    return true;
+}
+
+void ModBusTermiosPort::closeDescriptors()
+{
+    if (m_epollFd >= 0)
+        ::close(m_epollFd);
+    if (m_timerFd >= 0)
+        ::close(m_timerFd);
+    if (m_eventFd >= 0)
+        ::close(m_eventFd);
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_epollFd = -1;
+    m_timerFd = -1;
+    m_eventFd = -1;
+    m_fd = -1;
+}
+
+void ModBusTermiosPort::run()
+{
+    if (m_realtimePriority > 0)
+    {
+        struct sched_param parameter;
+        memset(&parameter, 0, sizeof(parameter));
+        parameter.sched_priority = m_realtimePriority;
+        int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameter);
+        if ((result != 0) && m_debug)
+        {
+            fprintf(stdout, "DEBUG ModBusTermiosPort::run: Real-time priority not set: %s.\n", strerror(result));
+            fflush(stdout);
+        }
+    }
+
+    QByteArray frame;
+    qint64 firstByteNs = 0;
+    char buffer[256];
+
+    struct itimerspec gap;
+    memset(&gap, 0, sizeof(gap));
+    gap.it_value.tv_sec = m_interFrameGap / 1000000;
+    gap.it_value.tv_nsec = (m_interFrameGap % 1000000) * 1000;
+
+    while (m_running)
+    {
+        struct epoll_event events[3];
+        int count = epoll_wait(m_epollFd, events, 3, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        bool timerExpired = false;
+        bool rxReady = false;
+        bool txReady = false;
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.fd == m_timerFd)
+                timerExpired = true;
+            else if (events[i].data.fd == m_fd)
+            {
+                rxReady = true;
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    lose();     // Device is gone
+            }
+            else if (events[i].data.fd == m_eventFd)
+                txReady = true;
+        }
+
+        // A gap that expired ends the frame before any byte of this round is added
+        if (timerExpired)
+        {
+            quint64 expirations;
+            if (read(m_timerFd, &expirations, sizeof(expirations)) < 0) {}
+            if (!frame.isEmpty())
+            {
+                emit signal_frameReceived(frame, firstByteNs);
+                frame.clear();
+            }
+        }
+
+        if (rxReady)
+        {
+            ssize_t received;
+            while ((received = read(m_fd, buffer, sizeof(buffer))) > 0)
+            {
+                if (frame.isEmpty())
+                    firstByteNs = monotonicNs();
+                frame.append(buffer, received);
+            }
+            timerfd_settime(m_timerFd, 0, &gap, NULL);
+        }
+
+        if (txReady)
+        {
+            quint64 value;
+            if (read(m_eventFd, &value, sizeof(value)) < 0) {}
+
+            m_txMutex.lock();
+            QList<QByteArray> queue = m_txQueue;
+            m_txQueue.clear();
+            m_txMutex.unlock();
+
+            foreach (const QByteArray &out, queue)
+                transmit(out);
+        }
+    }
+
+    if (!frame.isEmpty())
+        emit signal_frameReceived(frame, firstByteNs);
+    if (m_deviceLost)
+        emit signal_deviceLost(QString("Device hang up"));
+}
+
+void ModBusTermiosPort::lose()
+{
+    // The descriptors stay valid until close() on the owning thread; the port reports closed from now on
+    m_deviceLost = true;
+    m_running = false;
+}
+
+void ModBusTermiosPort::transmit(const QByteArray &frame)
+{
+    int written = 0;
+    while (written < frame.size())
+    {
+        ssize_t result = ::write(m_fd, frame.constData() + written, frame.size() - written);
+        if (result > 0)
+        {
+            written += result;
+            continue;
+        }
+        if ((result < 0) && (errno != EAGAIN) && (errno != EINTR))
+        {
+            if (m_debug)
+            {
+                fprintf(stdout, "DEBUG ModBusTermiosPort::transmit: %s.\n", strerror(errno));
+                fflush(stdout);
+            }
+            if ((errno == EIO) || (errno == ENXIO) || (errno == ENODEV))
+                lose();
+            return;
+        }
+        struct pollfd writable;
+        writable.fd = m_fd;
+        writable.events = POLLOUT;
+        poll(&writable, 1, 100);
+    }
+
+    // Returns when the last bit has left the UART, the response can only start after that
+    tcdrain(m_fd);
+}
@@ -0,0 +1,92 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#ifndef OPENFFUCONTROLMODBUSTERMIOSPORT_H
+#define OPENFFUCONTROLMODBUSTERMIOSPORT_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QtSerialPort/QSerialPort>
+#include <atomic>
+#include <thread>
+
+#include "modbus_global.h"
+
+// Linux serial transport that drives the tty directly, without QSerialPort and the event loop.
+//
+// A dedicated I/O thread waits with epoll on the tty, a timerfd and an eventfd. Every batch of
+// received bytes rearms the timerfd with the inter-frame gap (t3.5); when it expires the frame
+// is complete and handed over with signal_frameReceived. Frames to send are queued with write()
+// and written by the I/O thread, which waits until they have left the UART. The thread can run
+// with SCHED_FIFO priority, so frame boundaries are detected independently of the load of the
+// bus thread. Works on pseudo terminals as well, which is handy for tests.
+//
+// USB serial adapters deliver bytes in bursts; set a gap above their latency timer for them.
+class MODBUSSHARED_EXPORT ModBusTermiosPort : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ModBusTermiosPort(QObject *parent, QString interface, bool debug = false);
+    ~ModBusTermiosPort();
+
+    // Take effect with the next open()
+    void setRealtimePriority(int priority);     // SCHED_FIFO priority of the I/O thread, 0 keeps normal scheduling
+    void setInterFrameGap(int microseconds);    // 0 derives t3.5 from the line settings
+
+    bool open(qint32 baudrate, QSerialPort::DataBits dataBits, QSerialPort::Parity parity, QSerialPort::StopBits stopBits);
+    void close();
+    bool isOpen() const;
+    QString errorString() const;
+
+    // Thread safe; the frame is sent by the I/O thread
+    void write(const QByteArray &frame);
+
+    static qint64 monotonicNs();    // Same clock as QElapsedTimer on Linux
+
+private:
+    QString m_interface;
+    bool m_debug;
+    int m_realtimePriority;
+    int m_interFrameGapConfigured;
+    int m_interFrameGap;            // Microseconds, in use
+    QString m_errorString;
+
+    int m_fd;
+    int m_epollFd;
+    int m_timerFd;
+    int m_eventFd;
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_deviceLost;
+
+    QMutex m_txMutex;
+    QList<QByteArray> m_txQueue;
+
+    bool configure(qint32 baudrate, QSerialPort::DataBits dataBits, QSerialPort::Parity parity, QSerialPort::StopBits stopBits);
+    void closeDescriptors();
+    void run();
+    void transmit(const QByteArray &frame);
+    void lose();
+
+signals:
+    void signal_frameReceived(QByteArray frame, qint64 firstByteNs);  // Emitted on the I/O thread
+    void signal_deviceLost(QString errorString);                      // Emitted on the I/O thread, which has stopped; isOpen() is false from then on
+};
+
+#endif // OPENFFUCONTROLMODBUSTERMIOSPORT_H
@@ -14,10 +14,16 @@
 #*********************************************************************/
 
 QT       -= core
-QT       += serialport testlib
+QT       += serialport network
 
 CONFIG += c++11
 
+# Opt-in C++20 build that provides the coroutine interface in modbuscoroutine.h
+modbus_coroutines {
+    CONFIG -= c++11
+    CONFIG += c++2a
+}
+
 TARGET = openffucontrol-qtmodbus
 TEMPLATE = lib
 
@@ -29,13 +35,57 @@ DEFINES += OPENFFUCONTROL_QTMODBUS_LIBRARY
 
 SOURCES += \
     modbus.cpp \
+    modbusbatch.cpp \
+    modbuscapture.cpp \
+    modbuscore.cpp \
+    modbusfiletransfer.cpp \
+    modbusframing.cpp \
+    modbusfuture.cpp \
+    modbusgroupsetpoint.cpp \
+    modbushistory.cpp \
+    modbusidentification.cpp \
+    modbusregisterbank.cpp \
+    modbusregisterview.cpp \
+    modbusreplay.cpp \
+    modbusscanner.cpp \
+    modbustcpgateway.cpp \
     modbustelegram.cpp
 
 HEADERS += \
     modbus.h \
     modbus_global.h \
+    modbusbatch.h \
+    modbuscapture.h \
+    modbuscore.h \
+    modbusfiletransfer.h \
+    modbusframing.h \
+    modbusfuture.h \
+    modbusgroupsetpoint.h \
+    modbushistory.h \
+    modbusidentification.h \
+    modbusregisterbank.h \
+    modbusregistermap.h \
+    modbusregisterview.h \
+    modbusreplay.h \
+    modbusscanner.h \
+    modbustcpgateway.h \
     modbustelegram.h
 
+modbus_coroutines {
+    HEADERS += modbuscoroutine.h
+}
+
+unix {
+    SOURCES += modbusshmpublisher.cpp
+    HEADERS += modbusshmpublisher.h
+    linux: LIBS += -lrt
+}
+
+linux {
+    SOURCES += modbustermiosport.cpp
+    HEADERS += modbustermiosport.h
+}
+
 linux-g++: QMAKE_TARGET.arch = $$QMAKE_HOST.arch
 linux-g++-32: QMAKE_TARGET.arch = x86
 linux-g++-64: QMAKE_TARGET.arch = x86_64
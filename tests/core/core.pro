@@ -0,0 +1,41 @@
+#**********************************************************************
+#* openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+#* Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+#* This program is free software: you can redistribute it and/or modify
+#* it under the terms of the GNU General Public License as published by
+#* the Free Software Foundation, either version 3 of the License, or
+#* (at your option) any later version.
+#* This program is distributed in the hope that it will be useful,
+#* but WITHOUT ANY WARRANTY; without even the implied warranty of
+#* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#* GNU General Public License for more details.
+#* You should have received a copy of the GNU General Public License
+#* along with this program. If not, see <http://www.gnu.org/licenses/>.
+#*********************************************************************/
+
+# Fuzz test and benchmark of the Qt independent protocol core in modbuscore.h.
+# Build with qmake and run ./tst_core [iterations]; exits with 1 if a check fails.
+# With clang, CONFIG+=libfuzzer builds a libFuzzer target from the same checks instead.
+
+QT       -= core gui
+
+CONFIG += c++11 console
+CONFIG -= qt app_bundle
+
+TARGET = tst_core
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    tst_core.cpp \
+    ../../src/modbuscore.cpp
+
+HEADERS += \
+    ../../src/modbuscore.h
+
+libfuzzer {
+    DEFINES += MODBUSCORE_LIBFUZZER
+    QMAKE_CXXFLAGS += -fsanitize=fuzzer,address,undefined
+    QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
+}
@@ -0,0 +1,468 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbuscore.h"
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        if (failures < 20)
+            fprintf(stdout, "FAIL %s\n", what);
+        failures++;
+    }
+}
+
+// Checks that hold for any input: lengths are stable once known, decoders stay within their buffers
+static void checkFrame(const uint8_t* data, size_t size)
+{
+    int request = ModBusCore::requestLength(data, size);
+    int response = ModBusCore::responseLength(data, size);
+    check(request >= -1, "requestLength range");
+    check(response >= -1, "responseLength range");
+    check((request <= 0) || (request >= 4), "requestLength minimum");
+    check((response <= 0) || (response >= 4), "responseLength minimum");
+
+    // A length that is known from a prefix does not change when more bytes arrive
+    for (size_t prefix = 0; prefix < size; prefix++)
+    {
+        int partial = ModBusCore::responseLength(data, prefix);
+        if (partial > 0)
+            check(partial == response, "responseLength stable");
+        partial = ModBusCore::requestLength(data, prefix);
+        if (partial > 0)
+            check(partial == request, "requestLength stable");
+    }
+
+    uint16_t words[MODBUSCORE_MAX_ADU_SIZE / 2];
+    int count = ModBusCore::decodeRegisters(data, size, words, sizeof(words) / sizeof(words[0]));
+    check((count == -1) || ((size_t)count * 2 + 5 == size), "decodeRegisters size");
+
+    uint8_t bits[MODBUSCORE_MAX_ADU_SIZE];
+    int bytes = ModBusCore::decodeBits(data, size, bits, sizeof(bits));
+    check((bytes == -1) || ((size_t)bytes + 5 == size), "decodeBits size");
+
+    if (size < 3)
+        return;     // The remaining decoders get complete frames from the master only
+    uint16_t status, eventCount, messageCount;
+    int events = ModBusCore::decodeCommEventLog(data, size, &status, &eventCount, &messageCount, bits, sizeof(bits));
+    check((events == -1) || ((size_t)events + 11 == size), "decodeCommEventLog size");
+    const uint8_t* slaveId = NULL;
+    int length = ModBusCore::decodeSlaveId(data, size, &slaveId);
+    check((length == -1) || ((slaveId == data + 3) && ((size_t)length + 5 == size)), "decodeSlaveId size");
+    count = ModBusCore::decodeFileRecordRead(data, size, words, sizeof(words) / sizeof(words[0]));
+    check((count == -1) || ((size_t)count * 2 + 8 == size), "decodeFileRecordRead size");
+    count = ModBusCore::decodeFIFOQueue(data, size, words, sizeof(words) / sizeof(words[0]));
+    check((count == -1) || ((size_t)count * 2 + 8 == size), "decodeFIFOQueue size");
+
+    ModBusCore::DeviceIdentification identification;
+    ModBusCore::DeviceIdentificationObject objects[MODBUSCORE_MAX_ADU_SIZE / 2];
+    count = ModBusCore::decodeDeviceIdentification(data, size, &identification, objects, sizeof(objects) / sizeof(objects[0]));
+    for (int i = 0; i < count; i++)
+        check((objects[i].value >= data + 10) && (objects[i].value + objects[i].length <= data + size - 2), "decodeDeviceIdentification bounds");
+}
+
+#ifdef MODBUSCORE_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    checkFrame(data, size);
+    if (failures > 0)
+        abort();
+    return 0;
+}
+
+#else
+
+static uint32_t randomState = 0x12345678;
+
+static uint32_t random32()
+{
+    // xorshift32, the same sequence on every run
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// Encoded requests are framed and decoded back to what was encoded
+static void checkRoundTrip()
+{
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    uint16_t values[123];
+    uint16_t count = 1 + random32() % 123;
+    for (int i = 0; i < count; i++)
+        values[i] = random32();
+
+    size_t size = ModBusCore::encodeWriteMultipleRegisters(adu, sizeof(adu), 1 + random32() % 247, random32(), values, count);
+    check((size > 0) && ModBusCore::crcOK(adu, size), "write registers encoded");
+    check(ModBusCore::requestLength(adu, size) == (int)size, "write registers framed");
+
+    // The response of fc 0x03 carries the same words
+    uint8_t response[MODBUSCORE_MAX_ADU_SIZE];
+    response[0] = adu[0];
+    response[1] = 0x03;
+    response[2] = count * 2;
+    memcpy(response + 3, adu + 7, count * 2);
+    uint16_t crc = ModBusCore::crc16(response, 3 + count * 2);
+    response[3 + count * 2] = crc & 0xff;
+    response[4 + count * 2] = crc >> 8;
+    check(ModBusCore::responseLength(response, 5 + count * 2) == 5 + count * 2, "read registers framed");
+
+    uint16_t decoded[125];
+    check(ModBusCore::decodeRegisters(response, 5 + count * 2, decoded, 125) == count, "read registers decoded");
+    check(memcmp(decoded, values, count * 2) == 0, "read registers values");
+
+    size = ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x03, random32(), 1 + random32() % 125);
+    check((size == 8) && (ModBusCore::requestLength(adu, size) == 8) && ModBusCore::crcOK(adu, size), "read request");
+    check(ModBusCore::encodeWriteMultipleRegisters(adu, sizeof(adu), 1, 0, values, 124) == 0, "too many registers refused");
+
+    uint16_t writeCount = 1 + random32() % 121;
+    size = ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), 1, random32(), 1 + random32() % 125, random32(), values, writeCount);
+    check((size == 13 + (size_t)writeCount * 2) && ModBusCore::crcOK(adu, size), "read/write registers encoded");
+    check(ModBusCore::requestLength(adu, size) == (int)size, "read/write registers framed");
+    check(ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), 1, 0, 126, 0, values, 1) == 0, "too many registers to read refused");
+    check(ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), 1, 0, 1, 0, values, 122) == 0, "too many registers to write refused");
+    check(ModBusCore::encodeReadWriteMultipleRegisters(adu, sizeof(adu), 1, 0, 1, 0, values, 0) == 0, "nothing to write refused");
+
+    size = ModBusCore::encodeWriteFileRecord(adu, sizeof(adu), 1, 1, random32(), values, 122);
+    check((size == 256) && ModBusCore::crcOK(adu, size) && (ModBusCore::requestLength(adu, size) == 256), "largest file record write");
+    check(ModBusCore::encodeWriteFileRecord(adu, sizeof(adu), 1, 1, 0, values, 123) == 0, "too many file registers to write refused");
+    size = ModBusCore::encodeReadFileRecord(adu, sizeof(adu), 1, 1, random32(), 121);
+    check((size == 12) && (ModBusCore::requestLength(adu, size) == 12), "file record read");
+    check(ModBusCore::encodeReadFileRecord(adu, sizeof(adu), 1, 1, 0, 122) == 0, "too many file registers to read refused");
+}
+
+static size_t finishResponse(uint8_t* adu, size_t length)
+{
+    uint16_t crc = ModBusCore::crc16(adu, length);
+    adu[length] = crc & 0xff;
+    adu[length + 1] = crc >> 8;
+    return length + 2;
+}
+
+// Range checks and the codes without a dedicated round trip above
+static void checkEncodersAndDecoders()
+{
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+    check(ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x03, 0, 0) == 0, "read of no register refused");
+    check(ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x04, 0, 126) == 0, "read of 126 registers refused");
+    check(ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x03, 0, 125) == 8, "read of 125 registers");
+    check(ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x01, 0, 2000) == 8, "read of 2000 coils");
+    check(ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x02, 0, 2001) == 0, "read of 2001 inputs refused");
+    check(ModBusCore::encodeWriteSingle(adu, sizeof(adu), 1, 0x05, 7, 0xff00) == 8, "write single coil");
+    check(ModBusCore::encodeWriteSingle(adu, sizeof(adu), 1, 0x06, 7, 0) == 8, "write single register of 0");
+
+    uint8_t data[2] = { 0x12, 0x34 };
+    size_t size = ModBusCore::encodeDiagnostics(adu, sizeof(adu), 1, 0x0000, data, 2);
+    check((size == 8) && (adu[1] == 0x08) && (adu[4] == 0x12) && (ModBusCore::requestLength(adu, size) == 8), "diagnostics");
+    size = ModBusCore::encodeMaskWriteRegister(adu, sizeof(adu), 1, 0x0004, 0x00f2, 0x0025);
+    check((size == 10) && (adu[7] == 0x25) && (ModBusCore::requestLength(adu, size) == 10) && ModBusCore::crcOK(adu, size), "mask write register");
+    size = ModBusCore::encodeReadFIFOQueue(adu, sizeof(adu), 1, 0x04de);
+    check((size == 6) && (adu[2] == 0x04) && (ModBusCore::requestLength(adu, size) == 6), "read FIFO queue");
+    size = ModBusCore::encodeReadDeviceIdentification(adu, sizeof(adu), 1, 0x01, 0x00);
+    check((size == 7) && (adu[2] == 0x0e) && (ModBusCore::requestLength(adu, size) == 7), "read device identification");
+    check(ModBusCore::encodeReadDeviceIdentification(adu, sizeof(adu), 1, 0x05, 0x00) == 0, "unknown read device id code refused");
+    size = ModBusCore::encodeEncapsulatedInterfaceTransport(adu, sizeof(adu), 1, 0x0d, data, 2);
+    check((size == 7) && (adu[2] == 0x0d) && (adu[3] == 0x12), "encapsulated interface transport");
+    size = ModBusCore::encodeRequest(adu, sizeof(adu), 1, 0x11, NULL, 0);
+    check((size == 4) && (ModBusCore::requestLength(adu, size) == 4), "report slave id");
+
+    uint8_t exceptionCode = 0;
+    uint8_t response[MODBUSCORE_MAX_ADU_SIZE] = { 0x01, 0x83, 0x02 };
+    size = finishResponse(response, 3);
+    check(ModBusCore::isException(response, size, &exceptionCode) && (exceptionCode == 0x02), "exception");
+
+    uint8_t status = 0;
+    response[1] = 0x07; response[2] = 0x6d;
+    size = finishResponse(response, 3);
+    check((ModBusCore::decodeExceptionStatus(response, size, &status) == 0) && (status == 0x6d), "exception status");
+
+    uint16_t word1 = 0, word2 = 0, word3 = 0;
+    const uint8_t diagnostics[] = { 0x01, 0x08, 0x00, 0x0b, 0x12, 0x34 };
+    memcpy(response, diagnostics, sizeof(diagnostics));
+    size = finishResponse(response, sizeof(diagnostics));
+    check((ModBusCore::decodeDiagnostics(response, size, &word1, &word2) == 0) && (word1 == 0x0b) && (word2 == 0x1234), "diagnostics response");
+    response[1] = 0x0b;
+    size = finishResponse(response, sizeof(diagnostics));
+    check((ModBusCore::decodeCommEventCounter(response, size, &word1, &word2) == 0) && (word1 == 0x000b) && (word2 == 0x1234), "comm event counter");
+
+    const uint8_t log[] = { 0x01, 0x0c, 0x08, 0x00, 0x00, 0x01, 0x08, 0x01, 0x21, 0x20, 0x00 };
+    memcpy(response, log, sizeof(log));
+    size = finishResponse(response, sizeof(log));
+    uint8_t events[8];
+    check((ModBusCore::decodeCommEventLog(response, size, &word1, &word2, &word3, events, sizeof(events)) == 2) && (word2 == 0x0108) && (word3 == 0x0121) && (events[0] == 0x20), "comm event log");
+    check(ModBusCore::decodeCommEventLog(response, size, &word1, &word2, &word3, events, 1) == -1, "comm event log capacity");
+
+    const uint8_t* slaveId = NULL;
+    const uint8_t id[] = { 0x01, 0x11, 0x03, 0x42, 0x43, 0xff };
+    memcpy(response, id, sizeof(id));
+    size = finishResponse(response, sizeof(id));
+    check((ModBusCore::decodeSlaveId(response, size, &slaveId) == 3) && (slaveId == response + 3), "slave id");
+
+    uint16_t words[4];
+    const uint8_t file[] = { 0x01, 0x14, 0x06, 0x05, 0x06, 0x0d, 0xfe, 0x00, 0x20 };
+    memcpy(response, file, sizeof(file));
+    size = finishResponse(response, sizeof(file));
+    check((ModBusCore::decodeFileRecordRead(response, size, words, 4) == 2) && (words[0] == 0x0dfe) && (words[1] == 0x0020), "file record read");
+
+    uint16_t values[2] = { 0x06af, 0x04be };
+    size = ModBusCore::encodeWriteFileRecord(adu, sizeof(adu), 1, 4, 7, values, 2);
+    check(ModBusCore::decodeFileRecordWritten(adu, size, adu, size) == 2, "file record written");
+    memcpy(response, adu, size);
+    response[11] ^= 1;
+    check(ModBusCore::decodeFileRecordWritten(response, size, adu, size) == -1, "file record written differs");
+
+    const uint8_t fifo[] = { 0x01, 0x18, 0x00, 0x06, 0x00, 0x02, 0x01, 0xb8, 0x12, 0x84 };
+    memcpy(response, fifo, sizeof(fifo));
+    size = finishResponse(response, sizeof(fifo));
+    check((ModBusCore::decodeFIFOQueue(response, size, words, 4) == 2) && (words[1] == 0x1284), "FIFO queue");
+
+    const uint8_t identification[] = { 0x01, 0x2b, 0x0e, 0x01, 0x01, 0x00, 0x00, 0x02, 0x00, 0x03, 'A', 'B', 'C', 0x01, 0x01, 'X' };
+    memcpy(response, identification, sizeof(identification));
+    size = finishResponse(response, sizeof(identification));
+    ModBusCore::DeviceIdentification header;
+    ModBusCore::DeviceIdentificationObject objects[4];
+    check((ModBusCore::decodeDeviceIdentification(response, size, &header, objects, 4) == 2) && (header.conformityLevel == 0x01) && !header.moreFollows
+          && (objects[0].length == 3) && (objects[0].value == response + 10) && (objects[1].id == 0x01), "device identification");
+    check(ModBusCore::decodeDeviceIdentification(response, size - 1, &header, objects, 4) == -1, "truncated device identification");
+    check(ModBusCore::decodeDeviceIdentification(response, size, &header, objects, 1) == -1, "device identification capacity");
+}
+
+// Line of the master under test; a fake clock, what was written and what the slave sends back
+typedef struct {
+    uint64_t now;
+    int writes;
+    bool writeFails;
+    uint8_t tx[MODBUSCORE_MAX_ADU_SIZE];
+    size_t txSize;
+    uint8_t rx[2 * MODBUSCORE_MAX_ADU_SIZE];
+    size_t rxSize;
+    int frames;
+} FakeLine;
+
+static int fakeWrite(void* context, const uint8_t* data, size_t length)
+{
+    FakeLine* line = (FakeLine*)context;
+    if (line->writeFails)
+        return -1;
+    memcpy(line->tx, data, length);
+    line->txSize = length;
+    line->writes++;
+    return length;
+}
+
+static int fakeRead(void* context, uint8_t* data, size_t capacity)
+{
+    FakeLine* line = (FakeLine*)context;
+    size_t size = (line->rxSize < capacity) ? line->rxSize : capacity;
+    memcpy(data, line->rx, size);
+    memmove(line->rx, line->rx + size, line->rxSize - size);
+    line->rxSize -= size;
+    return size;
+}
+
+static uint64_t fakeNowUs(void* context)
+{
+    return ((FakeLine*)context)->now;
+}
+
+static void fakeFrameReceived(void* context, const uint8_t* adu, size_t size)
+{
+    (void)adu;
+    (void)size;
+    ((FakeLine*)context)->frames++;
+}
+
+static void receive(FakeLine* line, const uint8_t* data, size_t size)
+{
+    memcpy(line->rx + line->rxSize, data, size);
+    line->rxSize += size;
+}
+
+static void checkMaster()
+{
+    FakeLine line;
+    memset(&line, 0, sizeof(line));
+    line.now = 1000;
+    ModBusCoreMaster::Io io = { &line, fakeWrite, fakeRead, fakeNowUs, NULL, fakeFrameReceived };
+    ModBusCoreMaster master(io);
+    master.setInterFrameTimeout(2000);
+    master.setBroadcastTurnaroundDelay(50000);
+
+    uint8_t request[MODBUSCORE_MAX_ADU_SIZE];
+    size_t requestSize = ModBusCore::encodeReadRequest(request, sizeof(request), 7, 0x03, 0, 2);
+    uint8_t response[MODBUSCORE_MAX_ADU_SIZE] = { 7, 0x03, 4, 0x12, 0x34, 0x56, 0x78 };
+    size_t responseSize = finishResponse(response, 7);
+
+    // Response in two parts; complete by its length without waiting for the line to go quiet
+    receive(&line, response, 3);    // Left over from an earlier transaction, discarded by start()
+    check(master.start(request, requestSize, 100000, 2) && (line.writes == 1) && (line.txSize == requestSize), "master start");
+    check(master.nextPollUs() == 101000, "master next poll at timeout");
+    line.now += 5000;
+    receive(&line, response, 3);
+    check(master.poll() == ModBusCoreMaster::STATE_WAITING, "master waits for the rest");
+    check(master.nextPollUs() == 8000, "master next poll at inter-frame timeout");
+    line.now += 1000;
+    receive(&line, response + 3, responseSize - 3);
+    check(master.poll() == ModBusCoreMaster::STATE_FINISHED, "master response");
+    check((master.responseSize() == responseSize) && (memcmp(master.response(), response, responseSize) == 0), "master response bytes");
+    check((master.responseTimeUs() == 5000) && (line.frames == 1), "master response time");
+
+    // A frame with CRC error and one of another slave are dropped, the request waits on
+    uint8_t corrupted[MODBUSCORE_MAX_ADU_SIZE];
+    memcpy(corrupted, response, responseSize);
+    corrupted[4] ^= 0x01;
+    check(master.start(request, requestSize, 100000, 1), "master second start");
+    receive(&line, corrupted, responseSize);
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (master.crcErrors() == 1), "master drops CRC error");
+    corrupted[0] = 8;
+    corrupted[4] ^= 0x01;
+    finishResponse(corrupted, responseSize - 2);
+    receive(&line, corrupted, responseSize);
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (master.crcErrors() == 1), "master drops other slave");
+    receive(&line, response, responseSize);
+    check(master.poll() == ModBusCoreMaster::STATE_FINISHED, "master response after dropped frames");
+
+    // A truncated frame is dropped when the line goes quiet
+    check(master.start(request, requestSize, 100000, 1), "master third start");
+    receive(&line, response, 4);
+    check(master.poll() == ModBusCoreMaster::STATE_WAITING, "master truncated frame pending");
+    line.now += 2000;
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (master.crcErrors() == 2), "master drops truncated frame");
+    master.abort();
+
+    // Exception
+    uint8_t exception[5] = { 7, 0x83, 0x02 };
+    finishResponse(exception, 3);
+    check(master.start(request, requestSize, 100000, 1), "master exception start");
+    receive(&line, exception, sizeof(exception));
+    check((master.poll() == ModBusCoreMaster::STATE_EXCEPTION) && (master.exceptionCode() == 0x02), "master exception");
+
+    // Timeout, repeat and loss
+    line.writes = 0;
+    check(master.start(request, requestSize, 100000, 2), "master repeat start");
+    line.now += 99999;
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (line.writes == 1), "master before timeout");
+    line.now += 1;
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (line.writes == 2), "master repeats");
+    line.now += 100000;
+    check((master.poll() == ModBusCoreMaster::STATE_LOST) && (line.writes == 2), "master lost");
+
+    // A broadcast only waits for the turnaround delay; it is repeated as well
+    uint8_t broadcast[MODBUSCORE_MAX_ADU_SIZE];
+    size_t broadcastSize = ModBusCore::encodeWriteSingle(broadcast, sizeof(broadcast), 0, 0x06, 1, 2);
+    line.writes = 0;
+    check(master.start(broadcast, broadcastSize, 100000, 2), "master broadcast start");
+    check(master.nextPollUs() == line.now + 50000, "master broadcast next poll");
+    line.now += 50000;
+    check((master.poll() == ModBusCoreMaster::STATE_WAITING) && (line.writes == 2), "master broadcast repeated");
+    line.now += 50000;
+    check(master.poll() == ModBusCoreMaster::STATE_FINISHED, "master broadcast finished");
+
+    // Unknown response length; the frame ends when the line goes quiet
+    uint8_t custom[MODBUSCORE_MAX_ADU_SIZE] = { 7, 0x41, 0x01, 0x02, 0x03 };
+    size_t customSize = finishResponse(custom, 5);
+    check(master.start(custom, customSize, 100000, 1), "master custom start");
+    receive(&line, custom, customSize);
+    check(master.poll() == ModBusCoreMaster::STATE_WAITING, "master custom pending");
+    line.now += 2000;
+    check((master.poll() == ModBusCoreMaster::STATE_FINISHED) && (master.responseSize() == customSize), "master custom response");
+
+    // Failed write and invalid requests
+    line.writeFails = true;
+    check(!master.start(request, requestSize, 100000, 1) && (master.state() == ModBusCoreMaster::STATE_IO_ERROR), "master write failure");
+    line.writeFails = false;
+    check(!master.start(request, 3, 100000, 1) && (master.state() == ModBusCoreMaster::STATE_IDLE), "master short request refused");
+    check(master.start(request, requestSize, 100000, 1) && !master.start(request, requestSize, 100000, 1), "master busy");
+    master.abort();
+    check(master.state() == ModBusCoreMaster::STATE_IDLE, "master abort");
+}
+
+template <typename Function>
+static void bench(const char* name, int iterations, Function function)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t sink = 0;
+    for (int i = 0; i < iterations; i++)
+        sink += function();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stdout, "%-28s %8.1f ns per call (%u)\n", name, ns / iterations, sink & 1);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200000;
+
+    // Fuzz with random frames; a quarter of them get a small function code so that the framers are reached
+    uint8_t frame[MODBUSCORE_MAX_ADU_SIZE];
+    for (int i = 0; i < iterations; i++)
+    {
+        size_t size = random32() % (sizeof(frame) + 1);
+        for (size_t j = 0; j < size; j++)
+            frame[j] = random32();
+        if ((size > 1) && (random32() % 4 == 0))
+            frame[1] = random32() % 0x30;
+        if ((size > 2) && (random32() % 8 == 0))
+            frame[2] = size - 5;    // Byte count that matches the size
+        checkFrame(frame, size);
+    }
+
+    for (int i = 0; i < iterations / 100; i++)
+        checkRoundTrip();
+    checkEncodersAndDecoders();
+    checkMaster();
+
+    uint8_t response[MODBUSCORE_MAX_ADU_SIZE] = { 0x01, 0x03, 0xf6 };
+    size_t responseSize = 3 + 0xf6;
+    uint16_t crc = ModBusCore::crc16(response, responseSize);
+    response[responseSize++] = crc & 0xff;
+    response[responseSize++] = crc >> 8;
+    uint16_t words[125];
+    uint8_t adu[MODBUSCORE_MAX_ADU_SIZE];
+
+    bench("crc16, 256 bytes", iterations, [&]() { return (uint32_t)ModBusCore::crc16(response, sizeof(response)); });
+    bench("responseLength", iterations, [&]() { return (uint32_t)ModBusCore::responseLength(response, responseSize); });
+    bench("crcOK + decodeRegisters(123)", iterations, [&]() {
+        return (uint32_t)(ModBusCore::crcOK(response, responseSize) + ModBusCore::decodeRegisters(response, responseSize, words, 125));
+    });
+    bench("encodeReadRequest", iterations, [&]() { return (uint32_t)ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x03, 0xd000, 10); });
+
+    // One transaction of the master, 123 registers answered in one read
+    FakeLine line;
+    memset(&line, 0, sizeof(line));
+    ModBusCoreMaster::Io io = { &line, fakeWrite, fakeRead, fakeNowUs, NULL, NULL };
+    ModBusCoreMaster master(io);
+    size_t requestSize = ModBusCore::encodeReadRequest(adu, sizeof(adu), 1, 0x03, 0xd000, 123);
+    bench("master transaction(123)", iterations, [&]() {
+        master.start(adu, requestSize, 100000, 1);
+        receive(&line, response, responseSize);
+        return (uint32_t)master.poll();
+    });
+
+    fprintf(stdout, "%s\n", (failures == 0) ? "PASS" : "FAIL");
+    return (failures == 0) ? 0 : 1;
+}
+
+#endif
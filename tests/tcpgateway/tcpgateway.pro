@@ -0,0 +1,34 @@
+#**********************************************************************
+#* openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+#* Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+#* This program is free software: you can redistribute it and/or modify
+#* it under the terms of the GNU General Public License as published by
+#* the Free Software Foundation, either version 3 of the License, or
+#* (at your option) any later version.
+#* This program is distributed in the hope that it will be useful,
+#* but WITHOUT ANY WARRANTY; without even the implied warranty of
+#* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#* GNU General Public License for more details.
+#* You should have received a copy of the GNU General Public License
+#* along with this program. If not, see <http://www.gnu.org/licenses/>.
+#*********************************************************************/
+
+# Localhost test of ModBusTcpGateway: Modbus TCP clients on 127.0.0.1, a bus on a pseudo terminal
+# pair and a simulated slave on the master side. Covers routing by transaction id, read merging
+# and the per-client queue limit. Linux only; links the library built in ../../src, so run it with
+# LD_LIBRARY_PATH=../../src ./tst_tcpgateway. Exits with 1 if a check fails.
+
+QT       -= gui
+QT       += network serialport
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = tst_tcpgateway
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+LIBS += -L../../src -lopenffucontrol-qtmodbus
+
+SOURCES += \
+    tst_tcpgateway.cpp
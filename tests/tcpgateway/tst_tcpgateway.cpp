@@ -0,0 +1,249 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QSocketNotifier>
+#include <QTcpSocket>
+#include <QTimer>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "modbus.h"
+#include "modbuscore.h"
+#include "modbustcpgateway.h"
+
+#define SLAVE_ADDRESS       7
+#define SLAVE_DELAY_MS      50      // Long enough for requests of several clients to meet in the queue of the bus
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        fprintf(stdout, "FAIL %s\n", what);
+        fflush(stdout);
+        failures++;
+    }
+}
+
+static bool waitFor(std::function<bool()> condition, int milliseconds)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!condition())
+    {
+        if (timer.elapsed() > milliseconds)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    return true;
+}
+
+// Simulated slave on the master side of the pseudo terminal. Holding register n has the value n,
+// so every response tells which request it belongs to. Other function codes are not answered.
+class Slave
+{
+public:
+    int master;
+    QByteArray buffer;
+    int requests;
+
+    Slave(int fd) : master(fd), requests(0) {}
+
+    void readyRead()
+    {
+        char data[256];
+        ssize_t received = read(master, data, sizeof(data));
+        if (received > 0)
+            buffer.append(data, received);
+
+        int length = ModBusCore::requestLength((const uint8_t*)buffer.constData(), buffer.size());
+        if ((length <= 0) || (buffer.size() < length))
+            return;
+
+        QByteArray request = buffer.left(length);
+        buffer.remove(0, length);
+        if (!ModBusCore::crcOK((const uint8_t*)request.constData(), length) || (request.at(0) != SLAVE_ADDRESS) || (request.at(1) != 0x03))
+            return;
+        requests++;
+
+        quint16 address = ((quint8)request.at(2) << 8) | (quint8)request.at(3);
+        quint16 count = ((quint8)request.at(4) << 8) | (quint8)request.at(5);
+        uint8_t response[MODBUSCORE_MAX_ADU_SIZE];
+        response[0] = SLAVE_ADDRESS;
+        response[1] = 0x03;
+        response[2] = count * 2;
+        for (int i = 0; i < count; i++)
+        {
+            response[3 + i * 2] = (address + i) >> 8;
+            response[4 + i * 2] = (address + i) & 0xff;
+        }
+        uint16_t crc = ModBusCore::crc16(response, 3 + count * 2);
+        response[3 + count * 2] = crc & 0xff;
+        response[4 + count * 2] = crc >> 8;
+        QByteArray frame((const char*)response, 5 + count * 2);
+
+        int fd = master;
+        QTimer::singleShot(SLAVE_DELAY_MS, [fd, frame]() {
+            if (write(fd, frame.constData(), frame.size()) != frame.size())
+                check(false, "slave write");
+        });
+    }
+};
+
+// Modbus TCP client; responses are collected by transaction id
+class Client
+{
+public:
+    QTcpSocket socket;
+    QByteArray buffer;
+    QMap<quint16, QByteArray> responses;   // PDU by transaction id
+
+    bool connectTo(quint16 port)
+    {
+        socket.connectToHost(QHostAddress(QHostAddress::LocalHost), port);
+        QObject::connect(&socket, &QTcpSocket::readyRead, [this]() { parse(); });
+        return socket.waitForConnected(1000);
+    }
+
+    static QByteArray readRequest(quint16 transactionID, quint16 address, quint16 count)
+    {
+        QByteArray adu;
+        adu.append(transactionID >> 8);
+        adu.append(transactionID & 0xff);
+        adu.append((char)0x00);
+        adu.append((char)0x00);
+        adu.append((char)0x00);
+        adu.append(6);
+        adu.append(SLAVE_ADDRESS);
+        adu.append(0x03);
+        adu.append(address >> 8);
+        adu.append(address & 0xff);
+        adu.append(count >> 8);
+        adu.append(count & 0xff);
+        return adu;
+    }
+
+    void send(const QByteArray &adus)
+    {
+        socket.write(adus);
+        socket.flush();
+    }
+
+    void parse()
+    {
+        buffer.append(socket.readAll());
+        while (buffer.size() >= 7)
+        {
+            int length = ((quint8)buffer.at(4) << 8) | (quint8)buffer.at(5);
+            if (buffer.size() < 6 + length)
+                return;
+            quint16 transactionID = ((quint8)buffer.at(0) << 8) | (quint8)buffer.at(1);
+            check(buffer.at(6) == SLAVE_ADDRESS, "unit id of response");
+            responses.insert(transactionID, buffer.mid(7, length - 1));
+            buffer.remove(0, 6 + length);
+        }
+    }
+
+    // The response carries registers address .. address + count - 1
+    bool hasRegisters(quint16 transactionID, quint16 address, quint16 count) const
+    {
+        QByteArray pdu = responses.value(transactionID);
+        if ((pdu.size() != 2 + count * 2) || (pdu.at(0) != 0x03) || ((quint8)pdu.at(1) != count * 2))
+            return false;
+        for (int i = 0; i < count; i++)
+        {
+            if (((((quint8)pdu.at(2 + i * 2)) << 8) | (quint8)pdu.at(3 + i * 2)) != address + i)
+                return false;
+        }
+        return true;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        fprintf(stdout, "FAIL No pseudo terminal: %s\n", strerror(errno));
+        return 1;
+    }
+
+    Slave slave(master);
+    QSocketNotifier notifier(master, QSocketNotifier::Read);
+    QObject::connect(&notifier, &QSocketNotifier::activated, [&slave]() { slave.readyRead(); });
+
+    ModBus bus(NULL, QString(ptsname(master)));
+    bus.setTermiosBackend(true, 0, 1750);
+    bus.setEchoMode(ModBus::ECHO_OFF);
+    bus.setRequestTimeout(1000);
+    check(bus.open(19200, QSerialPort::Data8, QSerialPort::EvenParity, QSerialPort::OneStop), "bus open");
+
+    ModBusTcpGateway gateway(NULL, &bus);
+    check(gateway.listen(QHostAddress(QHostAddress::LocalHost), 0), "listen");
+
+    Client a, b, c;
+    check(a.connectTo(gateway.serverPort()) && b.connectTo(gateway.serverPort()) && c.connectTo(gateway.serverPort()), "clients connected");
+    check(waitFor([&gateway]() { return gateway.clientCount() == 3; }, 1000), "clients accepted");
+
+    // Routing: two requests of one client in flight at once, each response carries its own transaction id
+    a.send(Client::readRequest(0x1111, 10, 2) + Client::readRequest(0x2222, 20, 3));
+    check(waitFor([&a]() { return a.responses.size() == 2; }, 2000), "routing: both responses");
+    check(a.hasRegisters(0x1111, 10, 2), "routing: response of 0x1111");
+    check(a.hasRegisters(0x2222, 20, 3), "routing: response of 0x2222");
+
+    // Merging: the same read of two clients goes to the bus once, both get the response
+    int requestsBefore = slave.requests;
+    quint64 mergedBefore = gateway.mergedReads();
+    b.send(Client::readRequest(0x0001, 100, 4));
+    c.send(Client::readRequest(0x0002, 100, 4));
+    check(waitFor([&b, &c]() { return (b.responses.size() == 1) && (c.responses.size() == 1); }, 2000), "merging: both responses");
+    check(b.hasRegisters(0x0001, 100, 4) && c.hasRegisters(0x0002, 100, 4), "merging: response content");
+    check(gateway.mergedReads() == mergedBefore + 1, "merging: counted");
+    check(slave.requests == requestsBefore + 1, "merging: one request on the bus");
+
+    // Queue limit: while the bus is busy, a client may have two requests waiting; more are rejected as busy
+    a.responses.clear();
+    b.responses.clear();
+    gateway.setMaxTelegramsInQueue(1);
+    gateway.setMaxRequestsPerClient(2);
+    gateway.setMaxRequestsInFlightPerClient(1);
+    a.send(Client::readRequest(0x0100, 200, 1));
+    check(waitFor([&slave, requestsBefore]() { return slave.requests == requestsBefore + 2; }, 1000), "queue limit: bus busy");
+    b.send(Client::readRequest(1, 301, 1) + Client::readRequest(2, 302, 1) + Client::readRequest(3, 303, 1) + Client::readRequest(4, 304, 1));
+    check(waitFor([&b]() { return b.responses.size() == 4; }, 3000), "queue limit: all answered");
+    check(b.hasRegisters(1, 301, 1) && b.hasRegisters(2, 302, 1), "queue limit: accepted requests");
+    check(b.responses.value(3) == QByteArray("\x83\x06", 2), "queue limit: third request busy");
+    check(b.responses.value(4) == QByteArray("\x83\x06", 2), "queue limit: fourth request busy");
+    check(a.hasRegisters(0x0100, 200, 1), "queue limit: other client served");
+
+    gateway.close();
+    bus.close();
+    close(master);
+
+    fprintf(stdout, "%s\n", (failures == 0) ? "PASS" : "FAIL");
+    return (failures == 0) ? 0 : 1;
+}
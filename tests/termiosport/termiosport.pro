@@ -0,0 +1,36 @@
+#**********************************************************************
+#* openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+#* Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+#* This program is free software: you can redistribute it and/or modify
+#* it under the terms of the GNU General Public License as published by
+#* the Free Software Foundation, either version 3 of the License, or
+#* (at your option) any later version.
+#* This program is distributed in the hope that it will be useful,
+#* but WITHOUT ANY WARRANTY; without even the implied warranty of
+#* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#* GNU General Public License for more details.
+#* You should have received a copy of the GNU General Public License
+#* along with this program. If not, see <http://www.gnu.org/licenses/>.
+#*********************************************************************/
+
+# Loopback test and turnaround benchmark of ModBusTermiosPort over a pseudo terminal pair.
+# Build with qmake and run ./tst_termiosport; exits with 1 if a check fails.
+
+QT       -= gui
+QT       += serialport
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = tst_termiosport
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+DEFINES += OPENFFUCONTROL_QTMODBUS_LIBRARY    # Sources are built into the test
+
+SOURCES += \
+    tst_termiosport.cpp \
+    ../../src/modbustermiosport.cpp
+
+HEADERS += \
+    ../../src/modbustermiosport.h
@@ -0,0 +1,178 @@
+/**********************************************************************
+** openFFUcontrol-qtmodbus - a library for openFFUcontrol communication
+** Copyright (C) 2023 Smart Micro Engineering GmbH, Peter Diener
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+** You should have received a copy of the GNU General Public License
+** along with this program. If not, see <http://www.gnu.org/licenses/>.
+**********************************************************************/
+
+
+#include <QCoreApplication>
+#include <QMutex>
+#include <QWaitCondition>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "modbustermiosport.h"
+
+#define RUNS 200
+
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        fprintf(stdout, "FAIL %s\n", what);
+        fflush(stdout);
+        failures++;
+    }
+}
+
+// Frames and events of the port, which are emitted on its I/O thread
+class Receiver
+{
+public:
+    QMutex mutex;
+    QWaitCondition changed;
+    QList<QByteArray> frames;
+    qint64 receivedNs;
+    bool deviceLost;
+
+    Receiver() : receivedNs(0), deviceLost(false) {}
+
+    bool waitForFrame(int milliseconds, QByteArray* frame)
+    {
+        QMutexLocker locker(&mutex);
+        qint64 deadline = ModBusTermiosPort::monotonicNs() + milliseconds * 1000000LL;
+        while (frames.isEmpty())
+        {
+            qint64 remaining = (deadline - ModBusTermiosPort::monotonicNs()) / 1000000LL;
+            if (remaining <= 0)
+                return false;
+            changed.wait(&mutex, remaining);
+        }
+        *frame = frames.takeFirst();
+        return true;
+    }
+
+    bool waitForDeviceLost(int milliseconds)
+    {
+        QMutexLocker locker(&mutex);
+        qint64 deadline = ModBusTermiosPort::monotonicNs() + milliseconds * 1000000LL;
+        while (!deviceLost)
+        {
+            qint64 remaining = (deadline - ModBusTermiosPort::monotonicNs()) / 1000000LL;
+            if (remaining <= 0)
+                return false;
+            changed.wait(&mutex, remaining);
+        }
+        return true;
+    }
+};
+
+static bool readMaster(int master, int size, int milliseconds, QByteArray* data)
+{
+    data->clear();
+    while (data->size() < size)
+    {
+        struct pollfd readable;
+        readable.fd = master;
+        readable.events = POLLIN;
+        if (poll(&readable, 1, milliseconds) <= 0)
+            return false;
+        char buffer[256];
+        ssize_t received = read(master, buffer, sizeof(buffer));
+        if (received <= 0)
+            return false;
+        data->append(buffer, received);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        fprintf(stdout, "FAIL No pseudo terminal: %s\n", strerror(errno));
+        return 1;
+    }
+
+    ModBusTermiosPort port(NULL, QString(ptsname(master)));
+    port.setInterFrameGap(1750);
+    check(port.open(19200, QSerialPort::Data8, QSerialPort::EvenParity, QSerialPort::OneStop), "open");
+
+    Receiver receiver;
+    QObject::connect(&port, &ModBusTermiosPort::signal_frameReceived, [&receiver](QByteArray frame, qint64) {
+        QMutexLocker locker(&receiver.mutex);
+        receiver.frames.append(frame);
+        receiver.receivedNs = ModBusTermiosPort::monotonicNs();
+        receiver.changed.wakeAll();
+    });
+    QObject::connect(&port, &ModBusTermiosPort::signal_deviceLost, [&receiver](QString) {
+        QMutexLocker locker(&receiver.mutex);
+        receiver.deviceLost = true;
+        receiver.changed.wakeAll();
+    });
+
+    // Receive: the frame ends one gap after its last byte. The time from writing the last byte
+    // to the frame being handed over is the receive part of the turnaround.
+    const QByteArray request("\x01\x03\x00\x00\x00\x01\x84\x0a", 8);
+    std::vector<qint64> latencies;
+    for (int run = 0; run < RUNS; run++)
+    {
+        qint64 sentNs = ModBusTermiosPort::monotonicNs();
+        if (write(master, request.constData(), request.size()) != request.size())
+        {
+            check(false, "write to master");
+            break;
+        }
+        QByteArray frame;
+        if (!receiver.waitForFrame(1000, &frame))
+        {
+            check(false, "frame received");
+            break;
+        }
+        check(frame == request, "frame content");
+        QMutexLocker locker(&receiver.mutex);
+        latencies.push_back(receiver.receivedNs - sentNs);
+    }
+
+    // Transmit: the frame is written by the I/O thread
+    const QByteArray response("\x01\x03\x02\x12\x34\xb5\x33", 7);
+    port.write(response);
+    QByteArray transmitted;
+    check(readMaster(master, response.size(), 1000, &transmitted) && (transmitted == response), "transmitted frame");
+
+    // Hang up: the port reports the loss and no longer accepts frames
+    close(master);
+    check(receiver.waitForDeviceLost(1000), "device lost reported");
+    check(!port.isOpen(), "closed after hang up");
+    port.close();
+
+    if (!latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+        fprintf(stdout, "Receive turnaround over %i runs, gap 1750 us: median %.3f ms, max %.3f ms\n",
+                (int)latencies.size(), latencies[latencies.size() / 2] / 1e6, latencies.back() / 1e6);
+    }
+    fprintf(stdout, "%s\n", (failures == 0) ? "PASS" : "FAIL");
+    return (failures == 0) ? 0 : 1;
+}